@@ -19,51 +19,363 @@
 #pragma once
 
 #include <nori/mesh.h>
+#include <nori/mmap.h>
+#include <nori/simd.h>
+#include <nori/transform.h>
+#include <tbb/concurrent_vector.h>
+#include <tbb/enumerable_thread_specific.h>
+#include <atomic>
+#include <memory>
 
 NORI_NAMESPACE_BEGIN
 
 static constexpr uint32_t MAX_TRIANGLES_PER_NODE = 15;
 static constexpr uint32_t MAX_RECURSION_DEPTH = 10;
-static constexpr uint32_t MAX_NUM_MESHES = 32;
+
+static constexpr uint32_t BVH_BIN_COUNT = 16;          ///< Candidate split planes per axis are BVH_BIN_COUNT - 1
+static constexpr uint32_t BVH_MAX_TRIANGLES_PER_LEAF = 8;
+static constexpr uint32_t BVH_MAX_DEPTH = 64;          ///< Deeper nodes become leaves regardless of their size
+static constexpr uint32_t TRAVERSAL_STACK_SIZE = 512;  ///< Enough for both hierarchies, see the static_assert in accel.cpp
+static constexpr float SAH_TRAVERSAL_COST = 1.f;       ///< SAH cost of visiting an interior node
+static constexpr float SAH_INTERSECTION_COST = 1.f;    ///< SAH cost of a ray-triangle test
+static constexpr float SBVH_MIN_OVERLAP = 1e-5f;       ///< Spatial splits are tried if object split children overlap more (relative to the root area)
+
+static constexpr uint32_t LBVH_MAX_TRIANGLES_PER_LEAF = 2;       ///< Without triangle groups, which use NORI_SIMD_WIDTH instead
+static constexpr uint32_t LBVH_LONG_CODE_THRESHOLD = 1u << 20;    ///< Meshes with more triangles use 63-bit Morton codes instead of 30 bits
+static constexpr uint32_t LBVH_TASK_DEPTH = 8;                    ///< Treelets are restructured in parallel tasks above this depth
+static constexpr uint32_t TREELET_LEAF_COUNT = 7;                 ///< Subtrees rearranged by one treelet optimization
+
+static constexpr uint32_t BUILD_TASK_THRESHOLD = 4096;            ///< Subtrees with more triangles are built as separate tasks
+static constexpr uint32_t BUILD_PARALLEL_SPLIT_THRESHOLD = 65536; ///< Nodes with more triangles are binned and partitioned in parallel
+static constexpr uint32_t BUILD_GRAIN_SIZE = 4096;                ///< Triangles per work item of the parallel loops
+static constexpr uint32_t REFIT_TASK_DEPTH = 4;                   ///< Wide nodes above this depth refit their children in parallel
+static constexpr uint32_t PACKET_SIZE = 64;                        ///< Maximum number of rays traced together, see Accel::rayIntersectPacket()
+static constexpr uint32_t NODE_LAYOUT_BLOCK_SIZE = 4096;          ///< Bytes of wide nodes per treelet of the treelet layout (one page)
+
+static constexpr uint32_t STATS_CACHE_SIZE = 256 * 1024;          ///< Size of the cache simulated by the traversal statistics
+static constexpr uint32_t STATS_CACHE_WAYS = 8;                   ///< Associativity of the simulated cache, which has 64-byte lines
+
+/**
+ * \brief Traversal counters of the ray queries of one kind
+ *
+ * Every query contributes its counts to a histogram with power-of-two
+ * buckets: bucket 0 holds the queries with a count of zero, bucket i > 0
+ * those with a count in [2^(i-1), 2^i).
+ *
+ * The counters are only collected if nori is compiled with
+ * \c NORI_ACCEL_STATS (the CMake option of the same name), otherwise they
+ * stay empty and the traversal code is unchanged.
+ */
+struct TraversalStatistics {
+    enum ECounter {
+        ENodes = 0,    ///< Interior nodes whose children were tested
+        EBoxes,        ///< Child boxes tested, without the empty slots of wide nodes
+        ETriangles,    ///< Ray-triangle tests, not counting the unused lanes of triangle groups
+        EHits,         ///< Triangles hit, including those replaced by a closer hit later
+        ECacheMisses,  ///< Lines of nodes and leaf primitives that missed a simulated cache, see STATS_CACHE_SIZE
+        ECounterCount
+    };
+
+    static constexpr int HISTOGRAM_SIZE = 33;
+
+    uint64_t queries = 0;
+    uint64_t total[ECounterCount] = { };
+    uint32_t max[ECounterCount] = { };
+    uint64_t histogram[ECounterCount][HISTOGRAM_SIZE] = { };
+
+    /// Add the counts of one query
+    void add(const uint32_t *counts);
+
+    /// Add the queries of another thread
+    void merge(const TraversalStatistics &other);
+
+    /// Return the name of a counter as used in the JSON output
+    static const char *getCounterName(int counter);
+};
 
 /**
  * \brief Acceleration data structure for ray intersection queries
  *
- * The current implementation falls back to a brute force loop
- * through the geometry.
+ * Two hierarchies are available: a bounding volume hierarchy built with the
+ * binned surface area heuristic (the default), and a midpoint octree that
+ * duplicates triangles spanning the split planes. The scene selects one
+ * with its \c accel property (\c "bvh" or \c "octree").
+ *
+ * A linear BVH (\c "lbvh") is also available for fast rebuilds of large
+ * meshes: it sorts the triangles along a Morton curve and splits wherever
+ * the codes change their highest bit. The optional treelet restructuring of
+ * Karras and Aila recovers part of the SAH quality that this loses.
+ *
+ * The SAH BVH can optionally also consider spatial splits (Stich et al.,
+ * "Spatial Splits in Bounding Volume Hierarchies"), which clip the triangles
+ * against the split plane and reference them from both children. They are
+ * only used where the SAH prefers them over the best object split, and the
+ * number of extra references is limited by a budget.
+ *
+ * The binary BVH is collapsed into a wide BVH with \ref NORI_SIMD_WIDTH
+ * children per node after the build, which is then traversed with one SIMD
+ * slab test per node. Its child boxes can optionally be quantized to save
+ * memory bandwidth, see \ref setNodeQuantization().
+ *
+ * Meshes with \ref Instance children are not part of this hierarchy. Each
+ * of them gets its own bottom-level acceleration structure in object space,
+ * and a top-level wide BVH over the world space boxes of all instances
+ * transforms the ray into the space of every instance it reaches.
+ *
+ * Built hierarchies can be kept in a cache directory, see
+ * \ref setCacheDirectory(). Deformed meshes can be updated without a new
+ * build, see \ref refit(). The order of the wide nodes in memory can be
+ * chosen for the locality of incoherent rays, see \ref setNodeLayout().
+ * The quality of the hierarchy and what the ray queries cost can be
+ * inspected with \ref writeStatistics().
  */
 class Accel {
+public:
+    /// Supported hierarchy types
+    enum EType {
+        EBVH = 0,
+        EOctree,
+        ELinearBVH
+    };
+
+    /// Orders of the wide BVH nodes in memory
+    enum ENodeLayout {
+        EDepthFirst = 0,  ///< Every subtree is stored contiguously, children in slot order
+        EVanEmdeBoas,     ///< Recursively split at half the height: the top tree first, then the bottom trees
+        ETreeletClusters  ///< Nodes are grouped into page-sized treelets of the children most likely to be visited
+    };
+
+private:
+    /**
+     * \brief Node of the flattened hierarchy (32 bytes)
+     *
+     * All nodes live in one array. The children of a node are stored next to
+     * each other, and sibling groups are laid out in depth-first order. The
+     * two children of a BVH node therefore share one 64-byte cache line.
+     */
+    struct alignas(32) Node {
+        BoundingBox3f bbox;
+        uint32_t offset = 0;     ///< Index of the first child, or of the first PrimRef of a leaf
+        uint32_t count : 23;     ///< Number of children, or of primitives in a leaf
+        uint32_t flags : 8;      ///< Octree: bit i is set if the children include octant i
+        uint32_t leaf : 1;
+
+        Node() : count(0), flags(0), leaf(1) { }
+    };
+
+    /**
+     * \brief Node of the wide BVH (128 bytes with 4 lanes, 256 with 8)
+     *
+     * The boxes of all children are stored as a structure of arrays so that
+     * a single SIMD slab test covers them. Unused slots hold an empty box
+     * (min at +infinity, max at -infinity) that no ray can hit. The order of
+     * the nodes in the array depends on the node layout, see \ref ENodeLayout.
+     */
+    struct alignas(64) WideNode {
+        float bounds[6][NORI_SIMD_WIDTH];  ///< min x, y, z and max x, y, z of every child
+        uint32_t child[NORI_SIMD_WIDTH];   ///< Index of an interior child, or of the first PrimRef of a leaf
+        uint32_t count[NORI_SIMD_WIDTH];   ///< Number of primitives of a leaf child, 0 for interior children
+    };
+
+    /**
+     * \brief Wide BVH node with quantized child boxes
+     *
+     * The boxes are stored as multiples of a power-of-two step from the
+     * minimum corner of the node, rounded outwards so that they contain the
+     * exact boxes. Empty slots have their minimum above their maximum.
+     * Nodes take 64 bytes with 4 lanes and 8-bit coordinates, 96 bytes
+     * with 16 bits, and 128 or 160 bytes with 8 lanes.
+     */
+    template <typename Q> struct alignas(sizeof(Q) == 1 ? 64 : 32) QuantizedNode {
+        float origin[3];                  ///< Minimum corner of the node
+        int8_t exponent[3];               ///< The step along each axis is 2^exponent
+        Q bounds[6][NORI_SIMD_WIDTH];     ///< min x, y, z and max x, y, z of every child in steps
+        uint32_t child[NORI_SIMD_WIDTH];  ///< Index of an interior child, or of the first PrimRef of a leaf
+        uint16_t count[NORI_SIMD_WIDTH];  ///< Number of primitives of a leaf child, 0 for interior children
+    };
+
+    /// Ray data shared by the slab tests of all nodes during one traversal
+    struct SlabRay {
+        SimdFloat o[3], rcp[3], mint;
+        float scalar_o[3], scalar_rcp[3];
+        int near[3], far[3];  ///< Rows of the node bounds that the ray enters and leaves on every axis
+    };
+
+    /// Reference to a triangle in one of the meshes, stored contiguously for all leaves
+    struct PrimRef {
+        uint32_t mesh;
+        uint32_t triangle;
+    };
+
+    /// Read-only array that points either into a vector of this object or into a mapped cache file
+    template <typename T> struct ArrayView {
+        const T *data = nullptr;
+        size_t size = 0;
+
+        ArrayView() { }
+        ArrayView(const std::vector<T> &vec) : data(vec.data()), size(vec.size()) { }
+        ArrayView(const uint8_t *ptr, size_t size) : data((const T *) ptr), size(size) { }
+
+        const T &operator[](size_t i) const { return data[i]; }
+        const T *begin() const { return data; }
+        const T *end() const { return data + size; }
+        bool empty() const { return size == 0; }
+    };
+
+    /// Instance of a mesh that has its own bottom-level hierarchy
+    struct InstanceRecord {
+        const Accel *blas;
+        const Instance *instance;
+        Transform toObject;      ///< World to object space of the instance
+    };
 
-    struct Node {
-        uint32_t num_triangles = 0;
+    /// Part of a triangle during a spatial split build: the clipped bounds and the index of its PrimRef
+    struct SpatialReference {
         BoundingBox3f bbox;
-        Node* next = nullptr;
-        Node* child = nullptr;
-        uint32_t* triangle_indices = nullptr;
-        uint32_t* mesh_indices = nullptr;
-
-        ~Node() {
-            delete[] triangle_indices;
-            delete[] mesh_indices;
-            delete next;
-            delete child;
-        }
+        uint32_t prim;
+    };
+
+    /**
+     * \brief Up to \ref NORI_SIMD_WIDTH triangles of one leaf, prepared for
+     * a SIMD Moeller-Trumbore test
+     *
+     * Stores the first vertex and both edges of every triangle, so that
+     * nothing has to be gathered through the index buffer during traversal.
+     * Unused lanes have zero edges and are rejected as degenerate.
+     */
+    struct alignas(64) TriangleGroup {
+        float p0[3][NORI_SIMD_WIDTH];
+        float edge1[3][NORI_SIMD_WIDTH];
+        float edge2[3][NORI_SIMD_WIDTH];
+        uint32_t mesh[NORI_SIMD_WIDTH];
+        uint32_t triangle[NORI_SIMD_WIDTH];
     };
 
 public:
-    ~Accel() { delete m_root; }
+    /**
+     * \brief Create an empty acceleration data structure of the given type
+     *
+     * \param precompute
+     *    Store the vertices and edges of all triangles in \ref TriangleGroup
+     *    records that are intersected \ref NORI_SIMD_WIDTH at a time. This
+     *    is faster but needs several times the memory of plain triangle
+     *    references, which read the vertices from the meshes instead.
+     */
+    Accel(EType type = EBVH, bool precompute = true) : m_type(type), m_precompute(precompute) { }
 
     /**
      * \brief Register a triangle mesh for inclusion in the acceleration
      * data structure
      *
+     * Instanced meshes get a bottom-level hierarchy of their own, which
+     * is shared by all of their instances.
+     *
      * This function can only be used before \ref build() is called
      */
     void addMesh(Mesh *mesh);
 
-    /// Build the acceleration data structure (currently a no-op)
+    /// Build the acceleration data structure
     void build();
 
+    /**
+     * \brief Update the hierarchy after vertices were moved with
+     * \ref Mesh::setVertexPositions()
+     *
+     * Keeps the topology and recomputes the bounds of all wide BVH nodes
+     * (and the precomputed triangles) bottom-up, in parallel. This is much
+     * faster than \ref build() but the quality of the hierarchy degrades
+     * as the triangles move away from where they were during the build.
+     * Instanced meshes are refitted as well, and the top level is rebuilt.
+     * The octree cannot be refitted and is rebuilt instead.
+     *
+     * \param rebuild_threshold
+     *    If positive, subtrees whose SAH cost has grown by more than this
+     *    factor since they were built (e.g. 1.5) are rebuilt with the
+     *    binned SAH builder, the highest such subtree in each branch.
+     *
+     * \return The number of rebuilt subtrees
+     */
+    uint32_t refit(float rebuild_threshold = 0.f);
+
+    /// Return the type of the hierarchy
+    EType getType() const { return m_type; }
+
+    /**
+     * \brief Enable the treelet restructuring pass of the linear BVH
+     *
+     * This function can only be used before \ref build() is called
+     */
+    void setTreeletRestructuring(bool enable) { m_treelets = enable; }
+
+    /**
+     * \brief Allow spatial splits in the SAH BVH
+     *
+     * \param budget
+     *    Maximum number of duplicated triangle references relative to the
+     *    number of triangles, e.g. 0.3 for up to 30% more references.
+     *    Zero disables spatial splits.
+     *
+     * This function can only be used before \ref build() is called
+     */
+    void setSpatialSplitBudget(float budget) { m_spatial_budget = budget; }
+
+    /**
+     * \brief Keep built hierarchies in the given directory
+     *
+     * Every hierarchy is written to a file named after a hash of the mesh
+     * contents and the build settings. Later builds of the same meshes map
+     * that file read-only and traverse it in place instead of building.
+     * Files written by a different version or for other meshes are ignored
+     * (and replaced). An empty string disables the cache.
+     *
+     * This function can only be used before \ref build() is called
+     */
+    void setCacheDirectory(const std::string &directory) { m_cache_directory = directory; }
+
+    /**
+     * \brief Store the child boxes of the wide BVH with fewer bits
+     *
+     * \param bits
+     *    8 or 16 bits per box coordinate, or 0 for full precision floats.
+     *    The boxes are rounded outwards, so the queries return the same
+     *    hits, but rays visit slightly more nodes. The octree is not
+     *    affected.
+     *
+     * This function can only be used before \ref build() is called
+     */
+    void setNodeQuantization(int bits) {
+        if (bits != 0 && bits != 8 && bits != 16)
+            throw NoriException("Accel: unsupported node quantization (%i bits)!", bits);
+        m_quantization_bits = (uint32_t) bits;
+    }
+
+    /**
+     * \brief Choose the order of the wide BVH nodes in memory
+     *
+     * The nodes are reordered after the build (and after a \ref refit()
+     * that rebuilds subtrees), which does not change the hierarchy itself
+     * and therefore not the hits, only which nodes share cache lines and
+     * pages. The octree is not affected.
+     *
+     * This function can only be used before \ref build() is called
+     */
+    void setNodeLayout(ENodeLayout layout) { m_node_layout = layout; }
+
+    /// Are leaves stored as precomputed triangle groups?
+    bool isPrecomputed() const { return m_precompute; }
+
+    /**
+     * \brief Return the expected cost of a ray query according to the
+     * surface area heuristic
+     *
+     * Sums \ref SAH_TRAVERSAL_COST over all interior nodes and
+     * \ref SAH_INTERSECTION_COST per triangle (or per triangle group if
+     * they are precomputed) over all leaves, each weighted
+     * by the surface area of the node relative to the root. This makes the
+     * different hierarchy types comparable for the same scene.
+     */
+    float getSAHCost() const;
+
     /// Return an axis-aligned box that bounds the scene
     const BoundingBox3f &getBoundingBox() const { return m_bbox; }
 
@@ -88,19 +400,251 @@ public:
      */
     bool rayIntersect(const Ray3f &ray, Intersection &its, bool shadowRay) const;
 
+    /**
+     * \brief Intersect a packet of coherent rays, e.g. camera rays through
+     * neighbouring pixels
+     *
+     * The rays share one traversal of the wide BVH: every node is fetched
+     * once for the whole packet, children that no ray of the packet can
+     * hit are culled with interval arithmetic on the origins and
+     * directions of all rays, and only the rays that hit a child box visit
+     * that child. The results are the same as those of \ref rayIntersect().
+     *
+     * Rays that do not share the signs of all direction components are
+     * traced one by one, as are rays of the octree.
+     *
+     * The traversal statistics record every ray as a query of its own. A
+     * ray counts the nodes it was active at and the boxes and triangles it
+     * tested; the cache misses of fetching a node go to the lowest ray
+     * that was active at it, since the packet fetches it only once.
+     *
+     * \param count
+     *    Number of rays, larger batches are split into packets of
+     *    \ref PACKET_SIZE rays
+     * \param found
+     *    Receives for every ray whether an intersection was found, in
+     *    which case \c its holds the intersection record
+     */
+    void rayIntersectPacket(uint32_t count, const Ray3f *rays, Intersection *its, bool *found) const;
+
+    /**
+     * \brief Check whether any triangle blocks the ray segment
+     *
+     * This is a separate traversal for shadow rays: children are visited in
+     * storage order without computing the near-to-far order, nothing about
+     * the hit is recorded and the query ends at the first intersection.
+     */
+    bool occluded(const Ray3f &ray) const;
+
+    /**
+     * \brief Return the traversal counters of all threads so far
+     *
+     * \param shadowRay
+     *    Select the queries of \ref occluded() instead of the closest hit
+     *    queries of \ref rayIntersect()
+     */
+    TraversalStatistics getTraversalStatistics(bool shadowRay) const;
+
+    /// Discard the traversal counters collected so far
+    void resetTraversalStatistics() { m_statistics.clear(); }
+
+    /**
+     * \brief Write the quality of the hierarchy and the traversal counters
+     * to a JSON file
+     *
+     * Contains the sizes, the SAH cost and the distribution of the number
+     * of triangles per leaf of this hierarchy and of the bottom-level
+     * hierarchies of instanced meshes, and the traversal histograms of
+     * both query types summed over all threads and for every thread.
+     */
+    void writeStatistics(const std::string &filename) const;
+
 private:
-    Node* buildRecursive(const BoundingBox3f& bbox, std::vector<uint32_t>& triangle_indices,
-            std::vector<uint32_t>& mesh_indices, uint32_t recursion_depth);
-    bool traverseRecursive(const Node& node, Ray3f &ray, Intersection &its, bool shadowRay, uint32_t& hit_idx) const;
+    /// Traversal counters of one thread
+    struct ThreadStatistics {
+        TraversalStatistics closest;
+        TraversalStatistics shadow;
+    };
+
+    /// Nodes during the build, which may be appended to by several tasks at once
+    typedef tbb::concurrent_vector<Node> NodeArray;
+
+    void buildRecursive(NodeArray& nodes, tbb::concurrent_vector<PrimRef>& leaf_prims, uint32_t node_idx,
+            const BoundingBox3f& bbox, std::vector<uint32_t>& prim_indices, const std::vector<PrimRef>& prims,
+            const std::vector<BoundingBox3f>& bounds, uint32_t recursion_depth);
+    /// Build the hierarchy over the meshes of this object (without instances), print statistics if \c verbose
+    void buildHierarchy(bool verbose);
+    /// Hash of the meshes and of all settings that affect the hierarchy
+    uint64_t getCacheKey() const;
+    /// Map a cache file and point the views into it, returns \c false if it is missing or stale
+    bool loadCache(const std::string &filename, uint64_t key);
+    /// Write the built hierarchy to a cache file
+    void writeCache(const std::string &filename, uint64_t key) const;
+    /// Point the views at the arrays of a build
+    void setViews();
+    /// Print the size and SAH cost of the hierarchy
+    void printStatistics() const;
+    /// Write the sizes, SAH cost and leaf occupancy of the hierarchy as the members of a JSON object
+    void writeStructure(std::ostream &os, const std::string &indent) const;
+    /// Add the counters of the query that just finished on this thread to its statistics
+    void recordQuery(bool shadowRay) const;
+    /// Number of wide BVH nodes in whichever format they are stored
+    size_t getWideNodeCount() const {
+        return m_wide_view.size + m_quantized8_view.size + m_quantized16_view.size;
+    }
+    /// Memory used by the wide BVH nodes
+    size_t getWideNodeMemory() const {
+        return m_wide_view.size * sizeof(WideNode) + m_quantized8_view.size * sizeof(QuantizedNode<uint8_t>) +
+               m_quantized16_view.size * sizeof(QuantizedNode<uint16_t>);
+    }
+    /// Store the full precision wide nodes (and their build costs) in the order of \c m_node_layout
+    void reorderNodes();
+    /// Append the nodes of the top \c levels levels below \c node_idx in van Emde Boas order
+    void layoutVanEmdeBoas(uint32_t node_idx, uint32_t levels, std::vector<uint32_t>& order) const;
+    /// Append the nodes exactly \c depth levels below \c node_idx
+    void gatherDescendants(uint32_t node_idx, uint32_t depth, std::vector<uint32_t>& nodes) const;
+    /// Replace the full precision wide nodes by the quantized ones
+    void quantizeNodes();
+    /// Replace the quantized wide nodes by full precision ones
+    void dequantizeNodes();
+    template <typename Q> static void quantizeNode(const WideNode& node, QuantizedNode<Q>& result);
+    template <typename Q> static void dequantizeNode(const QuantizedNode<Q>& node, WideNode& result);
+    /// Build the bottom-level hierarchies of the instanced meshes and the top-level BVH over their instances
+    void buildInstances();
+    /// Build the top-level BVH over the current world space boxes of the instances
+    void buildTopLevel();
+    /// Refit the hierarchy over the meshes of this object, returns the number of rebuilt subtrees
+    uint32_t refitHierarchy(float rebuild_threshold);
+    /// Refit the full precision wide nodes and rebuild degraded subtrees
+    uint32_t refitWideNodes(float rebuild_threshold);
+    /**
+     * \brief Refit the subtree below a wide node and return its bounds
+     *
+     * \c costs receives the SAH cost of every subtree relative to the area
+     * of its root. If \c update is \c false, the costs are only measured
+     * for the current bounds.
+     */
+    BoundingBox3f refitRecursive(uint32_t node_idx, std::vector<float>& costs, bool update, uint32_t depth);
+    /// Recompute the precomputed triangles of a leaf and return their bounds
+    BoundingBox3f refitLeaf(uint32_t offset, uint32_t count);
+    struct Rebuild;
+    /// Append the triangles of all leaves below a wide node to \c prims
+    void gatherPrims(uint32_t node_idx, std::vector<PrimRef>& prims) const;
+    /// Build a new wide subtree over the triangles of subtree \c index of \c rebuild
+    void rebuildSubtree(Rebuild& rebuild, uint32_t index);
+    /**
+     * \brief Copy the subtree below \c node_idx into the new arrays of \c rebuild
+     *
+     * \c subtree selects a rebuilt subtree, or the old hierarchy if it is
+     * -1. Returns the index of the copied node.
+     */
+    uint32_t spliceRecursive(Rebuild& rebuild, uint32_t subtree, uint32_t node_idx);
+    /// Build the subtree over order[begin, end); a leaf refers to its range of \c order
+    void buildBVHRecursive(NodeArray& nodes, uint32_t node_idx, std::vector<uint32_t>& order, uint32_t begin,
+            uint32_t end, const std::vector<BoundingBox3f>& bounds, uint32_t recursion_depth);
+    struct SpatialBuild;
+    /// Build the subtree over \c refs with spatial splits, allowing at most \c budget duplicated references
+    void buildSBVHRecursive(SpatialBuild& build, uint32_t node_idx, std::vector<SpatialReference>& refs,
+            uint32_t budget, uint32_t recursion_depth);
+    /**
+     * \brief Sweep the bins of one axis and return the SAH cost of the best plane
+     *
+     * \c enter_counts and \c exit_counts hold the references starting and
+     * ending in every bin (the same for object splits). Planes that leave one
+     * side empty are skipped, the cost is infinite if there is no valid plane.
+     */
+    float sweepSAH(const BoundingBox3f* bin_bboxes, const uint32_t* enter_counts, const uint32_t* exit_counts,
+            float parent_area, uint32_t& best_bin) const;
+    /// Clip a triangle with the bounds \c bbox against an axis-aligned plane
+    void splitReference(const PrimRef& prim, const BoundingBox3f& bbox, int axis, float position,
+            BoundingBox3f& left, BoundingBox3f& right) const;
+    /// Sort the triangles by Morton code and emit the hierarchy, returns the time spent sorting
+    template <typename Code> double buildLinearBVH(NodeArray& nodes, uint32_t root, std::vector<uint32_t>& order,
+            const std::vector<BoundingBox3f>& bounds);
+    template <typename Code> void emitLinearBVH(NodeArray& nodes, uint32_t node_idx, const std::vector<Code>& codes,
+            uint32_t begin, uint32_t end, const std::vector<uint32_t>& order, const std::vector<BoundingBox3f>& bounds,
+            uint32_t recursion_depth);
+    /// Optimize the treelets of all nodes bottom-up, \c costs receives the SAH cost of every subtree
+    float restructureTreelets(uint32_t node_idx, std::vector<float>& costs, uint32_t recursion_depth);
+    /// Rearrange the treelet below \c root_idx into the topology with the lowest SAH cost
+    void optimizeTreelet(uint32_t root_idx, std::vector<float>& costs);
+    /// Collapse the binary BVH below \c node_idx into wide nodes and return the index of the first one
+    static uint32_t collapseBVH(const std::vector<Node>& nodes, std::vector<WideNode>& wide_nodes, uint32_t node_idx);
+    /// Intersect the meshes of this object with whichever hierarchy was built
+    template <bool ShadowRay> bool traverse(Ray3f &ray, Intersection &its, uint32_t& hit_idx) const;
+    /// Traverse a wide BVH, \c intersect_leaf(offset, count) returns \c true if the leaf was hit
+    template <bool ShadowRay, typename NodeType, typename LeafFunc> bool traverseWide(const NodeType* nodes,
+            Ray3f &ray, const LeafFunc& intersect_leaf) const;
+    /// Traverse a wide BVH with up to \ref PACKET_SIZE rays of the same direction octant
+    template <typename NodeType> void traversePacket(const NodeType* nodes, uint32_t count, Ray3f *rays,
+            Intersection *its, uint32_t *hit_idx, bool *found) const;
+    /// Prepare the slab tests of a ray
+    static void initSlabRay(const Ray3f &ray, SlabRay &slab_ray);
+    /// Load a row of child bounds: the lower bounds of axis k are row k, the upper bounds row k + 3
+    static SimdFloat loadBounds(const WideNode& node, int row);
+    template <typename Q> static SimdFloat loadBounds(const QuantizedNode<Q>& node, int row);
+    /// Compute the distances at which the ray enters and leaves all children of a node
+    template <typename NodeType> static void intersectChildren(const NodeType& node, const SlabRay& ray,
+            float maxt, SimdFloat& near_t, SimdFloat& far_t);
+    template <bool ShadowRay> bool traverseBVH(Ray3f &ray, Intersection &its, uint32_t& hit_idx) const;
+    /// Intersect the instances, \c hit_instance receives the one that was hit last
+    template <bool ShadowRay> bool traverseInstances(Ray3f &ray, Intersection &its, uint32_t& hit_idx,
+            const InstanceRecord*& hit_instance) const;
+    template <bool ShadowRay> bool traverseOctree(Ray3f &ray, Intersection &its, uint32_t& hit_idx) const;
+    /// Intersect the primitives of a leaf, returns \c true if one of them was hit
+    template <bool ShadowRay> bool intersectLeaf(uint32_t offset, uint32_t count, Ray3f &ray, Intersection &its,
+            uint32_t& hit_idx) const;
+    /// Replace the PrimRef ranges of all leaves by ranges of triangle groups
+    void buildTriangleGroups();
+    /// Store up to \ref NORI_SIMD_WIDTH triangles in a group, the remaining lanes are degenerate
+    void fillTriangleGroup(TriangleGroup& group, const PrimRef* prims, uint32_t count) const;
+    /// Return the box of a slot of a wide node
+    static BoundingBox3f getChildBounds(const WideNode& node, uint32_t i) {
+        return BoundingBox3f(Point3f(node.bounds[0][i], node.bounds[1][i], node.bounds[2][i]),
+                             Point3f(node.bounds[3][i], node.bounds[4][i], node.bounds[5][i]));
+    }
+    /// Number of intersection tests needed for a leaf with the given number of triangles
+    uint32_t getLeafTestCount(uint32_t count) const {
+        return m_precompute ? (count + NORI_SIMD_WIDTH - 1) / NORI_SIMD_WIDTH : count;
+    }
     static void subdivideBBox(const BoundingBox3f& parent, BoundingBox3f* bboxes);
 
-    Mesh*         m_meshes[MAX_NUM_MESHES]; ///< Meshes (up to MAX_NUM_MESHES meshes)
+    /// Append a group of sibling nodes and return the index of the first one
+    static uint32_t allocateNodes(NodeArray& nodes, uint32_t count);
+
+    EType         m_type;
+    bool          m_precompute;
+    bool          m_treelets = false;
+    float         m_spatial_budget = 0.f;
+    uint32_t      m_quantization_bits = 0;
+    ENodeLayout   m_node_layout = EDepthFirst;
+
+    std::vector<Mesh *> m_meshes;   ///< Meshes in this hierarchy
+    std::vector<Mesh *> m_instanced_meshes; ///< Meshes that are only present through their instances
     BoundingBox3f m_bbox;           ///< Bounding box of the entire scene
-    Node*         m_root = nullptr; ///< Root node of Octree
-    uint32_t      m_num_meshes = 0; ///< number of meshes in accel
+    std::vector<Node>    m_nodes;   ///< Flattened octree, the root comes first (BVH: only during the build)
+    std::vector<WideNode> m_wide_nodes; ///< Wide BVH, the root comes first
+    std::vector<QuantizedNode<uint8_t>> m_quantized8;   ///< Wide BVH with 8-bit boxes, replaces m_wide_nodes
+    std::vector<QuantizedNode<uint16_t>> m_quantized16; ///< Wide BVH with 16-bit boxes, replaces m_wide_nodes
+    std::vector<PrimRef> m_prims;   ///< Primitives of all leaves (precomputed: only during the build)
+    std::vector<TriangleGroup> m_groups; ///< Precomputed triangles of all leaves
+    std::vector<float> m_build_costs; ///< SAH cost of every wide subtree when it was built, see refit()
+
+    /* The queries only read the hierarchy through these views */
+    ArrayView<Node> m_node_view;
+    ArrayView<WideNode> m_wide_view;
+    ArrayView<QuantizedNode<uint8_t>> m_quantized8_view;
+    ArrayView<QuantizedNode<uint16_t>> m_quantized16_view;
+    ArrayView<PrimRef> m_prim_view;
+    ArrayView<TriangleGroup> m_group_view;
+    std::string   m_cache_directory;
+    std::unique_ptr<MemoryMappedFile> m_cache; ///< Cache file that the views point into, if any
+    std::vector<std::unique_ptr<Accel>> m_blas; ///< Bottom-level hierarchy of every instanced mesh
+    std::vector<InstanceRecord> m_instances;    ///< Instances in the order of the top-level leaves
+    std::vector<WideNode> m_tlas_nodes;         ///< Top-level wide BVH over the instances
 
     // only statistics
-    uint32_t m_num_nonempty_leaf_nodes = 0;
+    mutable tbb::enumerable_thread_specific<ThreadStatistics> m_statistics; ///< Traversal counters of every thread
     uint32_t m_num_leaf_nodes = 0;
     uint32_t m_num_nodes = 0;
     uint32_t m_recursion_depth = 0;
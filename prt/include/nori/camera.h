@@ -57,6 +57,21 @@ public:
         const Point2f &samplePosition,
         const Point2f &apertureSample) const = 0;
 
+    /**
+     * \brief Return the projective transformation from world space to
+     * raster space, if the camera has one
+     *
+     * Multiplying a homogeneous world-space point by this matrix yields
+     * \f$(x w, y w, z w, w)\f$, where \f$(x, y)\f$ is the position on the
+     * film in pixels, \f$z \ge 0\f$ in front of the near clipping plane and
+     * \f$w\f$ is the depth along the viewing direction. This is what the
+     * \ref Rasterizer uses to resolve primary visibility without tracing rays.
+     *
+     * \return \c false if the camera model cannot be expressed as a single
+     *    projective transformation (the default)
+     */
+    virtual bool getWorldToRaster(Eigen::Matrix4f & /* trafo */) const { return false; }
+
     /// Return the size of the output image in pixels
     const Vector2i &getOutputSize() const { return m_outputSize; }
 
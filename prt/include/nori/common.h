@@ -122,7 +122,9 @@ class Bitmap;
 class BlockGenerator;
 class Camera;
 class ImageBlock;
+class Instance;
 class Integrator;
+struct Intersection;
 class KDTree;
 class Emitter;
 struct EmitterQueryRecord;
@@ -187,6 +189,9 @@ extern std::string timeString(double time, bool precise = false);
 /// Convert a memory amount in bytes into a human-readable string
 extern std::string memString(size_t size, bool precise = false);
 
+/// Continue a 64-bit hash that mixes every word with the SplitMix64 finalizer (start with 0xcbf29ce484222325)
+extern uint64_t hashWords(uint64_t hash, const void *data, size_t size);
+
 /// Measures associated with probability distributions
 enum EMeasure {
     EUnknownMeasure = 0,
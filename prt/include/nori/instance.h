@@ -0,0 +1,90 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <nori/object.h>
+#include <nori/transform.h>
+#include <nori/mesh.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Placement of a mesh in the scene
+ *
+ * A mesh with \c <instance> children is not rendered by itself, but once
+ * per instance, each with its own \c toWorld transform. All instances share
+ * the vertices of the mesh and its hierarchy in \ref Accel, so memory grows
+ * with the unique geometry rather than the number of copies:
+ *
+ * \code
+ * <mesh type="obj">
+ *     <string name="filename" value="chair.obj"/>
+ *     <instance>
+ *         <transform name="toWorld"><translate value="1, 0, 0"/></transform>
+ *     </instance>
+ *     <instance>
+ *         <transform name="toWorld"><translate value="3, 0, 0"/></transform>
+ *     </instance>
+ * </mesh>
+ * \endcode
+ *
+ * The \c toWorld transform of the mesh itself is still baked into its
+ * vertices and is applied before that of the instance.
+ */
+class Instance : public NoriObject {
+public:
+    Instance(const PropertyList &propList);
+
+    /// Return the transformation from the space of the mesh to world space
+    const Transform &getTransform() const { return m_toWorld; }
+
+    /// Return the world space bounding box of the instance of \c mesh
+    BoundingBox3f getBoundingBox(const Mesh *mesh) const {
+        const BoundingBox3f &bbox = mesh->getBoundingBox();
+        BoundingBox3f result;
+        for (int i = 0; i < 8; ++i)
+            result.expandBy(m_toWorld * Point3f(bbox.getCorner(i)));
+        return result;
+    }
+
+    /**
+     * \brief Move an intersection record from the space of the mesh
+     * into world space
+     *
+     * Meant for records filled in by \ref Mesh::setHitInformation(). The
+     * distance \c its.t does not change, since rays are transformed without
+     * normalizing their direction.
+     */
+    void transformHit(Intersection &its) const {
+        its.p = m_toWorld * its.p;
+        its.geoFrame = Frame((m_toWorld * Normal3f(its.geoFrame.n)).normalized());
+        its.shFrame = Frame((m_toWorld * Normal3f(its.shFrame.n)).normalized());
+    }
+
+    /// Return a human-readable summary of this instance
+    std::string toString() const;
+
+    EClassType getClassType() const { return EInstance; }
+
+private:
+    Transform m_toWorld;
+};
+
+NORI_NAMESPACE_END
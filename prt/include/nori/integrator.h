@@ -53,6 +53,36 @@ public:
      */
     virtual Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray) const = 0;
 
+    /**
+     * \brief Can the radiance seen by the camera be computed from the first
+     * surface hit alone?
+     *
+     * If so, primary visibility may be resolved by the \ref Rasterizer and
+     * the integrator is invoked through \ref Lo() instead of \ref Li().
+     */
+    virtual bool isRasterizable() const { return false; }
+
+    /**
+     * \brief Is \ref Li() of a camera ray just \ref Lo() at its first
+     * surface hit (and black if the ray escapes)?
+     *
+     * If so, camera rays are traced in coherent packets (see
+     * \ref Accel::rayIntersectPacket()) and shaded through \ref Lo().
+     */
+    virtual bool shadesFirstHit() const { return false; }
+
+    /**
+     * \brief Return the radiance leaving a surface point towards the camera
+     *
+     * Only used when \ref isRasterizable() or \ref shadesFirstHit()
+     * returns \c true. If the intersection record comes from the
+     * rasterizer, \c its.t holds the depth along the viewing direction
+     * rather than a ray distance.
+     */
+    virtual Color3f Lo(const Scene * /* scene */, Sampler * /* sampler */, const Intersection & /* its */) const {
+        return Color3f(0.0f);
+    }
+
     /**
      * \brief Return the type of object (i.e. Mesh/BSDF/etc.) 
      * provided by this instance
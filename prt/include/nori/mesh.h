@@ -80,6 +80,13 @@ struct Intersection {
  */
 class Mesh : public NoriObject {
 public:
+    /// Vertex order of a mesh, see \ref reorder()
+    enum EVertexOrder {
+        EFileOrder = 0,  ///< Order in which the vertices were loaded
+        EMortonOrder,    ///< Along the Morton (Z-order) curve through the bounding box
+        EHilbertOrder    ///< Along the Hilbert curve through the bounding box
+    };
+
     /// Release all memory
     virtual ~Mesh();
 
@@ -131,6 +138,22 @@ public:
      */
     bool rayIntersect(uint32_t index, const Ray3f &ray, float &u, float &v, float &t) const;
 
+    /**
+     * \brief Fill in the detailed intersection record of a hit on a triangle
+     *
+     * Computes the position, texture coordinates, barycentric weights and
+     * the shading and geometry frames of the hit. This is shared by the
+     * ray tracer and the rasterizer.
+     *
+     * \param index
+     *    Index of the triangle that was hit
+     * \param its
+     *    The intersection record. On input, \c its.uv must contain the
+     *    barycentric 'U' and 'V' coordinates of the hit; \c its.t is left
+     *    untouched.
+     */
+    void setHitInformation(uint32_t index, Intersection &its) const;
+
     /// Return a pointer to the vertex positions
     const MatrixXf &getVertexPositions() const { return m_V; }
 
@@ -140,9 +163,39 @@ public:
     /// Return a pointer to the texture coordinates (or \c nullptr if there are none)
     const MatrixXf &getVertexTexCoords() const { return m_UV; }
 
+    /// Return a pointer to the linear RGB vertex colors (or \c nullptr if there are none)
+    const MatrixXf &getVertexColors() const { return m_C; }
+
     /// Return a pointer to the triangle vertex index list
     const MatrixXu &getIndices() const { return m_F; }
 
+    /**
+     * \brief Replace the vertex positions by those of another pose
+     *
+     * The topology is kept, so \c V must hold as many vertices as the
+     * mesh. The vertex normals are only replaced if \c N is given. The
+     * acceleration structure has to be updated afterwards, see
+     * \ref Accel::refit(). The columns follow the vertex order of the
+     * mesh, which differs from the file if the mesh was reordered.
+     */
+    void setVertexPositions(const MatrixXf &V, const MatrixXf &N = MatrixXf());
+
+    /**
+     * \brief Return the index of every loaded vertex in this mesh
+     *
+     * Empty unless the mesh was reordered, see \ref reorder()
+     */
+    const std::vector<uint32_t> &getVertexRemap() const { return m_vertexRemap; }
+
+    /**
+     * \brief Return the index of every loaded triangle in this mesh
+     *
+     * Empty unless the mesh was reordered. Output that other tools pair
+     * with the original file (e.g. the PRT transport export) has to be
+     * written in file order through this table.
+     */
+    const std::vector<uint32_t> &getTriangleRemap() const { return m_triangleRemap; }
+
     /// Is this mesh an area emitter?
     bool isEmitter() const { return m_emitter != nullptr; }
 
@@ -155,7 +208,15 @@ public:
     /// Return a pointer to the BSDF associated with this mesh
     const BSDF *getBSDF() const { return m_bsdf; }
 
-    /// Register a child object (e.g. a BSDF) with the mesh
+    /**
+     * \brief Return the instances of this mesh
+     *
+     * If there are any, the mesh is only rendered through them, see
+     * \ref Instance
+     */
+    const std::vector<Instance *> &getInstances() const { return m_instances; }
+
+    /// Register a child object (e.g. a BSDF or an instance) with the mesh
     virtual void addChild(NoriObject *child);
 
     /// Return the name of this mesh
@@ -174,14 +235,31 @@ protected:
     /// Create an empty mesh
     Mesh();
 
+    /**
+     * \brief Reorder the vertices and triangles for memory locality
+     *
+     * The vertices are sorted along a space-filling curve through the
+     * bounding box, so that nearby vertices (and thus their normals,
+     * colors and baked transport) end up nearby in memory. The triangles
+     * are then put into vertex cache order with the Tipsify algorithm
+     * (Sander et al. 2007), which walks the mesh in fans around the
+     * curve. The corners of every triangle keep their order and all
+     * index buffers are remapped. Does nothing for \ref EFileOrder.
+     */
+    void reorder(EVertexOrder order);
+
 protected:
     std::string m_name;                  ///< Identifying name
     MatrixXf      m_V;                   ///< Vertex positions
     MatrixXf      m_N;                   ///< Vertex normals
     MatrixXf      m_UV;                  ///< Vertex texture coordinates
+    MatrixXf      m_C;                   ///< Vertex colors
     MatrixXu      m_F;                   ///< Faces
     BSDF         *m_bsdf = nullptr;      ///< BSDF of the surface
     Emitter    *m_emitter = nullptr;     ///< Associated emitter, if any
+    std::vector<Instance *> m_instances; ///< Placements of the mesh, if it is instanced
+    std::vector<uint32_t> m_vertexRemap;   ///< New index of every loaded vertex (empty if not reordered)
+    std::vector<uint32_t> m_triangleRemap; ///< New index of every loaded triangle (empty if not reordered)
     BoundingBox3f m_bbox;                ///< Bounding box of the mesh
 };
 
@@ -0,0 +1,85 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <nori/common.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Read-only memory mapping of a file
+ *
+ * Pages are faulted in on demand and can be evicted by the operating
+ * system at any time, which makes this the preferred way of accessing
+ * data that may not fit into memory.
+ */
+class MemoryMappedFile {
+public:
+    /// Map the specified file into memory (throws a \ref NoriException on failure)
+    MemoryMappedFile(const std::string &filename);
+
+    /// Unmap the file
+    ~MemoryMappedFile();
+
+    /// Return a pointer to the start of the mapping
+    const uint8_t *data() const { return m_data; }
+
+    /// Return the size of the mapping in bytes
+    size_t size() const { return m_size; }
+
+    /// Return the name of the mapped file
+    const std::string &getFilename() const { return m_filename; }
+
+private:
+    MemoryMappedFile(const MemoryMappedFile &) = delete;
+    MemoryMappedFile &operator=(const MemoryMappedFile &) = delete;
+
+    std::string m_filename;
+    const uint8_t *m_data = nullptr;
+    size_t m_size = 0;
+#if defined(_WIN32)
+    void *m_file = nullptr;
+    void *m_mapping = nullptr;
+#endif
+};
+
+/**
+ * \brief Exclusively create a new, empty file named after \c filename
+ *
+ * The name is \c filename followed by the process id, a counter and
+ * ".tmp". Creation fails if the file already exists, in which case the
+ * next counter value is tried, so concurrent writers (threads or
+ * processes) never share a file. Writing to the returned file and then
+ * moving it to \c filename with \ref replaceFile() replaces the file atomically.
+ *
+ * \return The name of the created file (throws a \ref NoriException on failure)
+ */
+extern std::string createTemporaryFile(const std::string &filename);
+
+/**
+ * \brief Rename \c source to \c target, replacing \c target if it exists
+ *
+ * Unlike \c std::rename, this also replaces an existing file on Windows
+ * (where it uses \c MoveFileEx with \c MOVEFILE_REPLACE_EXISTING).
+ *
+ * \return \c true on success
+ */
+extern bool replaceFile(const std::string &source, const std::string &target);
+
+NORI_NAMESPACE_END
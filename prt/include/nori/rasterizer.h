@@ -0,0 +1,110 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <nori/vector.h>
+
+NORI_NAMESPACE_BEGIN
+
+/// One pixel of a visibility buffer
+struct VisibilitySample {
+    /// Marks pixels that are not covered by any triangle
+    static constexpr uint32_t Invalid = (uint32_t) -1;
+
+    /// Index of the drawn mesh (one per instance of instanced meshes), or \ref Invalid
+    uint32_t mesh = Invalid;
+    /// Index of the triangle within its mesh
+    uint32_t triangle = Invalid;
+    /// Barycentric 'U' and 'V' coordinates of the pixel center
+    float u = 0.f, v = 0.f;
+
+    bool isValid() const { return mesh != Invalid; }
+};
+
+/**
+ * \brief Tiled CPU rasterizer that resolves primary visibility
+ *
+ * Renders the scene from the camera into a visibility buffer, i.e. the
+ * mesh, triangle and perspective-correct barycentric coordinates of the
+ * closest surface at every pixel center. Integrators that only need the
+ * first hit (see \ref Integrator::isRasterizable()) can shade from this
+ * buffer instead of tracing one camera ray per pixel sample. Each pixel
+ * sample is then shaded at the hit of the pixel that contains it, so the
+ * sample count and reconstruction filter of the scene still apply, but
+ * geometry edges are only resolved at pixel resolution.
+ *
+ * Triangles are clipped against the near plane, binned into screen tiles
+ * and the tiles are then rasterized in parallel with half-space (edge
+ * function) tests. Coverage is inclusive on edges, so shared edges never
+ * leave cracks; the depth test decides between the two triangles.
+ */
+class Rasterizer {
+public:
+    /// Edge length of the screen tiles that are rasterized in parallel
+    static constexpr int TileSize = 64;
+
+    /// Render the visibility buffer of \c scene as seen from its camera
+    void render(const Scene *scene);
+
+    /// Return the size of the visibility buffer in pixels
+    const Vector2i &getSize() const { return m_size; }
+
+    /// Return the visibility sample of a pixel
+    const VisibilitySample &get(int x, int y) const {
+        return m_samples[(size_t) y * m_size.x() + x];
+    }
+
+    /**
+     * \brief Fill in the intersection record of the surface seen through
+     * a pixel center
+     *
+     * \return \c false if the pixel does not cover any triangle
+     */
+    bool getIntersection(int x, int y, Intersection &its) const;
+
+private:
+    /// A triangle after near-plane clipping and projection
+    struct Triangle {
+        /// Barycentric weight i of a pixel center p is a[i] px + b[i] py + c[i],
+        /// with p relative to (ox, oy) to keep the evaluation precise
+        float a[3], b[3], c[3];
+        float ox, oy;
+        float q[3];         ///< Reciprocal depths 1/w
+        float u[3], v[3];   ///< Barycentric coordinates within the mesh triangle
+        uint32_t mesh, index;
+        int xMin, yMin, xMax, yMax;  ///< Covered pixel range (inclusive)
+    };
+
+    void setup(const Vector4f *clip, const Vector2f *bary,
+               uint32_t mesh, uint32_t index, std::vector<Triangle> &out) const;
+    void rasterizeTile(int tile);
+    void resolveTile(int tile);
+
+    Vector2i m_size = Vector2i(0, 0);
+    Vector2i m_tileCount = Vector2i(0, 0);
+    std::vector<const Mesh *> m_meshes;         ///< Every mesh once, or once per instance
+    std::vector<const Instance *> m_instances;  ///< Instance of each entry of m_meshes, or nullptr
+    std::vector<Triangle> m_triangles;
+    std::vector<std::vector<uint32_t>> m_bins;  ///< Triangles overlapping each tile
+    std::vector<float> m_depth;                 ///< Reciprocal depth of the closest hit
+    std::vector<uint32_t> m_ids;                ///< Index into m_triangles of the closest hit
+    std::vector<VisibilitySample> m_samples;
+};
+
+NORI_NAMESPACE_END
@@ -40,6 +40,26 @@ public:
     /// Return a pointer to the scene's kd-tree
     const Accel *getAccel() const { return m_accel; }
 
+    /// Mutable access to the kd-tree, e.g. to rebuild it with another node layout when benchmarking
+    Accel *getAccel() { return m_accel; }
+
+    /**
+     * \brief Update the acceleration structure after meshes were deformed
+     * with \ref Mesh::setVertexPositions(), see \ref Accel::refit()
+     */
+    uint32_t refit(float rebuildThreshold = 0.f) { return m_accel->refit(rebuildThreshold); }
+
+    /**
+     * \brief Write the acceleration structure statistics to the file given
+     * by the \c accelStatistics property, see \ref Accel::writeStatistics()
+     *
+     * Does nothing if the property is not set.
+     */
+    void writeAccelStatistics() const {
+        if (!m_accelStatistics.empty())
+            m_accel->writeStatistics(m_accelStatistics);
+    }
+
     /// Return a pointer to the scene's integrator
     const Integrator *getIntegrator() const { return m_integrator; }
 
@@ -92,8 +112,18 @@ public:
      * \return \c true if an intersection was found
      */
     bool rayIntersect(const Ray3f &ray) const {
-        Intersection its; /* Unused */
-        return m_accel->rayIntersect(ray, its, true);
+        return m_accel->occluded(ray);
+    }
+
+    /**
+     * \brief Intersect a batch of coherent rays, e.g. camera rays of
+     * neighboring pixels
+     *
+     * Equivalent to calling \ref rayIntersect() on every ray, see
+     * \ref Accel::rayIntersectPacket()
+     */
+    void rayIntersectPacket(uint32_t count, const Ray3f *rays, Intersection *its, bool *found) const {
+        m_accel->rayIntersectPacket(count, rays, its, found);
     }
 
     /// \brief Return an axis-aligned box that bounds the scene
@@ -122,6 +152,7 @@ private:
     Sampler *m_sampler = nullptr;
     Camera *m_camera = nullptr;
     Accel *m_accel = nullptr;
+    std::string m_accelStatistics;
 };
 
 NORI_NAMESPACE_END
@@ -0,0 +1,88 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <nori/frame.h>
+#include <nori/bbox.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Orthographic depth map of a scene, rasterized on the CPU
+ *
+ * The map looks at the scene from infinitely far away along a direction
+ * \c d and stores, per texel, the largest projection \f$\langle p, d\rangle\f$
+ * of any surface point. A point is visible from \c d when nothing in its
+ * texel lies further along \c d than the point itself.
+ *
+ * This serves as an alternative visibility backend for the PRT bake: one
+ * map per sample direction resolves the visibility of all vertices at once,
+ * which costs O(K (N + pixels)) instead of one ray traversal per vertex and
+ * direction.
+ */
+class ShadowMap {
+public:
+    /// Allocate a square depth map with the given resolution
+    ShadowMap(int resolution);
+
+    /// Rasterize all meshes of \c scene as seen from direction \c d
+    void render(const Scene *scene, const Vector3f &d);
+
+    /**
+     * \brief Check whether \c p, on a surface with normal \c n, is visible
+     * from the direction of the last \ref render() call
+     *
+     * \param bias
+     *    Depth tolerance in texels, which hides self-shadowing artifacts
+     *    at the cost of light leaking near contact points. It is scaled by
+     *    \f$1 + \tan\theta\f$, where \f$\theta\f$ is the angle between
+     *    \c n and the view direction: the depth of a surface changes by
+     *    \f$\tan\theta\f$ per unit across the map, so grazing surfaces
+     *    need more tolerance than those facing the view
+     */
+    bool isVisible(const Point3f &p, const Vector3f &n, float bias) const {
+        Vector3f local = m_frame.toLocal(p - m_center);
+        int x = (int) ((local.x() + m_radius) * m_scale),
+            y = (int) ((local.y() + m_radius) * m_scale);
+        if (x < 0 || y < 0 || x >= m_resolution || y >= m_resolution)
+            return true;
+        float cosTheta = std::abs(m_frame.n.dot(n)) / n.norm(),
+              tanTheta = std::min(std::sqrt(std::max(1.f - cosTheta * cosTheta, 0.f)) / cosTheta, MaxSlope);
+        return m_depth[y * m_resolution + x] <= local.z() + bias * (1.f + tanTheta) * m_texelSize;
+    }
+
+    /// Return the world-space size of a texel
+    float getTexelSize() const { return m_texelSize; }
+
+private:
+    /// Upper bound of the slope that scales the depth tolerance, reached at about 86 degrees
+    static constexpr float MaxSlope = 16.f;
+
+    void rasterize(const Point3f &p0, const Point3f &p1, const Point3f &p2);
+
+    int m_resolution;
+    Frame m_frame;            ///< Frame whose normal points along the view direction
+    Point3f m_center;         ///< Center of the bounding sphere of the scene
+    float m_radius = 0.f;     ///< Radius of the bounding sphere of the scene
+    float m_scale = 0.f;      ///< Texels per world-space unit
+    float m_texelSize = 0.f;  ///< World-space units per texel
+    std::vector<float> m_depth;
+};
+
+NORI_NAMESPACE_END
@@ -0,0 +1,224 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <nori/common.h>
+#include <sh/spherical_harmonics.h>
+#include <Eigen/Geometry>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Allocation-free rotation of RGB spherical harmonics coefficients
+ *
+ * \c sh::Rotation builds a dense \c Eigen::MatrixXd per band every time a
+ * new rotation is requested, which is far too slow to spin an environment
+ * every frame. This class instead decomposes the rotation into ZYZ Euler
+ * angles, \f$R = R_z(\alpha) R_y(\beta) R_z(\gamma)\f$. Rotations about the
+ * SH polar (z) axis only mix the \f$\pm m\f$ pairs of a band and are applied
+ * in closed form, while the y rotation is expressed as
+ * \f$R_x(-\pi/2) R_z(\beta) R_x(\pi/2)\f$ using a fixed x kernel that is
+ * computed once per order.
+ *
+ * Pure azimuthal rotations (\f$\beta = 0\f$) skip the kernels entirely.
+ * Spins about the y axis (the up axis of the scenes) by many angles share
+ * their first kernel pass, see \ref prepareY() and \ref applyY().
+ *
+ * \tparam Order The SH order (band count minus one)
+ */
+template <int Order> class SHRotation {
+public:
+    static constexpr int CoeffCount = (Order + 1) * (Order + 1);
+
+    /// RGB coefficients, laid out like \c PRTIntegrator::m_LightCoeffs
+    typedef Eigen::Matrix<float, 3, CoeffCount> Coeffs;
+
+    /// Create the identity rotation
+    SHRotation() : m_kernel(&getKernel()) { setEulerZYZ(0.f, 0.f, 0.f); }
+
+    /// Create a rotation from ZYZ Euler angles (in radians)
+    SHRotation(float alpha, float beta, float gamma) : m_kernel(&getKernel()) {
+        setEulerZYZ(alpha, beta, gamma);
+    }
+
+    /// Create a rotation from an arbitrary rotation matrix
+    explicit SHRotation(const Eigen::Matrix3f &rotation) : m_kernel(&getKernel()) {
+        setMatrix(rotation);
+    }
+
+    /// Set the rotation from ZYZ Euler angles (in radians)
+    void setEulerZYZ(float alpha, float beta, float gamma) {
+        m_zonal = beta == 0.f;
+        if (m_zonal) {
+            /* Both z rotations collapse into a single one */
+            setZ(m_alpha, alpha + gamma);
+        } else {
+            setZ(m_alpha, alpha);
+            setZ(m_beta, beta);
+            setZ(m_gamma, gamma);
+        }
+    }
+
+    /// Set the rotation from a rotation matrix by decomposing it into ZYZ angles
+    void setMatrix(const Eigen::Matrix3f &R) {
+        float beta = std::acos(clamp(R(2, 2), -1.f, 1.f));
+        float sinBeta = std::sin(beta);
+        if (sinBeta < 1e-6f) {
+            /* Gimbal lock: fold everything into the first z rotation */
+            if (R(2, 2) > 0)
+                setEulerZYZ(std::atan2(R(1, 0), R(0, 0)), 0.f, 0.f);
+            else
+                setEulerZYZ(std::atan2(-R(1, 0), -R(0, 0)), M_PI, 0.f);
+        } else {
+            setEulerZYZ(std::atan2(R(1, 2), R(0, 2)), beta,
+                        std::atan2(R(2, 1), -R(2, 0)));
+        }
+    }
+
+    /// Rotate the coefficients in place
+    void apply(Coeffs &c) const {
+        if (m_zonal) {
+            applyZ(m_alpha, c);
+            return;
+        }
+        applyZ(m_gamma, c);
+        applyX(c, false);
+        applyZ(m_beta, c);
+        applyX(c, true);
+        applyZ(m_alpha, c);
+    }
+
+    /// Rotate \c in and store the result in \c out
+    void apply(const Coeffs &in, Coeffs &out) const {
+        out = in;
+        apply(out);
+    }
+
+    /**
+     * \brief Prepare coefficients for rotations about the y axis
+     *
+     * A rotation about y by \f$\theta\f$ is
+     * \f$R_x(-\pi/2) R_z(\theta) R_x(\pi/2)\f$. The first x kernel pass does
+     * not depend on the angle, so it is applied to \c in once here.
+     */
+    void prepareY(const Coeffs &in, Coeffs &out) const {
+        out = in;
+        applyX(out, false);
+    }
+
+    /**
+     * \brief Rotate coefficients returned by \ref prepareY() about the y
+     * axis by \c angle (in radians) and store the result in \c out
+     *
+     * Costs one z rotation and one x kernel pass. The rotation set on this
+     * instance is not used.
+     */
+    void applyY(const Coeffs &prepared, float angle, Coeffs &out) const {
+        ZTable table;
+        setZ(table, angle);
+        out = prepared;
+        applyZ(table, out);
+        applyX(out, true);
+    }
+
+private:
+    /// Number of entries in all band matrices of the x kernel
+    static constexpr int KernelSize = (Order + 1) * (2 * Order + 1) * (2 * Order + 3) / 3;
+
+    /// cos(m * angle) and sin(m * angle) for m = 1..Order
+    struct ZTable {
+        float cosine[Order + 1];
+        float sine[Order + 1];
+    };
+
+    /// Band matrices of a +90 degree rotation about the x axis
+    struct Kernel {
+        float entries[KernelSize];
+
+        Kernel() {
+            std::unique_ptr<sh::Rotation> rot = sh::Rotation::Create(Order,
+                Eigen::Quaterniond(Eigen::AngleAxisd(M_PI / 2, Eigen::Vector3d::UnitX())));
+            int offset = 0;
+            for (int l = 0; l <= Order; ++l) {
+                const Eigen::MatrixXd &band = rot->band_rotation(l);
+                for (int i = 0; i < 2 * l + 1; ++i)
+                    for (int j = 0; j < 2 * l + 1; ++j)
+                        entries[offset++] = (float) band(i, j);
+            }
+        }
+    };
+
+    /// The x kernel only depends on the order and is shared by all instances
+    static const Kernel &getKernel() {
+        static const Kernel kernel;
+        return kernel;
+    }
+
+    static void setZ(ZTable &table, float angle) {
+        for (int m = 0; m <= Order; ++m) {
+            table.sine[m] = std::sin(m * angle);
+            table.cosine[m] = std::cos(m * angle);
+        }
+    }
+
+    /// Rotate about the z axis: only the (m, -m) pairs of each band interact
+    static void applyZ(const ZTable &table, Coeffs &c) {
+        for (int l = 1; l <= Order; ++l) {
+            int center = l * (l + 1);
+            for (int m = 1; m <= l; ++m) {
+                float cosine = table.cosine[m], sine = table.sine[m];
+                for (int ch = 0; ch < 3; ++ch) {
+                    float pos = c(ch, center + m), neg = c(ch, center - m);
+                    c(ch, center + m) = cosine * pos - sine * neg;
+                    c(ch, center - m) = sine * pos + cosine * neg;
+                }
+            }
+        }
+    }
+
+    /// Rotate about the x axis by +90 degrees (or -90 using the transpose)
+    void applyX(Coeffs &c, bool inverse) const {
+        const float *band = m_kernel->entries + 1;
+        for (int l = 1; l <= Order; ++l) {
+            const int size = 2 * l + 1, center = l * (l + 1);
+            float tmp[3][2 * Order + 1];
+            for (int i = 0; i < size; ++i) {
+                float r = 0.f, g = 0.f, b = 0.f;
+                for (int j = 0; j < size; ++j) {
+                    float k = inverse ? band[j * size + i] : band[i * size + j];
+                    int col = center - l + j;
+                    r += k * c(0, col);
+                    g += k * c(1, col);
+                    b += k * c(2, col);
+                }
+                tmp[0][i] = r; tmp[1][i] = g; tmp[2][i] = b;
+            }
+            for (int i = 0; i < size; ++i)
+                for (int ch = 0; ch < 3; ++ch)
+                    c(ch, center - l + i) = tmp[ch][i];
+            band += size * size;
+        }
+    }
+
+    const Kernel *m_kernel;
+    ZTable m_alpha, m_beta, m_gamma;
+    bool m_zonal;
+};
+
+NORI_NAMESPACE_END
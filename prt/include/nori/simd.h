@@ -0,0 +1,214 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <nori/common.h>
+#include <cstring>
+
+/*
+ * Lane count of \ref SimdFloat and of the wide BVH nodes. It follows the
+ * instruction set the compiler targets: 8 lanes with AVX2, 4 lanes with SSE2
+ * (always present on x86-64), and 4 lanes of plain scalar code everywhere
+ * else or when NORI_NO_SIMD is defined. The CMake option NORI_SIMD selects the target.
+ */
+#if !defined(NORI_NO_SIMD) && defined(__AVX2__)
+#  include <immintrin.h>
+#  define NORI_SIMD_AVX2 1
+#  define NORI_SIMD_WIDTH 8
+#elif !defined(NORI_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#  include <emmintrin.h>
+#  define NORI_SIMD_SSE2 1
+#  define NORI_SIMD_WIDTH 4
+#else
+#  define NORI_SIMD_WIDTH 4
+#endif
+
+#if defined(_MSC_VER)
+#  include <intrin.h>
+#endif
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Lane mask produced by comparing two \ref SimdFloat values
+ */
+struct SimdMask {
+#if defined(NORI_SIMD_AVX2)
+    __m256 m;
+
+    SimdMask(__m256 m) : m(m) { }
+    SimdMask operator&(const SimdMask &o) const { return _mm256_and_ps(m, o.m); }
+    SimdMask operator|(const SimdMask &o) const { return _mm256_or_ps(m, o.m); }
+    /// Bit i of the result is set if lane i is active
+    int bits() const { return _mm256_movemask_ps(m); }
+#elif defined(NORI_SIMD_SSE2)
+    __m128 m;
+
+    SimdMask(__m128 m) : m(m) { }
+    SimdMask operator&(const SimdMask &o) const { return _mm_and_ps(m, o.m); }
+    SimdMask operator|(const SimdMask &o) const { return _mm_or_ps(m, o.m); }
+    int bits() const { return _mm_movemask_ps(m); }
+#else
+    bool m[NORI_SIMD_WIDTH];
+
+    SimdMask operator&(const SimdMask &o) const {
+        SimdMask r;
+        for (int i = 0; i < NORI_SIMD_WIDTH; ++i)
+            r.m[i] = m[i] && o.m[i];
+        return r;
+    }
+    SimdMask operator|(const SimdMask &o) const {
+        SimdMask r;
+        for (int i = 0; i < NORI_SIMD_WIDTH; ++i)
+            r.m[i] = m[i] || o.m[i];
+        return r;
+    }
+    int bits() const {
+        int r = 0;
+        for (int i = 0; i < NORI_SIMD_WIDTH; ++i)
+            r |= m[i] ? (1 << i) : 0;
+        return r;
+    }
+#endif
+};
+
+/**
+ * \brief \ref NORI_SIMD_WIDTH single precision floats processed in lockstep
+ *
+ * Only the handful of operations needed by the rasterizer and the ray
+ * tracing kernels are provided. \ref min() and \ref max() follow the SSE
+ * convention and return the second argument when either one is NaN.
+ */
+struct SimdFloat {
+    static constexpr int Size = NORI_SIMD_WIDTH;
+
+#if defined(NORI_SIMD_AVX2)
+    __m256 v;
+
+    SimdFloat() { }
+    SimdFloat(__m256 v) : v(v) { }
+    explicit SimdFloat(float f) : v(_mm256_set1_ps(f)) { }
+
+    /// Load from a 32-byte aligned array
+    static SimdFloat load(const float *p) { return _mm256_load_ps(p); }
+    /// Load and convert unsigned integers (no alignment required)
+    static SimdFloat load(const uint8_t *p) {
+        return _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) p)));
+    }
+    static SimdFloat load(const uint16_t *p) {
+        return _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *) p)));
+    }
+    void store(float *p) const { _mm256_store_ps(p, v); }
+
+    SimdFloat operator+(const SimdFloat &o) const { return _mm256_add_ps(v, o.v); }
+    SimdFloat operator-(const SimdFloat &o) const { return _mm256_sub_ps(v, o.v); }
+    SimdFloat operator*(const SimdFloat &o) const { return _mm256_mul_ps(v, o.v); }
+    SimdFloat operator/(const SimdFloat &o) const { return _mm256_div_ps(v, o.v); }
+    SimdMask operator<(const SimdFloat &o) const { return _mm256_cmp_ps(v, o.v, _CMP_LT_OQ); }
+    SimdMask operator<=(const SimdFloat &o) const { return _mm256_cmp_ps(v, o.v, _CMP_LE_OQ); }
+    SimdMask operator>=(const SimdFloat &o) const { return _mm256_cmp_ps(v, o.v, _CMP_GE_OQ); }
+
+    friend SimdFloat min(const SimdFloat &a, const SimdFloat &b) { return _mm256_min_ps(a.v, b.v); }
+    friend SimdFloat max(const SimdFloat &a, const SimdFloat &b) { return _mm256_max_ps(a.v, b.v); }
+#elif defined(NORI_SIMD_SSE2)
+    __m128 v;
+
+    SimdFloat() { }
+    SimdFloat(__m128 v) : v(v) { }
+    explicit SimdFloat(float f) : v(_mm_set1_ps(f)) { }
+
+    /// Load from a 16-byte aligned array
+    static SimdFloat load(const float *p) { return _mm_load_ps(p); }
+    /// Load and convert unsigned integers (no alignment required)
+    static SimdFloat load(const uint8_t *p) {
+        int32_t bytes;
+        memcpy(&bytes, p, sizeof(bytes));
+        __m128i zero = _mm_setzero_si128();
+        return _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(bytes), zero), zero));
+    }
+    static SimdFloat load(const uint16_t *p) {
+        return _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i *) p), _mm_setzero_si128()));
+    }
+    void store(float *p) const { _mm_store_ps(p, v); }
+
+    SimdFloat operator+(const SimdFloat &o) const { return _mm_add_ps(v, o.v); }
+    SimdFloat operator-(const SimdFloat &o) const { return _mm_sub_ps(v, o.v); }
+    SimdFloat operator*(const SimdFloat &o) const { return _mm_mul_ps(v, o.v); }
+    SimdFloat operator/(const SimdFloat &o) const { return _mm_div_ps(v, o.v); }
+    SimdMask operator<(const SimdFloat &o) const { return _mm_cmplt_ps(v, o.v); }
+    SimdMask operator<=(const SimdFloat &o) const { return _mm_cmple_ps(v, o.v); }
+    SimdMask operator>=(const SimdFloat &o) const { return _mm_cmpge_ps(v, o.v); }
+
+    friend SimdFloat min(const SimdFloat &a, const SimdFloat &b) { return _mm_min_ps(a.v, b.v); }
+    friend SimdFloat max(const SimdFloat &a, const SimdFloat &b) { return _mm_max_ps(a.v, b.v); }
+#else
+    float v[Size];
+
+    SimdFloat() { }
+    explicit SimdFloat(float f) {
+        for (int i = 0; i < Size; ++i)
+            v[i] = f;
+    }
+
+    template <typename T> static SimdFloat load(const T *p) {
+        SimdFloat r;
+        for (int i = 0; i < Size; ++i)
+            r.v[i] = (float) p[i];
+        return r;
+    }
+    void store(float *p) const {
+        for (int i = 0; i < Size; ++i)
+            p[i] = v[i];
+    }
+
+    SimdFloat operator+(const SimdFloat &o) const { SimdFloat r; for (int i = 0; i < Size; ++i) r.v[i] = v[i] + o.v[i]; return r; }
+    SimdFloat operator-(const SimdFloat &o) const { SimdFloat r; for (int i = 0; i < Size; ++i) r.v[i] = v[i] - o.v[i]; return r; }
+    SimdFloat operator*(const SimdFloat &o) const { SimdFloat r; for (int i = 0; i < Size; ++i) r.v[i] = v[i] * o.v[i]; return r; }
+    SimdFloat operator/(const SimdFloat &o) const { SimdFloat r; for (int i = 0; i < Size; ++i) r.v[i] = v[i] / o.v[i]; return r; }
+    SimdMask operator<(const SimdFloat &o) const { SimdMask r; for (int i = 0; i < Size; ++i) r.m[i] = v[i] < o.v[i]; return r; }
+    SimdMask operator<=(const SimdFloat &o) const { SimdMask r; for (int i = 0; i < Size; ++i) r.m[i] = v[i] <= o.v[i]; return r; }
+    SimdMask operator>=(const SimdFloat &o) const { SimdMask r; for (int i = 0; i < Size; ++i) r.m[i] = v[i] >= o.v[i]; return r; }
+
+    friend SimdFloat min(const SimdFloat &a, const SimdFloat &b) {
+        SimdFloat r;
+        for (int i = 0; i < Size; ++i)
+            r.v[i] = a.v[i] < b.v[i] ? a.v[i] : b.v[i];
+        return r;
+    }
+    friend SimdFloat max(const SimdFloat &a, const SimdFloat &b) {
+        SimdFloat r;
+        for (int i = 0; i < Size; ++i)
+            r.v[i] = a.v[i] > b.v[i] ? a.v[i] : b.v[i];
+        return r;
+    }
+#endif
+};
+
+/// Index of the lowest set bit of a non-zero lane mask
+inline int lowestLane(int bits) {
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward(&index, (unsigned long) bits);
+    return (int) index;
+#else
+    return __builtin_ctz((unsigned int) bits);
+#endif
+}
+
+NORI_NAMESPACE_END
@@ -17,66 +17,988 @@
 */
 
 #include <nori/accel.h>
+#include <nori/instance.h>
+#include <nori/timer.h>
+#include <filesystem/path.h>
 #include <Eigen/Geometry>
-#include <chrono>
-
-using namespace std::chrono;
+#include <tbb/parallel_for.h>
+#include <tbb/parallel_invoke.h>
+#include <tbb/parallel_reduce.h>
+#include <tbb/blocked_range.h>
+#include <tbb/task_group.h>
+#include <bitset>
+#include <fstream>
 
 NORI_NAMESPACE_BEGIN
 
+/* Every level adds at most NORI_SIMD_WIDTH - 1 entries to the BVH stack, and up to 7 to the octree stack */
+static_assert(TRAVERSAL_STACK_SIZE >= BVH_MAX_DEPTH * (NORI_SIMD_WIDTH - 1) + 1 &&
+              TRAVERSAL_STACK_SIZE >= 7 * MAX_RECURSION_DEPTH + 1, "Traversal stack is too small");
+
+#if defined(NORI_ACCEL_STATS)
+/// Counters of the query that the current thread is running, see Accel::recordQuery()
+static thread_local uint32_t query_counters[TraversalStatistics::ECounterCount];
+#define NORI_ACCEL_COUNT(counter, n) (query_counters[TraversalStatistics::counter] += (uint32_t) (n))
+/// Counters of every ray of the packet that the current thread is tracing, see Accel::rayIntersectPacket()
+static thread_local uint32_t packet_counters[PACKET_SIZE][TraversalStatistics::ECounterCount];
+#define NORI_ACCEL_COUNT_RAY(ray, counter, n) (packet_counters[ray][TraversalStatistics::counter] += (uint32_t) (n))
+
+/// Move what the current query counted so far to a ray of the packet
+static inline void moveQueryCounters(uint32_t ray) {
+    for (int k = 0; k < TraversalStatistics::ECounterCount; k++) {
+        packet_counters[ray][k] += query_counters[k];
+        query_counters[k] = 0;
+    }
+}
+#define NORI_ACCEL_MOVE_COUNTS(ray) moveQueryCounters(ray)
+
+/// Set-associative cache with LRU replacement that only counts the misses of the traversal of one thread
+struct SimulatedCache {
+    static constexpr uint32_t SET_COUNT = STATS_CACHE_SIZE / (64 * STATS_CACHE_WAYS);
+    uint64_t lines[SET_COUNT][STATS_CACHE_WAYS] = { };  ///< Line address plus one (zero if empty), most recent first
+
+    /// Read the lines of an object and return how many of them missed
+    uint32_t access(const void *ptr, size_t size) {
+        uint32_t misses = 0;
+        uint64_t first = (uint64_t) (uintptr_t) ptr / 64, last = ((uint64_t) (uintptr_t) ptr + size - 1) / 64;
+        for (uint64_t line = first; line <= last; line++) {
+            uint64_t *set = lines[line % SET_COUNT];
+            uint32_t way = 0;
+            while (way < STATS_CACHE_WAYS - 1 && set[way] != line + 1)
+                way++;
+            if (set[way] != line + 1)
+                misses++;
+            // the line moves to the front, on a miss the least recently used one drops out
+            for (; way > 0; way--)
+                set[way] = set[way - 1];
+            set[0] = line + 1;
+        }
+        return misses;
+    }
+};
+static thread_local SimulatedCache simulated_cache;
+#else
+#define NORI_ACCEL_COUNT(counter, n) ((void) 0)
+#define NORI_ACCEL_COUNT_RAY(ray, counter, n) ((void) 0)
+#define NORI_ACCEL_MOVE_COUNTS(ray) ((void) 0)
+#endif
+
+/// State shared by all tasks of a spatial split BVH build
+struct Accel::SpatialBuild {
+    NodeArray& nodes;
+    const std::vector<PrimRef>& prims;
+    tbb::concurrent_vector<PrimRef> leaf_prims;
+    float root_area;
+    std::atomic<uint32_t> num_splits;
+
+    SpatialBuild(NodeArray& nodes, const std::vector<PrimRef>& prims, float root_area)
+        : nodes(nodes), prims(prims), root_area(root_area), num_splits(0) { }
+};
+
+/// Subtrees of a refitted BVH that are rebuilt, and the arrays that the new hierarchy is copied into
+struct Accel::Rebuild {
+    struct Subtree {
+        uint32_t root;                ///< Wide node that is replaced
+        uint32_t depth;               ///< Its depth in the wide BVH
+        std::vector<PrimRef> prims;   ///< Triangles in leaf order
+        std::vector<WideNode> nodes;  ///< New wide nodes, leaves refer to ranges of prims
+    };
+    std::vector<Subtree> subtrees;
+    std::vector<uint32_t> replaced;   ///< Subtree that replaces every old wide node, or -1
+
+    std::vector<WideNode> nodes;
+    std::vector<PrimRef> prims;
+    std::vector<TriangleGroup> groups;
+    std::vector<float> build_costs;   ///< Costs of the kept nodes, NaN for the new ones
+};
+
 void Accel::addMesh(Mesh *mesh) {
-    if (m_num_meshes >= MAX_NUM_MESHES)
-        throw NoriException("Accel: only %d meshes are supported!", MAX_NUM_MESHES);
-    m_meshes[m_num_meshes] = mesh;
+    if (!mesh->getInstances().empty()) {
+        // the world space bounds are only known once the instances are placed in build()
+        m_instanced_meshes.push_back(mesh);
+        return;
+    }
+    m_meshes.push_back(mesh);
     m_bbox.expandBy(mesh->getBoundingBox());
-    m_num_meshes++;
 }
 
 void Accel::build() {
-    if (m_num_meshes == 0)
+    if (m_meshes.empty() && m_instanced_meshes.empty())
         throw NoriException("No mesh found, could not build acceleration structure");
 
-    auto start = high_resolution_clock::now();
+    if (!m_meshes.empty())
+        buildHierarchy(true);
+    buildInstances();
+}
+
+void Accel::buildHierarchy(bool verbose) {
+    Timer total_timer, timer;
     // delete old hierarchy if present
-    delete m_root;
+    m_nodes.clear();
+    m_wide_nodes.clear();
+    m_quantized8.clear();
+    m_quantized16.clear();
+    m_prims.clear();
+    m_groups.clear();
+    m_build_costs.clear();
+    m_num_leaf_nodes = m_num_nodes = 0;
+    m_recursion_depth = m_num_triangles_saved = 0;
+    m_cache.reset();
+
+    const char *names[] = { "BVH", "Octree", "Linear BVH" };
+    std::string cache_file;
+    uint64_t key = 0;
+    if (!m_cache_directory.empty()) {
+        key = getCacheKey();
+        cache_file = tfm::format("%s/%016x.nbvh", m_cache_directory, key);
+        if (loadCache(cache_file, key)) {
+            if (verbose) {
+                printf("%s loaded from \"%s\" in %s\n", names[m_type], cache_file.c_str(),
+                       total_timer.elapsedString().c_str());
+                printStatistics();
+            }
+            return;
+        }
+    }
 
     uint32_t num_triangles = 0;
-    for (uint32_t mesh_idx = 0; mesh_idx < m_num_meshes; mesh_idx++) {
+    for (uint32_t mesh_idx = 0; mesh_idx < (uint32_t) m_meshes.size(); mesh_idx++) {
         num_triangles += m_meshes[mesh_idx]->getTriangleCount();
     }
 
-    std::vector<uint32_t> triangles(num_triangles);
-    std::vector<uint32_t> mesh_indices(num_triangles);
+    /* Bounds are computed once; the builds only permute indices into these arrays */
+    std::vector<PrimRef> prims(num_triangles);
+    std::vector<BoundingBox3f> bounds(num_triangles);
     uint32_t offset = 0;
+    for (uint32_t current_mesh_idx = 0; current_mesh_idx < (uint32_t) m_meshes.size(); current_mesh_idx++) {
+        const Mesh* mesh = m_meshes[current_mesh_idx];
+        tbb::parallel_for(tbb::blocked_range<uint32_t>(0, mesh->getTriangleCount(), BUILD_GRAIN_SIZE),
+            [&](const tbb::blocked_range<uint32_t> &range) {
+                for (uint32_t i = range.begin(); i != range.end(); ++i) {
+                    prims[offset + i] = PrimRef{ current_mesh_idx, i };
+                    bounds[offset + i] = mesh->getBoundingBox(i);
+                }
+            }
+        );
+        offset += mesh->getTriangleCount();
+    }
+    double bounds_time = timer.lap();
 
-    for (uint32_t current_mesh_idx = 0; current_mesh_idx < m_num_meshes; current_mesh_idx++) {
-        uint32_t num_triangles_mesh = m_meshes[current_mesh_idx]->getTriangleCount();
-        for (uint32_t i = 0; i < num_triangles_mesh; i++) {
-            triangles[offset + i] = i;
-            mesh_indices[offset + i] = current_mesh_idx;
+    NodeArray nodes;
+    uint32_t root = allocateNodes(nodes, 1);
+    std::vector<uint32_t> order(num_triangles);
+    for (uint32_t i = 0; i < num_triangles; i++)
+        order[i] = i;
+
+    double sort_time = 0.0;
+    bool spatial = m_type == EBVH && m_spatial_budget > 0.f;
+    uint32_t num_spatial_splits = 0;
+    if (spatial) {
+        // references are clipped against the split planes, so leaves collect copies of the primitives
+        std::vector<SpatialReference> refs(num_triangles);
+        for (uint32_t i = 0; i < num_triangles; i++)
+            refs[i] = SpatialReference{ bounds[i], i };
+        SpatialBuild state(nodes, prims, m_bbox.getSurfaceArea());
+        buildSBVHRecursive(state, root, refs, (uint32_t) (m_spatial_budget * num_triangles), 0);
+        m_prims.assign(state.leaf_prims.begin(), state.leaf_prims.end());
+        num_spatial_splits = state.num_splits;
+    } else if (m_type != EOctree) {
+        // leaves refer to their range of 'order', which becomes the primitive list
+        if (m_type == EBVH)
+            buildBVHRecursive(nodes, root, order, 0, num_triangles, bounds, 0);
+        else if (num_triangles < LBVH_LONG_CODE_THRESHOLD)
+            sort_time = buildLinearBVH<uint32_t>(nodes, root, order, bounds);
+        else
+            sort_time = buildLinearBVH<uint64_t>(nodes, root, order, bounds);
+        m_prims.resize(num_triangles);
+        tbb::parallel_for(tbb::blocked_range<uint32_t>(0, num_triangles, BUILD_GRAIN_SIZE),
+            [&](const tbb::blocked_range<uint32_t> &range) {
+                for (uint32_t i = range.begin(); i != range.end(); ++i)
+                    m_prims[i] = prims[order[i]];
+            }
+        );
+    } else {
+        tbb::concurrent_vector<PrimRef> leaf_prims;
+        buildRecursive(nodes, leaf_prims, root, m_bbox, order, prims, bounds, 0);
+        m_prims.assign(leaf_prims.begin(), leaf_prims.end());
+    }
+    m_nodes.assign(nodes.begin(), nodes.end());
+    m_num_nodes = (uint32_t) m_nodes.size();
+    m_num_triangles_saved = (uint32_t) m_prims.size();
+    double hierarchy_time = timer.lap() - sort_time;
+
+    bool treelets = m_type == ELinearBVH && m_treelets;
+    if (treelets) {
+        std::vector<float> costs(m_nodes.size());
+        restructureTreelets(root, costs, 0);
+    }
+    double treelet_time = timer.lap();
+
+    // statistics, the tasks of the build do not keep track of them
+    std::vector<std::pair<uint32_t, uint32_t>> stack{ { root, 0 } };
+    while (!stack.empty()) {
+        std::pair<uint32_t, uint32_t> entry = stack.back();
+        stack.pop_back();
+        const Node& node = m_nodes[entry.first];
+        m_recursion_depth = std::max(m_recursion_depth, entry.second);
+        if (node.leaf) {
+            m_num_leaf_nodes++;
+            continue;
         }
-        offset += num_triangles_mesh;
+        for (uint32_t i = 0; i < node.count; i++)
+            stack.emplace_back(node.offset + i, entry.second + 1);
     }
+    timer.reset();
+
+    if (m_precompute)
+        buildTriangleGroups();
+    double groups_time = timer.lap();
 
-    m_root = buildRecursive(m_bbox, triangles, mesh_indices, 0);
-    printf("Octree build time: %ldms \n", duration_cast<milliseconds>(high_resolution_clock::now() - start).count());
-    printf("Num nodes: %d \n", m_num_nodes);
+    if (m_type != EOctree) {
+        // the binary nodes are only needed to build the wide BVH
+        collapseBVH(m_nodes, m_wide_nodes, root);
+        m_nodes = std::vector<Node>();
+    }
+    double collapse_time = timer.lap();
+    if (m_type != EOctree)
+        reorderNodes();
+    double layout_time = timer.lap();
+    bool quantize = m_type != EOctree && m_quantization_bits > 0;
+    if (quantize)
+        quantizeNodes();
+    double quantize_time = timer.lap();
+    setViews();
+    if (!cache_file.empty())
+        writeCache(cache_file, key);
+    if (!verbose)
+        return;
+
+    std::string phases = tfm::format("bounds %s", timeString(bounds_time));
+    if (m_type == ELinearBVH)
+        phases += tfm::format(", morton sort %s", timeString(sort_time));
+    phases += tfm::format(", hierarchy %s", timeString(hierarchy_time));
+    if (treelets)
+        phases += tfm::format(", treelets %s", timeString(treelet_time));
+    if (m_precompute)
+        phases += tfm::format(", triangle groups %s", timeString(groups_time));
+    if (m_type != EOctree)
+        phases += tfm::format(", wide nodes %s", timeString(collapse_time));
+    if (m_type != EOctree && m_node_layout != EDepthFirst)
+        phases += tfm::format(", layout %s", timeString(layout_time));
+    if (quantize)
+        phases += tfm::format(", quantization %s", timeString(quantize_time));
+    printf("%s build time: %s (%s)\n", spatial ? "Spatial split BVH" : names[m_type],
+           total_timer.elapsedString().c_str(), phases.c_str());
+    if (spatial)
+        printf("Spatial splits: %d, %.3f references per triangle\n", num_spatial_splits,
+               (float) m_num_triangles_saved / num_triangles);
+    printStatistics();
+}
+
+void Accel::printStatistics() const {
+    if (m_type != EOctree)
+        printf("Num nodes: %d binary, %d %d-wide%s (%s)\n", m_num_nodes, (int) getWideNodeCount(), NORI_SIMD_WIDTH,
+               m_quantization_bits > 0 ? tfm::format(" with %d-bit boxes", m_quantization_bits).c_str() : "",
+               memString(getWideNodeMemory()).c_str());
+    else
+        printf("Num nodes: %d (%s)\n", m_num_nodes, memString(m_node_view.size * sizeof(Node)).c_str());
     printf("Num leaf nodes: %d \n", m_num_leaf_nodes);
-    printf("Num non-empty leaf nodes: %d \n", m_num_nonempty_leaf_nodes);
-    printf("Total number of saved triangles: %d \n", m_num_triangles_saved);
-    printf("Avg triangles per node: %f \n", (float)m_num_triangles_saved / (float)m_num_nodes);
+    if (m_precompute)
+        printf("Total number of saved triangles: %d in %d groups (%s, %.1f%% of the lanes used)\n",
+               m_num_triangles_saved, (int) m_group_view.size,
+               memString(m_group_view.size * sizeof(TriangleGroup)).c_str(),
+               100.f * m_num_triangles_saved / (m_group_view.size * NORI_SIMD_WIDTH));
+    else
+        printf("Total number of saved triangles: %d (%s)\n", m_num_triangles_saved,
+               memString(m_prim_view.size * sizeof(PrimRef)).c_str());
+    printf("Avg triangles per leaf: %f \n", (float)m_num_triangles_saved / (float)m_num_leaf_nodes);
     printf("Recursion depth: %d \n", m_recursion_depth);
+    printf("SAH cost: %f \n", getSAHCost());
+}
+
+void TraversalStatistics::add(const uint32_t *counts) {
+    queries++;
+    for (int k = 0; k < ECounterCount; k++) {
+        total[k] += counts[k];
+        max[k] = std::max(max[k], counts[k]);
+        int bucket = 0;
+        for (uint32_t count = counts[k]; count > 0; count >>= 1)
+            bucket++;
+        histogram[k][bucket]++;
+    }
+}
+
+void TraversalStatistics::merge(const TraversalStatistics &other) {
+    queries += other.queries;
+    for (int k = 0; k < ECounterCount; k++) {
+        total[k] += other.total[k];
+        max[k] = std::max(max[k], other.max[k]);
+        for (int i = 0; i < HISTOGRAM_SIZE; i++)
+            histogram[k][i] += other.histogram[k][i];
+    }
+}
+
+const char *TraversalStatistics::getCounterName(int counter) {
+    static const char *names[ECounterCount] = { "nodes", "boxes", "triangles", "hits", "cacheMisses" };
+    return names[counter];
+}
+
+TraversalStatistics Accel::getTraversalStatistics(bool shadowRay) const {
+    TraversalStatistics result;
+    for (const ThreadStatistics &stats : m_statistics)
+        result.merge(shadowRay ? stats.shadow : stats.closest);
+    return result;
+}
+
+/// Write the counters of one query type as a JSON object, with the histograms if \c detailed (else on one line)
+static void writeTraversal(std::ostream &os, const TraversalStatistics &stats, const std::string &indent,
+        bool detailed) {
+    const std::string separator = detailed ? ",\n" + indent + "  " : ", ";
+    os << (detailed ? "{\n" + indent + "  " : "{ ") << "\"queries\": " << stats.queries;
+    for (int k = 0; k < TraversalStatistics::ECounterCount; k++) {
+        os << separator << "\"" << TraversalStatistics::getCounterName(k) << "\": ";
+        if (!detailed) {
+            os << stats.total[k];
+            continue;
+        }
+        double mean = stats.queries > 0 ? (double) stats.total[k] / stats.queries : 0.0;
+        os << "{ \"total\": " << stats.total[k] << ", \"mean\": " << tfm::format("%.6g", mean)
+           << ", \"max\": " << stats.max[k] << ", \"histogram\": [";
+        // trailing empty buckets are left out
+        int size = TraversalStatistics::HISTOGRAM_SIZE;
+        while (size > 0 && stats.histogram[k][size - 1] == 0)
+            size--;
+        for (int i = 0; i < size; i++)
+            os << (i > 0 ? ", " : "") << stats.histogram[k][i];
+        os << "] }";
+    }
+    os << (detailed ? "\n" + indent + "}" : " }");
+}
+
+void Accel::writeStructure(std::ostream &os, const std::string &indent) const {
+    // number of leaves with every number of triangles
+    std::vector<uint64_t> occupancy;
+    auto add_leaf = [&](uint32_t count) {
+        if (count >= occupancy.size())
+            occupancy.resize(count + 1, 0);
+        occupancy[count]++;
+    };
+    auto add_node = [&](const auto& node) {
+        for (int i = 0; i < NORI_SIMD_WIDTH; i++)
+            if (node.count[i] > 0)
+                add_leaf(node.count[i]);
+    };
+    for (const WideNode& node : m_wide_view)
+        add_node(node);
+    for (const QuantizedNode<uint8_t>& node : m_quantized8_view)
+        add_node(node);
+    for (const QuantizedNode<uint16_t>& node : m_quantized16_view)
+        add_node(node);
+    if (getWideNodeCount() == 0) {
+        for (const Node& node : m_node_view)
+            if (node.leaf)
+                add_leaf(node.count);
+    }
+    uint64_t leaves = 0, references = 0;
+    for (size_t count = 0; count < occupancy.size(); count++) {
+        leaves += occupancy[count];
+        references += count * occupancy[count];
+    }
+    uint64_t triangles = 0;
+    for (const Mesh *mesh : m_meshes)
+        triangles += mesh->getTriangleCount();
+
+    static const char *type_names[] = { "bvh", "octree", "lbvh" };
+    bool wide = getWideNodeCount() > 0;
+    os << indent << "\"type\": \"" << type_names[m_type] << "\",\n";
+    os << indent << "\"precomputed\": " << (m_precompute ? "true" : "false") << ",\n";
+    os << indent << "\"width\": " << (wide ? NORI_SIMD_WIDTH : 8) << ",\n";
+    os << indent << "\"quantizationBits\": " << (wide ? m_quantization_bits : 0) << ",\n";
+    static const char *layout_names[] = { "dfs", "veb", "treelet" };
+    os << indent << "\"nodeLayout\": \"" << (wide ? layout_names[m_node_layout] : "dfs") << "\",\n";
+    os << indent << "\"triangles\": " << triangles << ",\n";
+    os << indent << "\"references\": " << references << ",\n";
+    os << indent << "\"nodes\": " << (wide ? getWideNodeCount() : m_node_view.size) << ",\n";
+    os << indent << "\"leaves\": " << leaves << ",\n";
+    os << indent << "\"nodeBytes\": "
+       << (wide ? getWideNodeMemory() : m_node_view.size * sizeof(Node)) << ",\n";
+    os << indent << "\"primitiveBytes\": "
+       << m_prim_view.size * sizeof(PrimRef) + m_group_view.size * sizeof(TriangleGroup) << ",\n";
+    os << indent << "\"sahCost\": " << tfm::format("%.6g", getSAHCost()) << ",\n";
+    os << indent << "\"leafOccupancy\": [";
+    for (size_t count = 0; count < occupancy.size(); count++)
+        os << (count > 0 ? ", " : "") << occupancy[count];
+    os << "]";
+}
+
+void Accel::writeStatistics(const std::string &filename) const {
+    std::ofstream os(filename);
+    if (!os)
+        throw NoriException("Accel: unable to write the statistics file \"%s\"!", filename);
+
+    os << "{\n";
+    writeStructure(os, "  ");
+    os << ",\n  \"instances\": " << m_instances.size() << ",\n";
+    os << "  \"instancedMeshes\": [";
+    for (size_t i = 0; i < m_blas.size(); i++) {
+        os << (i > 0 ? ", {\n" : "{\n");
+        m_blas[i]->writeStructure(os, "    ");
+        os << "\n  }";
+    }
+    os << "],\n";
+
+#if defined(NORI_ACCEL_STATS)
+    os << "  \"traversal\": {\n    \"enabled\": true,\n";
+#else
+    os << "  \"traversal\": {\n    \"enabled\": false,\n";
+#endif
+    os << "    \"closest\": ";
+    writeTraversal(os, getTraversalStatistics(false), "    ", true);
+    os << ",\n    \"shadow\": ";
+    writeTraversal(os, getTraversalStatistics(true), "    ", true);
+    os << ",\n    \"threads\": [";
+    bool first = true;
+    for (const ThreadStatistics &stats : m_statistics) {
+        os << (first ? "\n" : ",\n") << "      {\n        \"closest\": ";
+        writeTraversal(os, stats.closest, "", false);
+        os << ",\n        \"shadow\": ";
+        writeTraversal(os, stats.shadow, "", false);
+        os << "\n      }";
+        first = false;
+    }
+    os << (first ? "]\n" : "\n    ]\n") << "  }\n}\n";
+    os.close();
+    if (!os)
+        throw NoriException("Accel: unable to write the statistics file \"%s\"!", filename);
+}
+
+void Accel::setViews() {
+    m_node_view = ArrayView<Node>(m_nodes);
+    m_wide_view = ArrayView<WideNode>(m_wide_nodes);
+    m_quantized8_view = ArrayView<QuantizedNode<uint8_t>>(m_quantized8);
+    m_quantized16_view = ArrayView<QuantizedNode<uint16_t>>(m_quantized16);
+    m_prim_view = ArrayView<PrimRef>(m_prims);
+    m_group_view = ArrayView<TriangleGroup>(m_groups);
+}
+
+/* Cache files start with this header, followed by the node, wide node
+   (full precision, 8-bit and 16-bit), PrimRef and triangle group arrays,
+   each at a 64-byte aligned offset */
+static constexpr char CACHE_MAGIC[8] = "NoriAcc";
+static constexpr uint32_t CACHE_VERSION = 3;  ///< Increase whenever the layout or the builders change
+
+struct alignas(64) CacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t simd_width;
+    uint64_t key;
+    float bbox[6];
+    uint64_t counts[6];  ///< Nodes, wide nodes (all three formats), PrimRefs and triangle groups
+    uint32_t stats[4];   ///< Leaf nodes, binary nodes, depth and saved triangles
+};
+
+static inline size_t alignCacheOffset(size_t offset) {
+    return (offset + 63) & ~(size_t) 63;
+}
+
+uint64_t Accel::getCacheKey() const {
+    uint32_t settings[] = { CACHE_VERSION, NORI_SIMD_WIDTH, (uint32_t) m_type, m_precompute, m_treelets,
+                            m_quantization_bits, (uint32_t) m_node_layout, (uint32_t) m_meshes.size() };
+    uint64_t hash = hashWords(0xcbf29ce484222325ull, settings, sizeof(settings));
+    hash = hashWords(hash, &m_spatial_budget, sizeof(m_spatial_budget));
+    for (const Mesh *mesh : m_meshes) {
+        const MatrixXf &V = mesh->getVertexPositions();
+        const MatrixXu &F = mesh->getIndices();
+        uint64_t sizes[] = { (uint64_t) V.cols(), (uint64_t) F.cols() };
+        hash = hashWords(hash, sizes, sizeof(sizes));
+        hash = hashWords(hash, V.data(), sizeof(float) * V.size());
+        hash = hashWords(hash, F.data(), sizeof(uint32_t) * F.size());
+    }
+    return hash;
+}
+
+bool Accel::loadCache(const std::string &filename, uint64_t key) {
+    std::unique_ptr<MemoryMappedFile> file;
+    try {
+        file.reset(new MemoryMappedFile(filename));
+    } catch (const NoriException &) {
+        return false;
+    }
+
+    CacheHeader header;
+    if (file->size() < sizeof(CacheHeader))
+        return false;
+    memcpy(&header, file->data(), sizeof(CacheHeader));
+    if (memcmp(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0 || header.version != CACHE_VERSION ||
+        header.simd_width != NORI_SIMD_WIDTH || header.key != key)
+        return false;
+
+    const size_t sizes[] = { sizeof(Node), sizeof(WideNode), sizeof(QuantizedNode<uint8_t>),
+                             sizeof(QuantizedNode<uint16_t>), sizeof(PrimRef), sizeof(TriangleGroup) };
+    size_t offsets[6], offset = sizeof(CacheHeader);
+    for (int i = 0; i < 6; i++) {
+        offsets[i] = offset = alignCacheOffset(offset);
+        offset += header.counts[i] * sizes[i];
+    }
+    if (file->size() < offset)
+        return false;
+
+    m_node_view = ArrayView<Node>(file->data() + offsets[0], header.counts[0]);
+    m_wide_view = ArrayView<WideNode>(file->data() + offsets[1], header.counts[1]);
+    m_quantized8_view = ArrayView<QuantizedNode<uint8_t>>(file->data() + offsets[2], header.counts[2]);
+    m_quantized16_view = ArrayView<QuantizedNode<uint16_t>>(file->data() + offsets[3], header.counts[3]);
+    m_prim_view = ArrayView<PrimRef>(file->data() + offsets[4], header.counts[4]);
+    m_group_view = ArrayView<TriangleGroup>(file->data() + offsets[5], header.counts[5]);
+    m_bbox = BoundingBox3f(Point3f(header.bbox[0], header.bbox[1], header.bbox[2]),
+                           Point3f(header.bbox[3], header.bbox[4], header.bbox[5]));
+    m_num_leaf_nodes = header.stats[0];
+    m_num_nodes = header.stats[1];
+    m_recursion_depth = header.stats[2];
+    m_num_triangles_saved = header.stats[3];
+    m_cache = std::move(file);
+    return true;
+}
+
+void Accel::writeCache(const std::string &filename, uint64_t key) const {
+    CacheHeader header;
+    memset(&header, 0, sizeof(CacheHeader));
+    memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    header.version = CACHE_VERSION;
+    header.simd_width = NORI_SIMD_WIDTH;
+    header.key = key;
+    for (int k = 0; k < 3; k++) {
+        header.bbox[k] = m_bbox.min[k];
+        header.bbox[k + 3] = m_bbox.max[k];
+    }
+    const void *arrays[] = { m_node_view.data, m_wide_view.data, m_quantized8_view.data, m_quantized16_view.data,
+                             m_prim_view.data, m_group_view.data };
+    const size_t sizes[] = { m_node_view.size * sizeof(Node), m_wide_view.size * sizeof(WideNode),
+                             m_quantized8_view.size * sizeof(QuantizedNode<uint8_t>),
+                             m_quantized16_view.size * sizeof(QuantizedNode<uint16_t>),
+                             m_prim_view.size * sizeof(PrimRef), m_group_view.size * sizeof(TriangleGroup) };
+    header.counts[0] = m_node_view.size;
+    header.counts[1] = m_wide_view.size;
+    header.counts[2] = m_quantized8_view.size;
+    header.counts[3] = m_quantized16_view.size;
+    header.counts[4] = m_prim_view.size;
+    header.counts[5] = m_group_view.size;
+    header.stats[0] = m_num_leaf_nodes;
+    header.stats[1] = m_num_nodes;
+    header.stats[2] = m_recursion_depth;
+    header.stats[3] = m_num_triangles_saved;
+
+    filesystem::path directory(m_cache_directory);
+    if (!directory.exists())
+        filesystem::create_directories(directory);
+
+    // written to a file of our own first and renamed into place, so that
+    // other processes never map a partial file, even if they build the same key
+    std::string temp_file;
+    try {
+        temp_file = createTemporaryFile(filename);
+    } catch (const NoriException &) {
+        cerr << "Accel: unable to write the cache file \"" << filename << "\"" << endl;
+        return;
+    }
+    std::ofstream out(temp_file, std::ios::binary);
+    out.write((const char *) &header, sizeof(CacheHeader));
+    size_t offset = sizeof(CacheHeader);
+    const char padding[64] = {};
+    for (int i = 0; i < 6; i++) {
+        out.write(padding, alignCacheOffset(offset) - offset);
+        out.write((const char *) arrays[i], sizes[i]);
+        offset = alignCacheOffset(offset) + sizes[i];
+    }
+    out.close();
+    if (!out || !replaceFile(temp_file, filename)) {
+        cerr << "Accel: unable to write the cache file \"" << filename << "\"" << endl;
+        std::remove(temp_file.c_str());
+    }
+}
+
+void Accel::buildInstances() {
+    m_blas.clear();
+    m_instances.clear();
+    m_tlas_nodes.clear();
+    if (m_instanced_meshes.empty())
+        return;
+
+    // every instanced mesh gets a hierarchy of the same kind in its own space
+    Timer total_timer, timer;
+    for (Mesh *mesh : m_instanced_meshes) {
+        std::unique_ptr<Accel> blas(new Accel(m_type, m_precompute));
+        blas->m_treelets = m_treelets;
+        blas->m_spatial_budget = m_spatial_budget;
+        blas->m_quantization_bits = m_quantization_bits;
+        blas->m_node_layout = m_node_layout;
+        blas->m_cache_directory = m_cache_directory;
+        blas->m_meshes.push_back(mesh);
+        blas->m_bbox = mesh->getBoundingBox();
+        m_blas.push_back(std::move(blas));
+    }
+    tbb::parallel_for(tbb::blocked_range<uint32_t>(0, (uint32_t) m_blas.size(), 1),
+        [&](const tbb::blocked_range<uint32_t> &range) {
+            for (uint32_t i = range.begin(); i != range.end(); ++i)
+                m_blas[i]->buildHierarchy(false);
+        }
+    );
+    double blas_time = timer.lap();
+    buildTopLevel();
+    double tlas_time = timer.lap();
+
+    size_t blas_memory = 0;
+    uint64_t num_triangles = 0, num_instanced_triangles = 0;
+    for (const std::unique_ptr<Accel>& blas : m_blas) {
+        blas_memory += blas->getWideNodeMemory() + blas->m_node_view.size * sizeof(Node) +
+                       blas->m_prim_view.size * sizeof(PrimRef) + blas->m_group_view.size * sizeof(TriangleGroup);
+        num_triangles += blas->m_meshes[0]->getTriangleCount();
+    }
+    for (const InstanceRecord& record : m_instances)
+        num_instanced_triangles += record.blas->m_meshes[0]->getTriangleCount();
+    printf("Instancing build time: %s (bottom level %s, top level %s)\n", total_timer.elapsedString().c_str(),
+           timeString(blas_time).c_str(), timeString(tlas_time).c_str());
+    printf("Instances: %d of %d meshes, %llu triangles (%llu unique)\n", (int) m_instances.size(),
+           (int) m_instanced_meshes.size(), (unsigned long long) num_instanced_triangles,
+           (unsigned long long) num_triangles);
+    printf("Instance memory: %s bottom level, %s top level (%d %d-wide nodes, %s instances)\n",
+           memString(blas_memory).c_str(),
+           memString(m_tlas_nodes.size() * sizeof(WideNode) + m_instances.size() * sizeof(InstanceRecord)).c_str(),
+           (int) m_tlas_nodes.size(), NORI_SIMD_WIDTH, memString(m_instances.size() * sizeof(InstanceRecord)).c_str());
+}
+
+void Accel::buildTopLevel() {
+    std::vector<InstanceRecord> instances;
+    std::vector<BoundingBox3f> bounds;
+    for (size_t i = 0; i < m_instanced_meshes.size(); i++) {
+        for (const Instance *instance : m_instanced_meshes[i]->getInstances()) {
+            instances.push_back(InstanceRecord{ m_blas[i].get(), instance, instance->getTransform().inverse() });
+            bounds.push_back(instance->getBoundingBox(m_instanced_meshes[i]));
+            m_bbox.expandBy(bounds.back());
+        }
+    }
+    uint32_t num_instances = (uint32_t) instances.size();
+
+    /* Instances are intersected one at a time, so the top level is built
+       with the leaf costs of a hierarchy without triangle groups */
+    Accel top_level(EBVH, false);
+    NodeArray nodes;
+    uint32_t root = allocateNodes(nodes, 1);
+    std::vector<uint32_t> order(num_instances);
+    for (uint32_t i = 0; i < num_instances; i++)
+        order[i] = i;
+    top_level.buildBVHRecursive(nodes, root, order, 0, num_instances, bounds, 0);
+    m_instances.resize(num_instances);
+    for (uint32_t i = 0; i < num_instances; i++)
+        m_instances[i] = instances[order[i]];
+    m_tlas_nodes.clear();
+    collapseBVH(std::vector<Node>(nodes.begin(), nodes.end()), m_tlas_nodes, root);
+}
+
+uint32_t Accel::refit(float rebuild_threshold) {
+    if (getWideNodeCount() == 0 && m_node_view.empty() && m_tlas_nodes.empty())
+        throw NoriException("Accel::refit(): the acceleration structure has not been built!");
+
+    Timer timer;
+    m_bbox.reset();
+    uint32_t num_rebuilt = m_meshes.empty() ? 0 : refitHierarchy(rebuild_threshold);
+    if (!m_blas.empty()) {
+        std::atomic<uint32_t> num_blas_rebuilt(0);
+        tbb::parallel_for(tbb::blocked_range<uint32_t>(0, (uint32_t) m_blas.size(), 1),
+            [&](const tbb::blocked_range<uint32_t> &range) {
+                for (uint32_t i = range.begin(); i != range.end(); ++i)
+                    num_blas_rebuilt += m_blas[i]->refitHierarchy(rebuild_threshold);
+            }
+        );
+        num_rebuilt += num_blas_rebuilt;
+        // the boxes of the instances follow their meshes, and the top level is cheap to build
+        buildTopLevel();
+    }
+    printf("Refit time: %s (%d subtrees rebuilt, SAH cost %f)\n", timer.elapsedString().c_str(), num_rebuilt,
+           getSAHCost());
+    return num_rebuilt;
+}
+
+uint32_t Accel::refitHierarchy(float rebuild_threshold) {
+    m_bbox.reset();
+    for (const Mesh *mesh : m_meshes)
+        m_bbox.expandBy(mesh->getBoundingBox());
+    if (m_type == EOctree) {
+        // the cells of the octree do not depend on the triangles, which may now belong to other cells
+        buildHierarchy(false);
+        return 1;
+    }
+
+    if (m_cache) {
+        // the mapped cache file is read-only, refit a copy of it
+        m_wide_nodes.assign(m_wide_view.begin(), m_wide_view.end());
+        m_quantized8.assign(m_quantized8_view.begin(), m_quantized8_view.end());
+        m_quantized16.assign(m_quantized16_view.begin(), m_quantized16_view.end());
+        m_prims.assign(m_prim_view.begin(), m_prim_view.end());
+        m_groups.assign(m_group_view.begin(), m_group_view.end());
+        m_cache.reset();
+    }
+
+    // quantized nodes are refitted at full precision and quantized again
+    if (m_quantization_bits > 0)
+        dequantizeNodes();
+    uint32_t num_rebuilt = refitWideNodes(rebuild_threshold);
+    if (m_quantization_bits > 0)
+        quantizeNodes();
+    setViews();
+    return num_rebuilt;
+}
+
+uint32_t Accel::refitWideNodes(float rebuild_threshold) {
+    // the costs of the build are measured before the first refit changes the bounds
+    if (m_build_costs.empty()) {
+        m_build_costs.resize(m_wide_nodes.size());
+        refitRecursive(0, m_build_costs, false, 0);
+    }
+    std::vector<float> costs(m_wide_nodes.size());
+    refitRecursive(0, costs, true, 0);
+    if (!(rebuild_threshold > 0.f))
+        return 0;
+
+    // find the highest subtrees that degraded too much, along with their depth
+    Rebuild rebuild;
+    rebuild.replaced.assign(m_wide_nodes.size(), (uint32_t) -1);
+    std::vector<std::pair<uint32_t, uint32_t>> stack{ { 0, 0 } };
+    while (!stack.empty()) {
+        std::pair<uint32_t, uint32_t> entry = stack.back();
+        stack.pop_back();
+        if (costs[entry.first] > rebuild_threshold * m_build_costs[entry.first]) {
+            rebuild.replaced[entry.first] = (uint32_t) rebuild.subtrees.size();
+            rebuild.subtrees.emplace_back();
+            rebuild.subtrees.back().root = entry.first;
+            rebuild.subtrees.back().depth = entry.second;
+            continue;
+        }
+        const WideNode& node = m_wide_nodes[entry.first];
+        for (uint32_t i = 0; i < NORI_SIMD_WIDTH; i++) {
+            if (node.count[i] == 0 && node.bounds[0][i] != std::numeric_limits<float>::infinity())
+                stack.emplace_back(node.child[i], entry.second + 1);
+        }
+    }
+    if (rebuild.subtrees.empty())
+        return 0;
+
+    tbb::parallel_for(tbb::blocked_range<uint32_t>(0, (uint32_t) rebuild.subtrees.size(), 1),
+        [&](const tbb::blocked_range<uint32_t> &range) {
+            for (uint32_t i = range.begin(); i != range.end(); ++i)
+                rebuildSubtree(rebuild, i);
+        }
+    );
+
+    // copy the kept and the new nodes into fresh arrays, which keeps them in depth-first order
+    rebuild.nodes.reserve(m_wide_nodes.size());
+    rebuild.build_costs.reserve(m_wide_nodes.size());
+    spliceRecursive(rebuild, (uint32_t) -1, 0);
+    m_wide_nodes.swap(rebuild.nodes);
+    m_prims.swap(rebuild.prims);
+    m_groups.swap(rebuild.groups);
+
+    // the rebuilt subtrees are judged against their new costs from now on
+    costs.assign(m_wide_nodes.size(), 0.f);
+    refitRecursive(0, costs, false, 0);
+    m_build_costs.swap(rebuild.build_costs);
+    for (size_t i = 0; i < m_build_costs.size(); i++) {
+        if (std::isnan(m_build_costs[i]))
+            m_build_costs[i] = costs[i];
+    }
+    reorderNodes();
+    return (uint32_t) rebuild.subtrees.size();
+}
+
+BoundingBox3f Accel::refitRecursive(uint32_t node_idx, std::vector<float>& costs, bool update, uint32_t depth) {
+    WideNode& node = m_wide_nodes[node_idx];
+    BoundingBox3f bboxes[NORI_SIMD_WIDTH];
+    float weighted_costs[NORI_SIMD_WIDTH];
+    auto refit_child = [&](uint32_t i) {
+        weighted_costs[i] = 0.f;
+        if (node.bounds[0][i] == std::numeric_limits<float>::infinity())
+            return;
+
+        BoundingBox3f bbox = getChildBounds(node, i);
+        float cost;
+        if (node.count[i] == 0) {
+            BoundingBox3f child_bbox = refitRecursive(node.child[i], costs, update, depth + 1);
+            if (update)
+                bbox = child_bbox;
+            cost = costs[node.child[i]];
+        } else {
+            if (update)
+                bbox = refitLeaf(node.child[i], node.count[i]);
+            cost = SAH_INTERSECTION_COST * getLeafTestCount(node.count[i]);
+        }
+        bboxes[i] = bbox;
+        weighted_costs[i] = cost * bbox.getSurfaceArea();
+    };
+    if (depth < REFIT_TASK_DEPTH) {
+        tbb::parallel_for(0u, (uint32_t) NORI_SIMD_WIDTH, refit_child);
+    } else {
+        for (uint32_t i = 0; i < NORI_SIMD_WIDTH; i++)
+            refit_child(i);
+    }
+
+    // empty slots keep their inverted box
+    BoundingBox3f bbox;
+    float weighted_cost = 0.f;
+    for (uint32_t i = 0; i < NORI_SIMD_WIDTH; i++) {
+        if (node.bounds[0][i] == std::numeric_limits<float>::infinity())
+            continue;
+        if (update) {
+            for (int k = 0; k < 3; k++) {
+                node.bounds[k][i] = bboxes[i].min[k];
+                node.bounds[k + 3][i] = bboxes[i].max[k];
+            }
+        }
+        bbox.expandBy(bboxes[i]);
+        weighted_cost += weighted_costs[i];
+    }
+    float area = bbox.getSurfaceArea();
+    costs[node_idx] = SAH_TRAVERSAL_COST + (area > 0.f ? weighted_cost / area : 0.f);
+    return bbox;
+}
+
+BoundingBox3f Accel::refitLeaf(uint32_t offset, uint32_t count) {
+    BoundingBox3f bbox;
+    if (!m_precompute) {
+        for (uint32_t i = offset; i < offset + count; i++)
+            bbox.expandBy(m_meshes[m_prims[i].mesh]->getBoundingBox(m_prims[i].triangle));
+        return bbox;
+    }
+
+    // the groups know their triangles, only the vertices are fetched again
+    for (uint32_t i = 0; i < count; i += NORI_SIMD_WIDTH) {
+        TriangleGroup& group = m_groups[offset + i / NORI_SIMD_WIDTH];
+        uint32_t num_lanes = std::min<uint32_t>(count - i, NORI_SIMD_WIDTH);
+        PrimRef prims[NORI_SIMD_WIDTH];
+        for (uint32_t lane = 0; lane < num_lanes; lane++) {
+            prims[lane] = PrimRef{ group.mesh[lane], group.triangle[lane] };
+            bbox.expandBy(m_meshes[prims[lane].mesh]->getBoundingBox(prims[lane].triangle));
+        }
+        fillTriangleGroup(group, prims, num_lanes);
+    }
+    return bbox;
+}
+
+void Accel::gatherPrims(uint32_t node_idx, std::vector<PrimRef>& prims) const {
+    const WideNode& node = m_wide_nodes[node_idx];
+    for (uint32_t i = 0; i < NORI_SIMD_WIDTH; i++) {
+        if (node.bounds[0][i] == std::numeric_limits<float>::infinity())
+            continue;
+        if (node.count[i] == 0) {
+            gatherPrims(node.child[i], prims);
+            continue;
+        }
+        for (uint32_t j = 0; j < node.count[i]; j++) {
+            if (m_precompute) {
+                const TriangleGroup& group = m_groups[node.child[i] + j / NORI_SIMD_WIDTH];
+                prims.push_back(PrimRef{ group.mesh[j % NORI_SIMD_WIDTH], group.triangle[j % NORI_SIMD_WIDTH] });
+            } else {
+                prims.push_back(m_prims[node.child[i] + j]);
+            }
+        }
+    }
+}
+
+void Accel::rebuildSubtree(Rebuild& rebuild, uint32_t index) {
+    Rebuild::Subtree& subtree = rebuild.subtrees[index];
+    std::vector<PrimRef> prims;
+    gatherPrims(subtree.root, prims);
+    if (m_spatial_budget > 0.f) {
+        // spatial splits reference some triangles from several leaves
+        std::sort(prims.begin(), prims.end(), [](const PrimRef& a, const PrimRef& b) {
+            return a.mesh != b.mesh ? a.mesh < b.mesh : a.triangle < b.triangle;
+        });
+        prims.erase(std::unique(prims.begin(), prims.end(), [](const PrimRef& a, const PrimRef& b) {
+            return a.mesh == b.mesh && a.triangle == b.triangle;
+        }), prims.end());
+    }
+
+    uint32_t num_triangles = (uint32_t) prims.size();
+    std::vector<BoundingBox3f> bounds(num_triangles);
+    std::vector<uint32_t> order(num_triangles);
+    for (uint32_t i = 0; i < num_triangles; i++) {
+        bounds[i] = m_meshes[prims[i].mesh]->getBoundingBox(prims[i].triangle);
+        order[i] = i;
+    }
+
+    // starting at the depth of the old subtree keeps the whole hierarchy within BVH_MAX_DEPTH
+    NodeArray nodes;
+    uint32_t root = allocateNodes(nodes, 1);
+    buildBVHRecursive(nodes, root, order, 0, num_triangles, bounds, subtree.depth);
+    subtree.prims.resize(num_triangles);
+    for (uint32_t i = 0; i < num_triangles; i++)
+        subtree.prims[i] = prims[order[i]];
+    collapseBVH(std::vector<Node>(nodes.begin(), nodes.end()), subtree.nodes, root);
+}
+
+uint32_t Accel::spliceRecursive(Rebuild& rebuild, uint32_t subtree, uint32_t node_idx) {
+    if (subtree == (uint32_t) -1 && rebuild.replaced[node_idx] != (uint32_t) -1)
+        return spliceRecursive(rebuild, rebuild.replaced[node_idx], 0);
+
+    const Rebuild::Subtree *source = subtree == (uint32_t) -1 ? nullptr : &rebuild.subtrees[subtree];
+    WideNode node = source ? source->nodes[node_idx] : m_wide_nodes[node_idx];
+    uint32_t new_idx = (uint32_t) rebuild.nodes.size();
+    rebuild.nodes.emplace_back();
+    rebuild.build_costs.push_back(source ? std::numeric_limits<float>::quiet_NaN() : m_build_costs[node_idx]);
+
+    for (uint32_t i = 0; i < NORI_SIMD_WIDTH; i++) {
+        if (node.bounds[0][i] == std::numeric_limits<float>::infinity())
+            continue;
+        if (node.count[i] == 0) {
+            node.child[i] = spliceRecursive(rebuild, subtree, node.child[i]);
+            continue;
+        }
+
+        uint32_t offset = node.child[i], count = node.count[i];
+        if (!m_precompute) {
+            const PrimRef *prims = source ? &source->prims[offset] : &m_prims[offset];
+            node.child[i] = (uint32_t) rebuild.prims.size();
+            rebuild.prims.insert(rebuild.prims.end(), prims, prims + count);
+        } else if (!source) {
+            node.child[i] = (uint32_t) rebuild.groups.size();
+            rebuild.groups.insert(rebuild.groups.end(), m_groups.begin() + offset,
+                                  m_groups.begin() + offset + getLeafTestCount(count));
+        } else {
+            node.child[i] = (uint32_t) rebuild.groups.size();
+            rebuild.groups.resize(rebuild.groups.size() + getLeafTestCount(count));
+            for (uint32_t j = 0; j < count; j += NORI_SIMD_WIDTH)
+                fillTriangleGroup(rebuild.groups[node.child[i] + j / NORI_SIMD_WIDTH], &source->prims[offset + j],
+                                  std::min<uint32_t>(count - j, NORI_SIMD_WIDTH));
+        }
+    }
+    rebuild.nodes[new_idx] = node;
+    return new_idx;
+}
+
+inline void Accel::recordQuery(bool shadowRay) const {
+#if defined(NORI_ACCEL_STATS)
+    ThreadStatistics &stats = m_statistics.local();
+    (shadowRay ? stats.shadow : stats.closest).add(query_counters);
+    std::fill(query_counters, query_counters + TraversalStatistics::ECounterCount, 0);
+#else
+    (void) shadowRay;
+#endif
 }
 
 bool Accel::rayIntersect(const Ray3f &ray_, Intersection &its, bool shadowRay) const {
-    bool foundIntersection;  // Was an intersection found so far?
+    if (shadowRay)
+        return occluded(ray_);
+
+    bool foundIntersection = false;  // Was an intersection found so far?
     uint32_t f = (uint32_t) -1;      // Triangle index of the closest intersection
 
     Ray3f ray(ray_); /// Make a copy of the ray (we will need to update its '.maxt' value)
 
-    foundIntersection = traverseRecursive(*m_root, ray, its, shadowRay, f);
-    if (shadowRay)
-        return foundIntersection;
+    foundIntersection = traverse<false>(ray, its, f);
+
+    // instances can only be hit closer than what was found so far
+    const InstanceRecord *hit_instance = nullptr;
+    if (!m_tlas_nodes.empty() && traverseInstances<false>(ray, its, f, hit_instance))
+        foundIntersection = true;
+    recordQuery(false);
 
     if (foundIntersection) {
         /* At this point, we now know that there is an intersection,
@@ -86,195 +1008,1722 @@ bool Accel::rayIntersect(const Ray3f &ray_, Intersection &its, bool shadowRay) c
            characterize the intersection (normals, texture coordinates, etc..)
         */
 
-        /* Find the barycentric coordinates */
-        Vector3f bary;
-        bary << 1-its.uv.sum(), its.uv;
+        its.mesh->setHitInformation(f, its);
+        if (hit_instance)
+            hit_instance->instance->transformHit(its);
+    }
+
+    return foundIntersection;
+}
+
+bool Accel::occluded(const Ray3f &ray_) const {
+    Ray3f ray(ray_);
+    Intersection its; /* Unused */
+    uint32_t f;
+    const InstanceRecord *hit_instance;
+    bool found = traverse<true>(ray, its, f) ||
+                 (!m_tlas_nodes.empty() && traverseInstances<true>(ray, its, f, hit_instance));
+    recordQuery(true);
+    return found;
+}
+
+void Accel::rayIntersectPacket(uint32_t count, const Ray3f *rays, Intersection *its, bool *found) const {
+    for (; count > PACKET_SIZE; count -= PACKET_SIZE, rays += PACKET_SIZE, its += PACKET_SIZE, found += PACKET_SIZE)
+        rayIntersectPacket(PACKET_SIZE, rays, its, found);
+
+    // the interval arithmetic needs finite reciprocals of the same sign on every axis
+    bool coherent = getWideNodeCount() > 0;
+    for (uint32_t i = 0; i < count && coherent; i++) {
+        for (int axis = 0; axis < 3; axis++) {
+            coherent &= std::isfinite(rays[i].dRcp[axis]) &&
+                        (rays[i].dRcp[axis] < 0) == (rays[0].dRcp[axis] < 0);
+        }
+    }
+    if (!coherent) {
+        for (uint32_t i = 0; i < count; i++)
+            found[i] = rayIntersect(rays[i], its[i], false);
+        return;
+    }
+
+    /* Ray3f declares a copy constructor but no assignment, so the copies are constructed in place */
+    alignas(Ray3f) unsigned char ray_storage[PACKET_SIZE * sizeof(Ray3f)];
+    Ray3f *local = reinterpret_cast<Ray3f *>(ray_storage);
+    uint32_t hit_idx[PACKET_SIZE];
+    for (uint32_t i = 0; i < count; i++) {
+        new (&local[i]) Ray3f(rays[i]);
+        found[i] = false;
+        hit_idx[i] = (uint32_t) -1;
+#if defined(NORI_ACCEL_STATS)
+        std::fill(packet_counters[i], packet_counters[i] + TraversalStatistics::ECounterCount, 0);
+#endif
+    }
+    if (!m_quantized8_view.empty())
+        traversePacket(m_quantized8_view.data, count, local, its, hit_idx, found);
+    else if (!m_quantized16_view.empty())
+        traversePacket(m_quantized16_view.data, count, local, its, hit_idx, found);
+    else
+        traversePacket(m_wide_view.data, count, local, its, hit_idx, found);
 
-        /* References to all relevant mesh buffers */
-        const Mesh *mesh   = its.mesh;
-        const MatrixXf &V  = mesh->getVertexPositions();
-        const MatrixXf &N  = mesh->getVertexNormals();
-        const MatrixXf &UV = mesh->getVertexTexCoords();
-        const MatrixXu &F  = mesh->getIndices();
+    // instances are intersected ray by ray, as in rayIntersect()
+    for (uint32_t i = 0; i < count; i++) {
+        const InstanceRecord *hit_instance = nullptr;
+        if (!m_tlas_nodes.empty() && traverseInstances<false>(local[i], its[i], hit_idx[i], hit_instance))
+            found[i] = true;
+        if (found[i]) {
+            its[i].mesh->setHitInformation(hit_idx[i], its[i]);
+            if (hit_instance)
+                hit_instance->instance->transformHit(its[i]);
+        }
+        // every ray is a query of its own, with the counts that traversePacket() attributed to it
+#if defined(NORI_ACCEL_STATS)
+        for (int k = 0; k < TraversalStatistics::ECounterCount; k++)
+            query_counters[k] += packet_counters[i][k];
+#endif
+        recordQuery(false);
+    }
+}
 
-        /* Vertex indices of the triangle */
-        uint32_t idx0 = F(0, f), idx1 = F(1, f), idx2 = F(2, f);
+uint32_t Accel::allocateNodes(NodeArray& nodes, uint32_t count) {
+    return (uint32_t) (nodes.grow_by(count) - nodes.begin());
+}
 
-        Point3f p0 = V.col(idx0), p1 = V.col(idx1), p2 = V.col(idx2);
+/**
+ * Accumulate a value over the index range [begin, end), in parallel when
+ * the range is large. \c Value must provide a \c merge() method.
+ */
+template <typename Value, typename Func>
+static Value accumulate(uint32_t begin, uint32_t end, const Func &func) {
+    if (end - begin < BUILD_PARALLEL_SPLIT_THRESHOLD) {
+        Value value;
+        for (uint32_t i = begin; i < end; i++)
+            func(value, i);
+        return value;
+    }
+    return tbb::parallel_reduce(tbb::blocked_range<uint32_t>(begin, end, BUILD_GRAIN_SIZE), Value(),
+        [&](const tbb::blocked_range<uint32_t> &range, Value value) {
+            for (uint32_t i = range.begin(); i != range.end(); ++i)
+                func(value, i);
+            return value;
+        },
+        [](Value a, const Value &b) {
+            a.merge(b);
+            return a;
+        }
+    );
+}
 
-        its.bary = bary;
+/**
+ * Move the entries of order[begin, end) that satisfy the predicate to the
+ * front and return the index of the first one that does not. Large ranges
+ * are partitioned in parallel blocks through a temporary buffer.
+ */
+template <typename Pred>
+static uint32_t partition(std::vector<uint32_t>& order, uint32_t begin, uint32_t end, const Pred &pred) {
+    if (end - begin < BUILD_PARALLEL_SPLIT_THRESHOLD)
+        return (uint32_t) (std::partition(order.begin() + begin, order.begin() + end, pred) - order.begin());
 
-        its.tri_index = Point3f(idx0, idx1, idx2);
+    uint32_t num_blocks = (end - begin + BUILD_GRAIN_SIZE - 1) / BUILD_GRAIN_SIZE;
+    std::vector<uint32_t> left_offsets(num_blocks + 1, 0);
+    tbb::parallel_for(0u, num_blocks, [&](uint32_t block) {
+        uint32_t block_end = std::min(begin + (block + 1) * BUILD_GRAIN_SIZE, end);
+        for (uint32_t i = begin + block * BUILD_GRAIN_SIZE; i < block_end; i++)
+            left_offsets[block + 1] += pred(order[i]) ? 1 : 0;
+    });
+    for (uint32_t block = 0; block < num_blocks; block++)
+        left_offsets[block + 1] += left_offsets[block];
+    uint32_t num_left = left_offsets[num_blocks];
 
-        /* Compute the intersection positon accurately
-           using barycentric coordinates */
-        its.p = bary.x() * p0 + bary.y() * p1 + bary.z() * p2;
+    std::vector<uint32_t> partitioned(end - begin);
+    tbb::parallel_for(0u, num_blocks, [&](uint32_t block) {
+        uint32_t block_begin = begin + block * BUILD_GRAIN_SIZE;
+        uint32_t block_end = std::min(block_begin + BUILD_GRAIN_SIZE, end);
+        uint32_t left = left_offsets[block];
+        uint32_t right = num_left + (block_begin - begin) - left;
+        for (uint32_t i = block_begin; i < block_end; i++)
+            partitioned[pred(order[i]) ? left++ : right++] = order[i];
+    });
+    tbb::parallel_for(tbb::blocked_range<uint32_t>(0, end - begin, BUILD_GRAIN_SIZE),
+        [&](const tbb::blocked_range<uint32_t> &range) {
+            std::copy(partitioned.begin() + range.begin(), partitioned.begin() + range.end(),
+                      order.begin() + begin + range.begin());
+        }
+    );
+    return begin + num_left;
+}
 
-        /* Compute proper texture coordinates if provided by the mesh */
-        if (UV.size() > 0)
-            its.uv = bary.x() * UV.col(idx0) +
-                bary.y() * UV.col(idx1) +
-                bary.z() * UV.col(idx2);
+void Accel::buildRecursive(NodeArray& nodes, tbb::concurrent_vector<PrimRef>& leaf_prims, uint32_t node_idx,
+        const BoundingBox3f& bbox, std::vector<uint32_t>& prim_indices, const std::vector<PrimRef>& prims,
+        const std::vector<BoundingBox3f>& bounds, uint32_t recursion_depth) {
+    nodes[node_idx].bbox = bbox;
 
-        /* Compute the geometry frame */
-        its.geoFrame = Frame((p1-p0).cross(p2-p0).normalized());
+    uint32_t num_triangles = prim_indices.size();
 
-        if (N.size() > 0) {
-            /* Compute the shading frame. Note that for simplicity,
-               the current implementation doesn't attempt to provide
-               tangents that are continuous across the surface. That
-               means that this code will need to be modified to be able
-               use anisotropic BRDFs, which need tangent continuity */
+    // create leaf node if few triangles are left or if the max recursion depth is reached.
+    if (num_triangles <= MAX_TRIANGLES_PER_NODE || recursion_depth >= MAX_RECURSION_DEPTH) {
+        if (num_triangles >= (1u << 23))
+            throw NoriException("Accel: too many triangles (%i) in an octree leaf!", num_triangles);
+        Node& node = nodes[node_idx];
+        node.offset = (uint32_t) (leaf_prims.grow_by(num_triangles) - leaf_prims.begin());
+        node.count = num_triangles;
+        node.leaf = 1;
+        for (uint32_t i = 0; i < num_triangles; i++)
+            leaf_prims[node.offset + i] = prims[prim_indices[i]];
+        return;
+    }
 
-            its.shFrame = Frame(
-                (bary.x() * N.col(idx0) +
-                 bary.y() * N.col(idx1) +
-                 bary.z() * N.col(idx2)).normalized());
-        } else {
-            its.shFrame = its.geoFrame;
+    BoundingBox3f child_bboxes[8] = {};
+    subdivideBBox(bbox, child_bboxes);
+
+    // place every triangle in the children it overlaps with, one octant per task for large nodes
+    std::vector<uint32_t> child_prim_indices[8];
+    auto fill_octant = [&](uint32_t i) {
+        for (uint32_t j = 0; j < num_triangles; j++) {
+            if (child_bboxes[i].overlaps(bounds[prim_indices[j]]))
+                child_prim_indices[i].push_back(prim_indices[j]);
         }
+    };
+    if (num_triangles >= BUILD_PARALLEL_SPLIT_THRESHOLD) {
+        tbb::parallel_for(0u, 8u, fill_octant);
+    } else {
+        for (uint32_t i = 0; i < 8; i++)
+            fill_octant(i);
     }
 
-    return foundIntersection;
+    // release memory to avoid stack overflow
+    prim_indices = std::vector<uint32_t>();
+
+    // empty octants are not stored, the remaining children are allocated next to each other
+    uint32_t num_children = 0, octants = 0;
+    for (uint32_t i = 0; i < 8; i++) {
+        if (!child_prim_indices[i].empty()) {
+            num_children++;
+            octants |= 1 << i;
+        }
+    }
+
+    uint32_t first_child = allocateNodes(nodes, num_children);
+    Node& node = nodes[node_idx];
+    node.offset = first_child;
+    node.count = num_children;
+    node.flags = octants;
+    node.leaf = 0;
+
+    // large children become tasks, the others are built right away
+    tbb::task_group tasks;
+    for (uint32_t i = 0, child = first_child; i < 8; i++) {
+        if (child_prim_indices[i].empty())
+            continue;
+        auto build_child = [&, i, child] {
+            buildRecursive(nodes, leaf_prims, child, child_bboxes[i], child_prim_indices[i], prims, bounds,
+                           recursion_depth + 1);
+        };
+        if (child_prim_indices[i].size() >= BUILD_TASK_THRESHOLD)
+            tasks.run(build_child);
+        else
+            build_child();
+        child++;
+    }
+    tasks.wait();
 }
 
-Accel::Node* Accel::buildRecursive(const BoundingBox3f& bbox, std::vector<uint32_t>& triangle_indices,
-        std::vector<uint32_t>& mesh_indices, uint32_t recursion_depth) {
-    // a node is created in any case
-    m_num_nodes++;
+/// Bounds of a set of primitives and of their centroids
+struct BVHRangeBounds {
+    BoundingBox3f bbox, centroids;
 
-    uint32_t num_triangles = triangle_indices.size();
+    void merge(const BVHRangeBounds &other) {
+        bbox.expandBy(other.bbox);
+        centroids.expandBy(other.centroids);
+    }
+};
 
-    // return empty node if no triangles are left
-    if (num_triangles == 0) {
-        Node* node = new Node();
-        node->bbox = BoundingBox3f(bbox);
+/// Bins of the binned SAH along all three axes
+struct BVHBins {
+    BoundingBox3f bbox[3][BVH_BIN_COUNT];
+    uint32_t count[3][BVH_BIN_COUNT] = {};
 
-        // add to statistics
-        m_num_leaf_nodes++;
-        return node;
+    void merge(const BVHBins &other) {
+        for (int axis = 0; axis < 3; axis++) {
+            for (uint32_t bin = 0; bin < BVH_BIN_COUNT; bin++) {
+                bbox[axis][bin].expandBy(other.bbox[axis][bin]);
+                count[axis][bin] += other.count[axis][bin];
+            }
+        }
     }
+};
 
-    // create leaf node if 10 or less triangles are left or if the max recursion depth is reached.
-    if (num_triangles <= MAX_TRIANGLES_PER_NODE || recursion_depth >= MAX_RECURSION_DEPTH) {
-        Node* node = new Node();
-        node->num_triangles = num_triangles;
-        node->triangle_indices = new uint32_t[num_triangles];
-        node->mesh_indices = new uint32_t [num_triangles];
+float Accel::sweepSAH(const BoundingBox3f *bin_bboxes, const uint32_t *enter_counts, const uint32_t *exit_counts,
+        float parent_area, uint32_t &best_bin) const {
+    // sweep from the right to get the cost of everything above each plane
+    float right_cost[BVH_BIN_COUNT];
+    uint32_t right_counts[BVH_BIN_COUNT];
+    BoundingBox3f right_bbox;
+    uint32_t right_count = 0;
+    for (uint32_t bin = BVH_BIN_COUNT - 1; bin > 0; bin--) {
+        right_bbox.expandBy(bin_bboxes[bin]);
+        right_count += exit_counts[bin];
+        right_counts[bin] = right_count;
+        right_cost[bin] = right_count > 0 ? right_bbox.getSurfaceArea() * getLeafTestCount(right_count) : 0.f;
+    }
 
-        for (uint32_t i = 0; i < num_triangles; i++) {
-            node->triangle_indices[i] = triangle_indices[i];
-            node->mesh_indices[i] = mesh_indices[i];
+    // sweep from the left, plane 'bin' separates bins [0, bin] and [bin + 1, BVH_BIN_COUNT)
+    float best_cost = std::numeric_limits<float>::infinity();
+    BoundingBox3f left_bbox;
+    uint32_t left_count = 0;
+    for (uint32_t bin = 0; bin + 1 < BVH_BIN_COUNT; bin++) {
+        left_bbox.expandBy(bin_bboxes[bin]);
+        left_count += enter_counts[bin];
+        if (left_count == 0 || right_counts[bin + 1] == 0)
+            continue;
+        float cost = SAH_TRAVERSAL_COST + SAH_INTERSECTION_COST *
+            (left_bbox.getSurfaceArea() * getLeafTestCount(left_count) + right_cost[bin + 1]) / parent_area;
+        if (cost < best_cost) {
+            best_cost = cost;
+            best_bin = bin;
         }
-        node->bbox = BoundingBox3f(bbox);
+    }
+    return best_cost;
+}
 
-        // add to statistics
-        m_num_leaf_nodes++;
-        m_num_nonempty_leaf_nodes++;
-        m_num_triangles_saved += num_triangles;
-        return node;
+void Accel::buildBVHRecursive(NodeArray& nodes, uint32_t node_idx, std::vector<uint32_t>& order, uint32_t begin,
+        uint32_t end, const std::vector<BoundingBox3f>& bounds, uint32_t recursion_depth) {
+    BVHRangeBounds range_bounds = accumulate<BVHRangeBounds>(begin, end, [&](BVHRangeBounds &value, uint32_t i) {
+        value.bbox.expandBy(bounds[order[i]]);
+        value.centroids.expandBy(bounds[order[i]].getCenter());
+    });
+    const BoundingBox3f &bbox = range_bounds.bbox, &centroid_bbox = range_bounds.centroids;
+    nodes[node_idx].bbox = bbox;
+
+    uint32_t num_triangles = end - begin;
+    float leaf_cost = SAH_INTERSECTION_COST * getLeafTestCount(num_triangles);
+
+    // sort the primitives into bins along all axes in one pass
+    Vector3f scale;
+    for (int axis = 0; axis < 3; axis++) {
+        float extent = centroid_bbox.max[axis] - centroid_bbox.min[axis];
+        scale[axis] = extent > 0.f ? BVH_BIN_COUNT / extent : 0.f;
+    }
+    auto bin_index = [&](const Point3f &center, int axis) {
+        return std::min((uint32_t) ((center[axis] - centroid_bbox.min[axis]) * scale[axis]), BVH_BIN_COUNT - 1);
+    };
+    BVHBins bins;
+    if (num_triangles > 1) {
+        bins = accumulate<BVHBins>(begin, end, [&](BVHBins &value, uint32_t i) {
+            const BoundingBox3f& prim_bbox = bounds[order[i]];
+            Point3f center = prim_bbox.getCenter();
+            for (int axis = 0; axis < 3; axis++) {
+                uint32_t bin = bin_index(center, axis);
+                value.bbox[axis][bin].expandBy(prim_bbox);
+                value.count[axis][bin]++;
+            }
+        });
     }
 
-    // create new parent node
-    Node* node = new Node();
-    node->bbox = BoundingBox3f(bbox);
+    // find the cheapest split plane between the bins along every axis
+    float best_cost = std::numeric_limits<float>::infinity();
+    int best_axis = -1;
+    uint32_t best_bin = 0;
+    for (int axis = 0; axis < 3 && num_triangles > 1; axis++) {
+        if (!(scale[axis] > 0.f))
+            continue;
 
-    BoundingBox3f child_bboxes[8] = {};
-    subdivideBBox(bbox, child_bboxes);
+        uint32_t bin;
+        float cost = sweepSAH(bins.bbox[axis], bins.count[axis], bins.count[axis], bbox.getSurfaceArea(), bin);
+        if (cost < best_cost) {
+            best_cost = cost;
+            best_axis = axis;
+            best_bin = bin;
+        }
+    }
 
-    std::vector<std::vector<uint32_t>> child_triangle_indices(8);
-    std::vector<std::vector<uint32_t>> child_mesh_indices(8);
+    // keep the depth (and hence the traversal stack) bounded
+    bool force_leaf = recursion_depth >= BVH_MAX_DEPTH;
 
-    uint32_t child_num_triangles[8] = {};
+    uint32_t mid;
+    if (force_leaf) {
+        mid = begin;
+    } else if (best_axis >= 0 && (best_cost < leaf_cost || num_triangles > BVH_MAX_TRIANGLES_PER_LEAF)) {
+        mid = partition(order, begin, end, [&](uint32_t prim) {
+            return bin_index(bounds[prim].getCenter(), best_axis) <= best_bin;
+        });
+    } else if (num_triangles > BVH_MAX_TRIANGLES_PER_LEAF) {
+        // all centroids coincide, split the list in half
+        mid = begin + num_triangles / 2;
+    } else {
+        force_leaf = true;
+    }
 
-    // place every triangle in the children it overlaps with
-    // for every child bbox
-    for (uint32_t i = 0; i < 8; i++) {
-        // for every triangle inside of the parent create triangle bounding box
-        for (uint32_t j = 0; j < num_triangles; j++) {
-            // for every triangle vertex expand triangle bbox
-            uint32_t triangle_idx = triangle_indices[j];
-            uint32_t mesh_idx = mesh_indices[j];
-            BoundingBox3f triangle_bbox = m_meshes[mesh_idx]->getBoundingBox(triangle_idx);
+    if (force_leaf) {
+        if (num_triangles >= (1u << 23))
+            throw NoriException("Accel: too many triangles (%i) in a BVH leaf!", num_triangles);
+        Node& node = nodes[node_idx];
+        node.offset = begin;
+        node.count = num_triangles;
+        node.leaf = 1;
+        return;
+    }
+
+    // both children are allocated before either subtree so that they stay adjacent
+    uint32_t first_child = allocateNodes(nodes, 2);
+    Node& node = nodes[node_idx];
+    node.offset = first_child;
+    node.count = 2;
+    node.leaf = 0;
+
+    auto build_left = [&] {
+        buildBVHRecursive(nodes, first_child, order, begin, mid, bounds, recursion_depth + 1);
+    };
+    auto build_right = [&] {
+        buildBVHRecursive(nodes, first_child + 1, order, mid, end, bounds, recursion_depth + 1);
+    };
+    if (num_triangles >= BUILD_TASK_THRESHOLD) {
+        tbb::parallel_invoke(build_left, build_right);
+    } else {
+        build_left();
+        build_right();
+    }
+}
+
+void Accel::splitReference(const PrimRef &prim, const BoundingBox3f &bbox, int axis, float position,
+        BoundingBox3f &left, BoundingBox3f &right) const {
+    const MatrixXf& V = m_meshes[prim.mesh]->getVertexPositions();
+    const MatrixXu& F = m_meshes[prim.mesh]->getIndices();
+
+    // walk the edges of the triangle and add every vertex and plane crossing to the side(s) it lies on
+    left.reset();
+    right.reset();
+    for (int i = 0; i < 3; i++) {
+        Point3f v0 = V.col(F(i, prim.triangle)), v1 = V.col(F((i + 1) % 3, prim.triangle));
+        if (v0[axis] <= position)
+            left.expandBy(v0);
+        if (v0[axis] >= position)
+            right.expandBy(v0);
+        if ((v0[axis] < position && v1[axis] > position) || (v0[axis] > position && v1[axis] < position)) {
+            Point3f crossing = v0 + (v1 - v0) * ((position - v0[axis]) / (v1[axis] - v0[axis]));
+            crossing[axis] = position;
+            left.expandBy(crossing);
+            right.expandBy(crossing);
+        }
+    }
+
+    // the reference may already have been clipped by earlier splits
+    left.clip(bbox);
+    right.clip(bbox);
+    left.max[axis] = std::min(left.max[axis], position);
+    right.min[axis] = std::max(right.min[axis], position);
+}
+
+/// Spatial split bins: boxes of the clipped references, and where references start and end
+struct SBVHBins {
+    BoundingBox3f bbox[BVH_BIN_COUNT];
+    uint32_t enter[BVH_BIN_COUNT] = {};
+    uint32_t exit[BVH_BIN_COUNT] = {};
+};
 
-            // check if triangle is in bbox, if so put triangle index into triangle list of child
-            if (child_bboxes[i].overlaps(triangle_bbox)) {
-                child_triangle_indices[i].emplace_back(triangle_idx);
-                child_mesh_indices[i].emplace_back(mesh_idx);
-                child_num_triangles[i]++;
+void Accel::buildSBVHRecursive(SpatialBuild& build, uint32_t node_idx, std::vector<SpatialReference>& refs,
+        uint32_t budget, uint32_t recursion_depth) {
+    uint32_t num_refs = (uint32_t) refs.size();
+    BVHRangeBounds range_bounds = accumulate<BVHRangeBounds>(0, num_refs, [&](BVHRangeBounds &value, uint32_t i) {
+        value.bbox.expandBy(refs[i].bbox);
+        value.centroids.expandBy(refs[i].bbox.getCenter());
+    });
+    const BoundingBox3f &bbox = range_bounds.bbox, &centroid_bbox = range_bounds.centroids;
+    build.nodes[node_idx].bbox = bbox;
+    float leaf_cost = SAH_INTERSECTION_COST * getLeafTestCount(num_refs);
+
+    // object splits, exactly as in buildBVHRecursive()
+    Vector3f scale;
+    for (int axis = 0; axis < 3; axis++) {
+        float extent = centroid_bbox.max[axis] - centroid_bbox.min[axis];
+        scale[axis] = extent > 0.f ? BVH_BIN_COUNT / extent : 0.f;
+    }
+    auto bin_index = [&](const Point3f &center, int axis) {
+        return std::min((uint32_t) ((center[axis] - centroid_bbox.min[axis]) * scale[axis]), BVH_BIN_COUNT - 1);
+    };
+    BVHBins bins;
+    float object_cost = std::numeric_limits<float>::infinity();
+    int object_axis = -1;
+    uint32_t object_bin = 0;
+    if (num_refs > 1) {
+        bins = accumulate<BVHBins>(0, num_refs, [&](BVHBins &value, uint32_t i) {
+            Point3f center = refs[i].bbox.getCenter();
+            for (int axis = 0; axis < 3; axis++) {
+                uint32_t bin = bin_index(center, axis);
+                value.bbox[axis][bin].expandBy(refs[i].bbox);
+                value.count[axis][bin]++;
+            }
+        });
+        for (int axis = 0; axis < 3; axis++) {
+            uint32_t bin;
+            float cost = scale[axis] > 0.f ? sweepSAH(bins.bbox[axis], bins.count[axis], bins.count[axis],
+                                                      bbox.getSurfaceArea(), bin)
+                                           : std::numeric_limits<float>::infinity();
+            if (cost < object_cost) {
+                object_cost = cost;
+                object_axis = axis;
+                object_bin = bin;
             }
         }
     }
 
-    // release memory to avoid stack overflow
-    triangle_indices = std::vector<uint32_t>();
-    mesh_indices = std::vector<uint32_t>();
-
-    // for every child bbox
-    Node* last_child = nullptr;
-    for (uint32_t i = 0; i < 8; i++) {   
-        // first child
-        if (i == 0) {
-            node->child = buildRecursive(child_bboxes[i], child_triangle_indices[i], child_mesh_indices[i], recursion_depth + 1);
-            last_child = node->child;
-        // neighbour children
+    /* Spatial splits only pay off if the children of the best object split
+       overlap noticeably, and they need some budget for duplicates left */
+    float overlap = 0.f;
+    if (object_axis >= 0 && budget > 0) {
+        BoundingBox3f left_bbox, right_bbox;
+        for (uint32_t bin = 0; bin < BVH_BIN_COUNT; bin++)
+            (bin <= object_bin ? left_bbox : right_bbox).expandBy(bins.bbox[object_axis][bin]);
+        BoundingBox3f overlap_bbox = left_bbox;
+        overlap_bbox.clip(right_bbox);
+        if (overlap_bbox.isValid())
+            overlap = overlap_bbox.getSurfaceArea() / build.root_area;
+    }
+    Vector3f spatial_scale = Vector3f::Zero();
+    auto spatial_bin = [&](float position, int axis) {
+        return std::min((uint32_t) std::max((position - bbox.min[axis]) * spatial_scale[axis], 0.f), BVH_BIN_COUNT - 1);
+    };
+    auto plane = [&](uint32_t bin, int axis) {
+        return bbox.min[axis] + (bin + 1) * (bbox.max[axis] - bbox.min[axis]) / BVH_BIN_COUNT;
+    };
+    float spatial_cost = std::numeric_limits<float>::infinity();
+    int spatial_axis = -1;
+    uint32_t spatial_bin_idx = 0;
+    if (overlap > SBVH_MIN_OVERLAP) {
+        for (int axis = 0; axis < 3; axis++) {
+            float extent = bbox.max[axis] - bbox.min[axis];
+            spatial_scale[axis] = extent > 0.f ? BVH_BIN_COUNT / extent : 0.f;
+        }
+        for (int axis = 0; axis < 3; axis++) {
+            if (!(spatial_scale[axis] > 0.f))
+                continue;
+            // chop every reference into the bins it spans
+            SBVHBins spatial_bins;
+            for (const SpatialReference& ref : refs) {
+                uint32_t first = spatial_bin(ref.bbox.min[axis], axis), last = spatial_bin(ref.bbox.max[axis], axis);
+                spatial_bins.enter[first]++;
+                spatial_bins.exit[last]++;
+                SpatialReference rest = ref;
+                for (uint32_t bin = first; bin < last; bin++) {
+                    BoundingBox3f left, right;
+                    splitReference(build.prims[ref.prim], rest.bbox, axis, plane(bin, axis), left, right);
+                    if (left.isValid())
+                        spatial_bins.bbox[bin].expandBy(left);
+                    rest.bbox = right;
+                }
+                if (rest.bbox.isValid())
+                    spatial_bins.bbox[last].expandBy(rest.bbox);
+            }
+            uint32_t bin;
+            float cost = sweepSAH(spatial_bins.bbox, spatial_bins.enter, spatial_bins.exit, bbox.getSurfaceArea(), bin);
+            if (cost < spatial_cost) {
+                spatial_cost = cost;
+                spatial_axis = axis;
+                spatial_bin_idx = bin;
+            }
+        }
+    }
+
+    // keep the depth (and hence the traversal stack) bounded
+    bool force_leaf = recursion_depth >= BVH_MAX_DEPTH;
+    float best_cost = std::min(object_cost, spatial_cost);
+    bool split = !force_leaf && best_cost < std::numeric_limits<float>::infinity() &&
+                 (best_cost < leaf_cost || num_refs > BVH_MAX_TRIANGLES_PER_LEAF);
+
+    std::vector<SpatialReference> left_refs, right_refs;
+    uint32_t duplicates = 0;
+    if (split && spatial_cost < object_cost) {
+        float position = plane(spatial_bin_idx, spatial_axis);
+        for (const SpatialReference& ref : refs) {
+            if (spatial_bin(ref.bbox.max[spatial_axis], spatial_axis) <= spatial_bin_idx) {
+                left_refs.push_back(ref);
+            } else if (spatial_bin(ref.bbox.min[spatial_axis], spatial_axis) > spatial_bin_idx) {
+                right_refs.push_back(ref);
+            } else {
+                SpatialReference left{ BoundingBox3f(), ref.prim }, right{ BoundingBox3f(), ref.prim };
+                splitReference(build.prims[ref.prim], ref.bbox, spatial_axis, position, left.bbox, right.bbox);
+                if (left.bbox.isValid())
+                    left_refs.push_back(left);
+                if (right.bbox.isValid())
+                    right_refs.push_back(right);
+                if (left.bbox.isValid() && right.bbox.isValid())
+                    duplicates++;
+            }
+        }
+        if (duplicates <= budget && !left_refs.empty() && !right_refs.empty()) {
+            build.num_splits++;
         } else {
-            last_child->next = buildRecursive(child_bboxes[i], child_triangle_indices[i], child_mesh_indices[i], recursion_depth + 1);
-            last_child = last_child->next;
+            // over budget or no progress, fall back to the best object split
+            left_refs.clear();
+            right_refs.clear();
+            duplicates = 0;
+            split = object_axis >= 0 && (object_cost < leaf_cost || num_refs > BVH_MAX_TRIANGLES_PER_LEAF);
+            spatial_cost = std::numeric_limits<float>::infinity();
         }
-        m_recursion_depth = std::max(m_recursion_depth, recursion_depth + 1);
     }
-    return node;
+    if (split && !(spatial_cost < object_cost)) {
+        for (const SpatialReference& ref : refs)
+            (bin_index(ref.bbox.getCenter(), object_axis) <= object_bin ? left_refs : right_refs).push_back(ref);
+    } else if (!split && !force_leaf && num_refs > BVH_MAX_TRIANGLES_PER_LEAF) {
+        // all centroids coincide, split the list in half
+        left_refs.assign(refs.begin(), refs.begin() + num_refs / 2);
+        right_refs.assign(refs.begin() + num_refs / 2, refs.end());
+        split = true;
+    }
+
+    if (!split) {
+        if (num_refs >= (1u << 23))
+            throw NoriException("Accel: too many triangles (%i) in a BVH leaf!", num_refs);
+        Node& node = build.nodes[node_idx];
+        node.offset = (uint32_t) (build.leaf_prims.grow_by(num_refs) - build.leaf_prims.begin());
+        node.count = num_refs;
+        node.leaf = 1;
+        for (uint32_t i = 0; i < num_refs; i++)
+            build.leaf_prims[node.offset + i] = build.prims[refs[i].prim];
+        return;
+    }
+
+    // release memory to avoid stack overflow
+    refs = std::vector<SpatialReference>();
+
+    // the remaining budget is shared in proportion to the size of the children
+    uint32_t remaining = budget - duplicates;
+    uint32_t left_budget = (uint32_t) ((uint64_t) remaining * left_refs.size() / (left_refs.size() + right_refs.size()));
+
+    uint32_t first_child = allocateNodes(build.nodes, 2);
+    Node& node = build.nodes[node_idx];
+    node.offset = first_child;
+    node.count = 2;
+    node.leaf = 0;
+
+    auto build_left = [&] {
+        buildSBVHRecursive(build, first_child, left_refs, left_budget, recursion_depth + 1);
+    };
+    auto build_right = [&] {
+        buildSBVHRecursive(build, first_child + 1, right_refs, remaining - left_budget, recursion_depth + 1);
+    };
+    if (num_refs >= BUILD_TASK_THRESHOLD) {
+        tbb::parallel_invoke(build_left, build_right);
+    } else {
+        build_left();
+        build_right();
+    }
 }
 
-bool Accel::traverseRecursive(const Node& node, Ray3f &ray, Intersection &its, bool shadowRay, uint32_t& hit_idx) const {
-    bool foundIntersection = false;
+/// Spread the lowest 10 bits of x so that there are two zero bits between consecutive bits
+static inline uint32_t expandBits(uint32_t x) {
+    x = (x | (x << 16)) & 0x030000FFu;
+    x = (x | (x << 8)) & 0x0300F00Fu;
+    x = (x | (x << 4)) & 0x030C30C3u;
+    x = (x | (x << 2)) & 0x09249249u;
+    return x;
+}
 
-    // only check triangles of node and its children if ray intersects with node bbox
-    if (!node.bbox.rayIntersect(ray)) {
-        return false;
+/// Spread the lowest 21 bits of x so that there are two zero bits between consecutive bits
+static inline uint64_t expandBits(uint64_t x) {
+    x &= 0x1FFFFFull;
+    x = (x | (x << 32)) & 0x001F00000000FFFFull;
+    x = (x | (x << 16)) & 0x001F0000FF0000FFull;
+    x = (x | (x << 8)) & 0x100F00F00F00F00Full;
+    x = (x | (x << 4)) & 0x10C30C30C30C30C3ull;
+    x = (x | (x << 2)) & 0x1249249249249249ull;
+    return x;
+}
+
+/// Morton code of a point in the unit cube: 30 bits for \c uint32_t, 63 bits for \c uint64_t
+template <typename Code> static inline Code mortonCode(const Point3f &p) {
+    const float scale = (float) (1u << (sizeof(Code) == 4 ? 10 : 21));
+    Code code = 0;
+    for (int axis = 0; axis < 3; axis++) {
+        Code cell = (Code) std::min(std::max(p[axis] * scale, 0.f), scale - 1.f);
+        code |= expandBits(cell) << (2 - axis);
+    }
+    return code;
+}
+
+/**
+ * Stable least significant digit radix sort of (code, index) pairs with
+ * 8-bit digits. Every pass histograms blocks of the input in parallel and
+ * then scatters each block to its own precomputed offsets. Passes over a
+ * digit that is the same for all codes are skipped.
+ */
+template <typename Code> static void radixSort(std::vector<Code>& codes, std::vector<uint32_t>& order) {
+    const uint32_t size = (uint32_t) codes.size();
+    const uint32_t num_blocks = std::max((size + BUILD_GRAIN_SIZE - 1) / BUILD_GRAIN_SIZE, 1u);
+    std::vector<Code> codes_tmp(size);
+    std::vector<uint32_t> order_tmp(size);
+    std::vector<uint32_t> histograms(num_blocks * 256);
+
+    for (uint32_t shift = 0; shift < 8 * sizeof(Code); shift += 8) {
+        std::fill(histograms.begin(), histograms.end(), 0);
+        tbb::parallel_for(0u, num_blocks, [&](uint32_t block) {
+            uint32_t* histogram = &histograms[block * 256];
+            uint32_t block_end = std::min((block + 1) * BUILD_GRAIN_SIZE, size);
+            for (uint32_t i = block * BUILD_GRAIN_SIZE; i < block_end; i++)
+                histogram[(codes[i] >> shift) & 0xFF]++;
+        });
+
+        // exclusive prefix sum in digit-major order, which keeps the sort stable
+        uint32_t sum = 0;
+        bool constant_digit = false;
+        for (uint32_t digit = 0; digit < 256; digit++) {
+            uint32_t digit_count = 0;
+            for (uint32_t block = 0; block < num_blocks; block++) {
+                uint32_t count = histograms[block * 256 + digit];
+                histograms[block * 256 + digit] = sum;
+                sum += count;
+                digit_count += count;
+            }
+            constant_digit |= digit_count == size;
+        }
+        if (constant_digit)
+            continue;
+
+        tbb::parallel_for(0u, num_blocks, [&](uint32_t block) {
+            uint32_t* offsets = &histograms[block * 256];
+            uint32_t block_end = std::min((block + 1) * BUILD_GRAIN_SIZE, size);
+            for (uint32_t i = block * BUILD_GRAIN_SIZE; i < block_end; i++) {
+                uint32_t dest = offsets[(codes[i] >> shift) & 0xFF]++;
+                codes_tmp[dest] = codes[i];
+                order_tmp[dest] = order[i];
+            }
+        });
+        codes.swap(codes_tmp);
+        order.swap(order_tmp);
+    }
+}
+
+template <typename Code> double Accel::buildLinearBVH(NodeArray& nodes, uint32_t root, std::vector<uint32_t>& order,
+        const std::vector<BoundingBox3f>& bounds) {
+    Timer timer;
+    uint32_t num_triangles = (uint32_t) order.size();
+    BVHRangeBounds range_bounds = accumulate<BVHRangeBounds>(0, num_triangles, [&](BVHRangeBounds &value, uint32_t i) {
+        value.centroids.expandBy(bounds[i].getCenter());
+    });
+    const BoundingBox3f& centroid_bbox = range_bounds.centroids;
+    Vector3f scale;
+    for (int axis = 0; axis < 3; axis++) {
+        float extent = centroid_bbox.max[axis] - centroid_bbox.min[axis];
+        scale[axis] = extent > 0.f ? 1.f / extent : 0.f;
+    }
+
+    std::vector<Code> codes(num_triangles);
+    tbb::parallel_for(tbb::blocked_range<uint32_t>(0, num_triangles, BUILD_GRAIN_SIZE),
+        [&](const tbb::blocked_range<uint32_t> &range) {
+            for (uint32_t i = range.begin(); i != range.end(); ++i) {
+                Point3f p = (bounds[i].getCenter() - centroid_bbox.min).cwiseProduct(scale);
+                codes[i] = mortonCode<Code>(p);
+            }
+        }
+    );
+    radixSort(codes, order);
+    double sort_time = timer.lap();
+
+    emitLinearBVH(nodes, root, codes, 0, num_triangles, order, bounds, 0);
+    return sort_time;
+}
+
+template <typename Code> void Accel::emitLinearBVH(NodeArray& nodes, uint32_t node_idx, const std::vector<Code>& codes,
+        uint32_t begin, uint32_t end, const std::vector<uint32_t>& order, const std::vector<BoundingBox3f>& bounds,
+        uint32_t recursion_depth) {
+    uint32_t num_triangles = end - begin;
+    uint32_t max_leaf_size = m_precompute ? NORI_SIMD_WIDTH : LBVH_MAX_TRIANGLES_PER_LEAF;
+
+    if (num_triangles <= max_leaf_size || recursion_depth >= BVH_MAX_DEPTH) {
+        if (num_triangles >= (1u << 23))
+            throw NoriException("Accel: too many triangles (%i) in a BVH leaf!", num_triangles);
+        Node& node = nodes[node_idx];
+        for (uint32_t i = begin; i < end; i++)
+            node.bbox.expandBy(bounds[order[i]]);
+        node.offset = begin;
+        node.count = num_triangles;
+        node.leaf = 1;
+        return;
+    }
+
+    // split where the highest bit that differs within the range flips, or in half if all codes are equal
+    uint32_t mid;
+    Code first_code = codes[begin], last_code = codes[end - 1];
+    if (first_code == last_code) {
+        mid = begin + num_triangles / 2;
+    } else {
+        Code highest_bit = Code(1) << (8 * sizeof(Code) - 1);
+        while (!((first_code ^ last_code) & highest_bit))
+            highest_bit >>= 1;
+        mid = (uint32_t) (std::partition_point(codes.begin() + begin, codes.begin() + end, [&](Code code) {
+            return !(code & highest_bit);
+        }) - codes.begin());
+    }
+
+    uint32_t first_child = allocateNodes(nodes, 2);
+    auto build_left = [&] {
+        emitLinearBVH(nodes, first_child, codes, begin, mid, order, bounds, recursion_depth + 1);
+    };
+    auto build_right = [&] {
+        emitLinearBVH(nodes, first_child + 1, codes, mid, end, order, bounds, recursion_depth + 1);
+    };
+    if (num_triangles >= BUILD_TASK_THRESHOLD) {
+        tbb::parallel_invoke(build_left, build_right);
+    } else {
+        build_left();
+        build_right();
+    }
+
+    // the bounds are gathered on the way back up
+    Node& node = nodes[node_idx];
+    node.bbox = nodes[first_child].bbox;
+    node.bbox.expandBy(nodes[first_child + 1].bbox);
+    node.offset = first_child;
+    node.count = 2;
+    node.leaf = 0;
+}
+
+float Accel::restructureTreelets(uint32_t node_idx, std::vector<float>& costs, uint32_t recursion_depth) {
+    const Node& node = m_nodes[node_idx];
+    float area = node.bbox.getSurfaceArea();
+    if (node.leaf)
+        return costs[node_idx] = SAH_INTERSECTION_COST * getLeafTestCount(node.count) * area;
+
+    // the subtrees are disjoint, so they can be restructured concurrently before their parent
+    uint32_t first_child = node.offset;
+    auto restructure_left = [&] { restructureTreelets(first_child, costs, recursion_depth + 1); };
+    auto restructure_right = [&] { restructureTreelets(first_child + 1, costs, recursion_depth + 1); };
+    if (recursion_depth < LBVH_TASK_DEPTH) {
+        tbb::parallel_invoke(restructure_left, restructure_right);
+    } else {
+        restructure_left();
+        restructure_right();
+    }
+    costs[node_idx] = SAH_TRAVERSAL_COST * area + costs[first_child] + costs[first_child + 1];
+
+    optimizeTreelet(node_idx, costs);
+    return costs[node_idx];
+}
+
+void Accel::optimizeTreelet(uint32_t root_idx, std::vector<float>& costs) {
+    // grow the treelet by opening the interior leaf with the largest area
+    uint32_t leaves[TREELET_LEAF_COUNT];
+    uint32_t pairs[TREELET_LEAF_COUNT - 1]; // first child of every interior treelet node
+    uint32_t num_leaves = 2, num_pairs = 1;
+    leaves[0] = m_nodes[root_idx].offset;
+    leaves[1] = m_nodes[root_idx].offset + 1;
+    pairs[0] = m_nodes[root_idx].offset;
+    while (num_leaves < TREELET_LEAF_COUNT) {
+        int largest = -1;
+        float largest_area = 0.f;
+        for (uint32_t i = 0; i < num_leaves; i++) {
+            const Node& leaf = m_nodes[leaves[i]];
+            if (!leaf.leaf && (largest < 0 || leaf.bbox.getSurfaceArea() > largest_area)) {
+                largest = (int) i;
+                largest_area = leaf.bbox.getSurfaceArea();
+            }
+        }
+        if (largest < 0)
+            break;
+        uint32_t first_child = m_nodes[leaves[largest]].offset;
+        pairs[num_pairs++] = first_child;
+        leaves[largest] = first_child;
+        leaves[num_leaves++] = first_child + 1;
+    }
+    if (num_leaves < 3)
+        return;
+
+    // cheapest binary tree over every subset of the leaves, subsets only contain smaller ones
+    const uint32_t num_subsets = 1u << num_leaves;
+    BoundingBox3f subset_bbox[1 << TREELET_LEAF_COUNT];
+    float subset_cost[1 << TREELET_LEAF_COUNT];
+    uint8_t subset_split[1 << TREELET_LEAF_COUNT];
+    for (uint32_t subset = 1; subset < num_subsets; subset++) {
+        uint32_t lowest = subset & (0u - subset);
+        if (subset == lowest) {
+            uint32_t i = (uint32_t) lowestLane((int) subset);
+            subset_bbox[subset] = m_nodes[leaves[i]].bbox;
+            subset_cost[subset] = costs[leaves[i]];
+            continue;
+        }
+        subset_bbox[subset] = subset_bbox[subset ^ lowest];
+        subset_bbox[subset].expandBy(subset_bbox[lowest]);
+
+        // every partition is visited once by requiring the lowest leaf on the left
+        float best_cost = std::numeric_limits<float>::infinity();
+        for (uint32_t left = (subset - 1) & subset; left != 0; left = (left - 1) & subset) {
+            if (!(left & lowest))
+                continue;
+            float cost = subset_cost[left] + subset_cost[subset ^ left];
+            if (cost < best_cost) {
+                best_cost = cost;
+                subset_split[subset] = (uint8_t) left;
+            }
+        }
+        subset_cost[subset] = SAH_TRAVERSAL_COST * subset_bbox[subset].getSurfaceArea() + best_cost;
+    }
+
+    const uint32_t all = num_subsets - 1;
+    if (!(subset_cost[all] < costs[root_idx] * (1.f - 1e-5f)))
+        return;
+
+    // rebuild the treelet, reusing the sibling pairs of its interior nodes
+    Node leaf_nodes[TREELET_LEAF_COUNT];
+    float leaf_costs[TREELET_LEAF_COUNT];
+    for (uint32_t i = 0; i < num_leaves; i++) {
+        leaf_nodes[i] = m_nodes[leaves[i]];
+        leaf_costs[i] = costs[leaves[i]];
+    }
+    std::pair<uint32_t, uint32_t> stack[TREELET_LEAF_COUNT];
+    uint32_t stack_size = 0, next_pair = 0;
+    stack[stack_size++] = std::make_pair(root_idx, all);
+    while (stack_size > 0) {
+        uint32_t slot = stack[stack_size - 1].first, subset = stack[stack_size - 1].second;
+        stack_size--;
+        if ((subset & (subset - 1)) == 0) {
+            uint32_t i = (uint32_t) lowestLane((int) subset);
+            m_nodes[slot] = leaf_nodes[i];
+            costs[slot] = leaf_costs[i];
+            continue;
+        }
+        uint32_t first_child = pairs[next_pair++];
+        Node& node = m_nodes[slot];
+        node.bbox = subset_bbox[subset];
+        node.offset = first_child;
+        node.count = 2;
+        node.flags = 0;
+        node.leaf = 0;
+        costs[slot] = subset_cost[subset];
+        stack[stack_size++] = std::make_pair(first_child, (uint32_t) subset_split[subset]);
+        stack[stack_size++] = std::make_pair(first_child + 1, subset ^ subset_split[subset]);
+    }
+}
+
+void Accel::buildTriangleGroups() {
+    // every leaf gets a contiguous range of groups
+    std::vector<uint32_t> leaves;
+    std::vector<uint32_t> first_groups;
+    uint32_t num_groups = 0;
+    for (uint32_t i = 0; i < m_nodes.size(); i++) {
+        if (!m_nodes[i].leaf)
+            continue;
+        leaves.push_back(i);
+        first_groups.push_back(num_groups);
+        num_groups += getLeafTestCount(m_nodes[i].count);
     }
+    m_groups.resize(num_groups);
 
-    // search through all triangles in node
-    for (uint32_t i = 0; i < node.num_triangles; ++i) {
+    tbb::parallel_for(tbb::blocked_range<uint32_t>(0, (uint32_t) leaves.size(), BUILD_GRAIN_SIZE / 8),
+        [&](const tbb::blocked_range<uint32_t> &range) {
+            for (uint32_t leaf = range.begin(); leaf != range.end(); ++leaf) {
+                Node& node = m_nodes[leaves[leaf]];
+                for (uint32_t i = 0; i < node.count; i += NORI_SIMD_WIDTH)
+                    fillTriangleGroup(m_groups[first_groups[leaf] + i / NORI_SIMD_WIDTH], &m_prims[node.offset + i],
+                                      std::min<uint32_t>(node.count - i, NORI_SIMD_WIDTH));
+                node.offset = first_groups[leaf];
+            }
+        }
+    );
+
+    // the groups carry their own triangle references
+    m_prims = std::vector<PrimRef>();
+}
+
+void Accel::fillTriangleGroup(TriangleGroup& group, const PrimRef* prims, uint32_t count) const {
+    for (uint32_t lane = 0; lane < NORI_SIMD_WIDTH; lane++) {
+        Point3f p0 = Point3f::Zero();
+        Vector3f edge1 = Vector3f::Zero(), edge2 = Vector3f::Zero();
+        PrimRef prim{ 0, 0 };
+        if (lane < count) {
+            prim = prims[lane];
+            const MatrixXf& V = m_meshes[prim.mesh]->getVertexPositions();
+            const MatrixXu& F = m_meshes[prim.mesh]->getIndices();
+            p0 = V.col(F(0, prim.triangle));
+            edge1 = V.col(F(1, prim.triangle)) - p0;
+            edge2 = V.col(F(2, prim.triangle)) - p0;
+        }
+        for (int k = 0; k < 3; k++) {
+            group.p0[k][lane] = p0[k];
+            group.edge1[k][lane] = edge1[k];
+            group.edge2[k][lane] = edge2[k];
+        }
+        group.mesh[lane] = prim.mesh;
+        group.triangle[lane] = prim.triangle;
+    }
+}
+
+uint32_t Accel::collapseBVH(const std::vector<Node>& nodes, std::vector<WideNode>& wide_nodes, uint32_t node_idx) {
+    // start from the two children and keep opening the interior one with the largest area until all slots are used
+    uint32_t children[NORI_SIMD_WIDTH];
+    uint32_t num_children = 0;
+    const Node& root = nodes[node_idx];
+    if (root.leaf) {
+        children[num_children++] = node_idx;
+    } else {
+        children[num_children++] = root.offset;
+        children[num_children++] = root.offset + 1;
+    }
+    while (num_children < NORI_SIMD_WIDTH) {
+        int largest = -1;
+        float largest_area = 0.f;
+        for (uint32_t i = 0; i < num_children; i++) {
+            const Node& child = nodes[children[i]];
+            if (!child.leaf && (largest < 0 || child.bbox.getSurfaceArea() > largest_area)) {
+                largest = (int) i;
+                largest_area = child.bbox.getSurfaceArea();
+            }
+        }
+        if (largest < 0)
+            break;
+        uint32_t first_grandchild = nodes[children[largest]].offset;
+        children[largest] = first_grandchild;
+        children[num_children++] = first_grandchild + 1;
+    }
+
+    uint32_t wide_idx = (uint32_t) wide_nodes.size();
+    wide_nodes.emplace_back();
+
+    // filled in locally since the recursion may reallocate wide_nodes
+    WideNode wide;
+    for (uint32_t i = 0; i < NORI_SIMD_WIDTH; i++) {
+        if (i >= num_children || (nodes[children[i]].leaf && nodes[children[i]].count == 0)) {
+            for (int k = 0; k < 3; k++) {
+                wide.bounds[k][i] = std::numeric_limits<float>::infinity();
+                wide.bounds[k + 3][i] = -std::numeric_limits<float>::infinity();
+            }
+            wide.child[i] = wide.count[i] = 0;
+            continue;
+        }
+        const Node& child = nodes[children[i]];
+        for (int k = 0; k < 3; k++) {
+            wide.bounds[k][i] = child.bbox.min[k];
+            wide.bounds[k + 3][i] = child.bbox.max[k];
+        }
+        wide.child[i] = child.leaf ? child.offset : collapseBVH(nodes, wide_nodes, children[i]);
+        wide.count[i] = child.leaf ? child.count : 0;
+    }
+    wide_nodes[wide_idx] = wide;
+    return wide_idx;
+}
+
+void Accel::reorderNodes() {
+    if (m_node_layout == EDepthFirst || m_wide_nodes.empty())
+        return;  // the wide nodes are built in depth-first order
+
+    // order[i] is the node that is stored at index i, the root stays first
+    std::vector<uint32_t> order;
+    order.reserve(m_wide_nodes.size());
+    if (m_node_layout == EVanEmdeBoas) {
+        uint32_t height = 0;
+        std::vector<std::pair<uint32_t, uint32_t>> stack{ { 0, 1 } };
+        while (!stack.empty()) {
+            std::pair<uint32_t, uint32_t> entry = stack.back();
+            stack.pop_back();
+            height = std::max(height, entry.second);
+            const WideNode& node = m_wide_nodes[entry.first];
+            for (uint32_t i = 0; i < NORI_SIMD_WIDTH; i++) {
+                if (node.count[i] == 0 && node.bounds[0][i] != std::numeric_limits<float>::infinity())
+                    stack.emplace_back(node.child[i], entry.second + 1);
+            }
+        }
+        layoutVanEmdeBoas(0, height, order);
+    } else {
+        // a child is visited with the probability of its area relative to the treelet root
+        std::vector<float> area(m_wide_nodes.size(), 0.f);
+        for (const WideNode& node : m_wide_nodes) {
+            for (uint32_t i = 0; i < NORI_SIMD_WIDTH; i++) {
+                if (node.count[i] == 0 && node.bounds[0][i] != std::numeric_limits<float>::infinity())
+                    area[node.child[i]] = getChildBounds(node, i).getSurfaceArea();
+            }
+        }
+        size_t node_size = m_quantization_bits == 8 ? sizeof(QuantizedNode<uint8_t>) :
+                           m_quantization_bits == 16 ? sizeof(QuantizedNode<uint16_t>) : sizeof(WideNode);
+        size_t treelet_size = std::max<size_t>(1, NODE_LAYOUT_BLOCK_SIZE / node_size);
+
+        // grow every treelet by the largest child of its nodes, the remaining children start new treelets
+        std::vector<uint32_t> roots{ 0 }, frontier;
+        while (!roots.empty()) {
+            frontier.assign(1, roots.back());
+            roots.pop_back();
+            for (size_t size = 0; size < treelet_size && !frontier.empty(); size++) {
+                size_t largest = 0;
+                for (size_t j = 1; j < frontier.size(); j++) {
+                    if (area[frontier[j]] > area[frontier[largest]])
+                        largest = j;
+                }
+                uint32_t node_idx = frontier[largest];
+                frontier.erase(frontier.begin() + largest);
+                order.push_back(node_idx);
+                const WideNode& node = m_wide_nodes[node_idx];
+                for (uint32_t i = 0; i < NORI_SIMD_WIDTH; i++) {
+                    if (node.count[i] == 0 && node.bounds[0][i] != std::numeric_limits<float>::infinity())
+                        frontier.push_back(node.child[i]);
+                }
+            }
+            // the treelet below the largest remaining child is stored next
+            std::sort(frontier.begin(), frontier.end(), [&](uint32_t a, uint32_t b) { return area[a] < area[b]; });
+            roots.insert(roots.end(), frontier.begin(), frontier.end());
+        }
+    }
+
+    std::vector<uint32_t> new_index(m_wide_nodes.size());
+    for (uint32_t i = 0; i < (uint32_t) order.size(); i++)
+        new_index[order[i]] = i;
+    std::vector<WideNode> nodes(m_wide_nodes.size());
+    tbb::parallel_for(tbb::blocked_range<uint32_t>(0, (uint32_t) order.size(), BUILD_GRAIN_SIZE),
+        [&](const tbb::blocked_range<uint32_t> &range) {
+            for (uint32_t i = range.begin(); i != range.end(); ++i) {
+                WideNode& node = nodes[i];
+                node = m_wide_nodes[order[i]];
+                for (uint32_t k = 0; k < NORI_SIMD_WIDTH; k++) {
+                    if (node.count[k] == 0 && node.bounds[0][k] != std::numeric_limits<float>::infinity())
+                        node.child[k] = new_index[node.child[k]];
+                }
+            }
+        }
+    );
+    m_wide_nodes.swap(nodes);
+    if (!m_build_costs.empty()) {
+        std::vector<float> costs(m_build_costs.size());
+        for (uint32_t i = 0; i < (uint32_t) order.size(); i++)
+            costs[i] = m_build_costs[order[i]];
+        m_build_costs.swap(costs);
+    }
+}
+
+void Accel::layoutVanEmdeBoas(uint32_t node_idx, uint32_t levels, std::vector<uint32_t>& order) const {
+    if (levels == 1) {
+        order.push_back(node_idx);
+        return;
+    }
+    // the top tree of half the height, then every bottom tree below it
+    uint32_t top_levels = levels / 2;
+    layoutVanEmdeBoas(node_idx, top_levels, order);
+    std::vector<uint32_t> bottom_roots;
+    gatherDescendants(node_idx, top_levels, bottom_roots);
+    for (uint32_t root : bottom_roots)
+        layoutVanEmdeBoas(root, levels - top_levels, order);
+}
+
+void Accel::gatherDescendants(uint32_t node_idx, uint32_t depth, std::vector<uint32_t>& nodes) const {
+    if (depth == 0) {
+        nodes.push_back(node_idx);
+        return;
+    }
+    const WideNode& node = m_wide_nodes[node_idx];
+    for (uint32_t i = 0; i < NORI_SIMD_WIDTH; i++) {
+        if (node.count[i] == 0 && node.bounds[0][i] != std::numeric_limits<float>::infinity())
+            gatherDescendants(node.child[i], depth - 1, nodes);
+    }
+}
+
+/// Step of a quantized node axis, built directly from the exponent bits
+static inline float quantizationStep(int8_t exponent) {
+    uint32_t bits = (uint32_t) (exponent + 127) << 23;
+    float step;
+    memcpy(&step, &bits, sizeof(step));
+    return step;
+}
+
+template <typename Q> void Accel::quantizeNode(const WideNode& node, QuantizedNode<Q>& result) {
+    const uint32_t max_steps = std::numeric_limits<Q>::max();
+    BoundingBox3f bbox;
+    for (uint32_t i = 0; i < NORI_SIMD_WIDTH; i++) {
+        if (node.bounds[0][i] != std::numeric_limits<float>::infinity())
+            bbox.expandBy(getChildBounds(node, i));
+    }
+    float steps[3];
+    for (int axis = 0; axis < 3; axis++) {
+        float origin = bbox.isValid() ? bbox.min[axis] : 0.f;
+        float upper = bbox.isValid() ? bbox.max[axis] : 0.f;
+        // the smallest power of two step that still reaches the far side of the node
+        int exponent = upper > origin ? (int) std::ceil(std::log2((upper - origin) / max_steps)) : -126;
+        exponent = clamp(exponent, -126, 127);
+        while (exponent < 127 && origin + max_steps * quantizationStep((int8_t) exponent) < upper)
+            exponent++;
+        result.origin[axis] = origin;
+        result.exponent[axis] = (int8_t) exponent;
+        steps[axis] = quantizationStep((int8_t) exponent);
+    }
+
+    for (uint32_t i = 0; i < NORI_SIMD_WIDTH; i++) {
+        if (node.bounds[0][i] == std::numeric_limits<float>::infinity()) {
+            for (int k = 0; k < 3; k++) {
+                result.bounds[k][i] = (Q) max_steps;
+                result.bounds[k + 3][i] = 0;
+            }
+            result.child[i] = result.count[i] = 0;
+            continue;
+        }
+        for (int k = 0; k < 3; k++) {
+            // round outwards, checking the planes exactly as loadBounds() decodes them
+            float origin = result.origin[k], step = steps[k];
+            float lower = node.bounds[k][i], upper = node.bounds[k + 3][i];
+            uint32_t q_lower = (uint32_t) clamp(std::floor((lower - origin) / step), 0.f, (float) max_steps);
+            uint32_t q_upper = (uint32_t) clamp(std::ceil((upper - origin) / step), 0.f, (float) max_steps);
+            while (q_lower > 0 && origin + q_lower * step > lower)
+                q_lower--;
+            while (q_upper < max_steps && origin + q_upper * step < upper)
+                q_upper++;
+            result.bounds[k][i] = (Q) q_lower;
+            result.bounds[k + 3][i] = (Q) q_upper;
+        }
+        if (node.count[i] > std::numeric_limits<uint16_t>::max())
+            throw NoriException("Accel: too many triangles (%i) in a leaf of a quantized BVH!", node.count[i]);
+        result.child[i] = node.child[i];
+        result.count[i] = (uint16_t) node.count[i];
+    }
+}
+
+template <typename Q> void Accel::dequantizeNode(const QuantizedNode<Q>& node, WideNode& result) {
+    for (uint32_t i = 0; i < NORI_SIMD_WIDTH; i++) {
+        bool empty = node.bounds[0][i] > node.bounds[3][i];
+        for (int k = 0; k < 3; k++) {
+            float step = quantizationStep(node.exponent[k]);
+            result.bounds[k][i] = empty ? std::numeric_limits<float>::infinity()
+                                        : node.origin[k] + node.bounds[k][i] * step;
+            result.bounds[k + 3][i] = empty ? -std::numeric_limits<float>::infinity()
+                                            : node.origin[k] + node.bounds[k + 3][i] * step;
+        }
+        result.child[i] = node.child[i];
+        result.count[i] = node.count[i];
+    }
+}
+
+void Accel::quantizeNodes() {
+    uint32_t num_nodes = (uint32_t) m_wide_nodes.size();
+    auto quantize = [&](auto& quantized) {
+        quantized.resize(num_nodes);
+        tbb::parallel_for(tbb::blocked_range<uint32_t>(0, num_nodes, BUILD_GRAIN_SIZE),
+            [&](const tbb::blocked_range<uint32_t> &range) {
+                for (uint32_t i = range.begin(); i != range.end(); ++i)
+                    quantizeNode(m_wide_nodes[i], quantized[i]);
+            }
+        );
+    };
+    if (m_quantization_bits == 8)
+        quantize(m_quantized8);
+    else
+        quantize(m_quantized16);
+    m_wide_nodes = std::vector<WideNode>();
+}
+
+void Accel::dequantizeNodes() {
+    auto dequantize = [&](auto& quantized) {
+        m_wide_nodes.resize(quantized.size());
+        tbb::parallel_for(tbb::blocked_range<uint32_t>(0, (uint32_t) quantized.size(), BUILD_GRAIN_SIZE),
+            [&](const tbb::blocked_range<uint32_t> &range) {
+                for (uint32_t i = range.begin(); i != range.end(); ++i)
+                    dequantizeNode(quantized[i], m_wide_nodes[i]);
+            }
+        );
+        quantized.clear();
+        quantized.shrink_to_fit();
+    };
+    if (m_quantization_bits == 8)
+        dequantize(m_quantized8);
+    else
+        dequantize(m_quantized16);
+}
+
+/**
+ * Slab test of a ray against a box without the special cases of
+ * BoundingBox3f::rayIntersect(): a zero direction component has an infinite
+ * reciprocal, which makes that slab either contain the whole ray or none of it.
+ * As in Accel::intersectChildren(), the NaN of a ray lying in a slab plane
+ * only drops that slab: std::max() and std::min() return their first
+ * argument for NaN, which is the distance accumulated so far.
+ */
+static inline bool intersectBox(const BoundingBox3f &bbox, const Point3f &o, const Vector3f &dRcp,
+        float mint, float maxt, float &near_t) {
+    near_t = mint;
+    float far_t = maxt;
+    for (int axis = 0; axis < 3; axis++) {
+        float t0 = (bbox.min[axis] - o[axis]) * dRcp[axis], t1 = (bbox.max[axis] - o[axis]) * dRcp[axis];
+        if (dRcp[axis] < 0)
+            std::swap(t0, t1);
+        near_t = std::max(near_t, t0);
+        far_t = std::min(far_t, t1);
+    }
+    return near_t <= far_t;
+}
+
+template <bool ShadowRay> bool Accel::intersectLeaf(uint32_t offset, uint32_t count, Ray3f &ray,
+        Intersection &its, uint32_t& hit_idx) const {
+    bool found = false;
+    if (m_precompute) {
+        const SimdFloat ox(ray.o.x()), oy(ray.o.y()), oz(ray.o.z());
+        const SimdFloat dx(ray.d.x()), dy(ray.d.y()), dz(ray.d.z());
+        const SimdFloat zero(0.f), one(1.f), mint(ray.mint);
+
+        uint32_t end = offset + getLeafTestCount(count);
+        for (uint32_t g = offset; g < end; ++g) {
+            const TriangleGroup& group = m_group_view[g];
+            const SimdFloat e1x = SimdFloat::load(group.edge1[0]), e1y = SimdFloat::load(group.edge1[1]),
+                            e1z = SimdFloat::load(group.edge1[2]);
+            const SimdFloat e2x = SimdFloat::load(group.edge2[0]), e2y = SimdFloat::load(group.edge2[1]),
+                            e2z = SimdFloat::load(group.edge2[2]);
+
+            /* Same steps as Mesh::rayIntersect(), for all lanes at once */
+            SimdFloat px = dy * e2z - dz * e2y, py = dz * e2x - dx * e2z, pz = dx * e2y - dy * e2x;
+            SimdFloat det = e1x * px + e1y * py + e1z * pz;
+            SimdFloat inv_det = one / det;
+
+            SimdFloat tx = ox - SimdFloat::load(group.p0[0]), ty = oy - SimdFloat::load(group.p0[1]),
+                      tz = oz - SimdFloat::load(group.p0[2]);
+            SimdFloat u = (tx * px + ty * py + tz * pz) * inv_det;
+
+            SimdFloat qx = ty * e1z - tz * e1y, qy = tz * e1x - tx * e1z, qz = tx * e1y - ty * e1x;
+            SimdFloat v = (dx * qx + dy * qy + dz * qz) * inv_det;
+            SimdFloat t = (e2x * qx + e2y * qy + e2z * qz) * inv_det;
+
+            int hits = ((det <= SimdFloat(-1e-8f)) | (det >= SimdFloat(1e-8f))).bits() &
+                       ((zero <= u) & (u <= one) & (zero <= v) & (u + v <= one)).bits() &
+                       ((mint <= t) & (t < SimdFloat(ray.maxt))).bits();
+            NORI_ACCEL_COUNT(ECacheMisses, simulated_cache.access(&group, sizeof(TriangleGroup)));
+            NORI_ACCEL_COUNT(ETriangles, std::min(count - (g - offset) * NORI_SIMD_WIDTH, (uint32_t) NORI_SIMD_WIDTH));
+            if (!hits)
+                continue;
+            NORI_ACCEL_COUNT(EHits, std::bitset<NORI_SIMD_WIDTH>(hits).count());
+            if (ShadowRay)
+                return true;
+
+            alignas(32) float t_lanes[NORI_SIMD_WIDTH], u_lanes[NORI_SIMD_WIDTH], v_lanes[NORI_SIMD_WIDTH];
+            t.store(t_lanes);
+            u.store(u_lanes);
+            v.store(v_lanes);
+            while (hits) {
+                int lane = lowestLane(hits);
+                hits &= hits - 1;
+                if (t_lanes[lane] < ray.maxt) {
+                    ray.maxt = t_lanes[lane];
+                    its.t = t_lanes[lane];
+                    its.uv = Point2f(u_lanes[lane], v_lanes[lane]);
+                    its.mesh = m_meshes[group.mesh[lane]];
+                    hit_idx = group.triangle[lane];
+                    found = true;
+                }
+            }
+        }
+        return found;
+    }
+
+    // search through all triangles in leaf
+    for (uint32_t i = offset; i < offset + count; ++i) {
         float u, v, t;
-        uint32_t triangle_idx = node.triangle_indices[i];
-        uint32_t mesh_idx = node.mesh_indices[i];
-        if (m_meshes[mesh_idx]->rayIntersect(triangle_idx, ray, u, v, t) && t < ray.maxt) {
+        const PrimRef& prim = m_prim_view[i];
+        const Mesh* mesh = m_meshes[prim.mesh];
+        NORI_ACCEL_COUNT(ETriangles, 1);
+        NORI_ACCEL_COUNT(ECacheMisses, simulated_cache.access(&prim, sizeof(PrimRef)));
+        if (mesh->rayIntersect(prim.triangle, ray, u, v, t) && t < ray.maxt) {
+            NORI_ACCEL_COUNT(EHits, 1);
             /* An intersection was found! Can terminate
                immediately if this is a shadow ray query */
-            if (shadowRay)
+            if (ShadowRay)
                 return true;
             ray.maxt = t;
             its.t = t;
             its.uv = Point2f(u, v);
-            its.mesh = m_meshes[mesh_idx];
-            hit_idx = triangle_idx;
+            its.mesh = mesh;
+            hit_idx = prim.triangle;
+            found = true;
+        }
+    }
+    return found;
+}
+
+template <bool ShadowRay> bool Accel::traverse(Ray3f &ray, Intersection &its, uint32_t& hit_idx) const {
+    if (getWideNodeCount() > 0)
+        return traverseBVH<ShadowRay>(ray, its, hit_idx);
+    else if (!m_node_view.empty())
+        return traverseOctree<ShadowRay>(ray, its, hit_idx);
+    return false;
+}
+
+template <bool ShadowRay> bool Accel::traverseBVH(Ray3f &ray, Intersection &its, uint32_t& hit_idx) const {
+    auto intersect_leaf = [&](uint32_t offset, uint32_t count) {
+        return intersectLeaf<ShadowRay>(offset, count, ray, its, hit_idx);
+    };
+    if (!m_quantized8_view.empty())
+        return traverseWide<ShadowRay>(m_quantized8_view.data, ray, intersect_leaf);
+    if (!m_quantized16_view.empty())
+        return traverseWide<ShadowRay>(m_quantized16_view.data, ray, intersect_leaf);
+    return traverseWide<ShadowRay>(m_wide_view.data, ray, intersect_leaf);
+}
+
+template <bool ShadowRay> bool Accel::traverseInstances(Ray3f &ray, Intersection &its, uint32_t& hit_idx,
+        const InstanceRecord*& hit_instance) const {
+    return traverseWide<ShadowRay>(m_tlas_nodes.data(), ray, [&](uint32_t offset, uint32_t count) {
+        bool found = false;
+        for (uint32_t i = offset; i < offset + count; ++i) {
+            const InstanceRecord& record = m_instances[i];
+            // the direction is not normalized, so distances along the ray stay the same in object space
+            Ray3f local = record.toObject * ray;
+            if (!record.blas->traverse<ShadowRay>(local, its, hit_idx))
+                continue;
+            if (ShadowRay)
+                return true;
+            ray.maxt = local.maxt;
+            hit_instance = &record;
+            found = true;
+        }
+        return found;
+    });
+}
+
+inline void Accel::initSlabRay(const Ray3f &ray, SlabRay &slab_ray) {
+    /* Row of the node bounds that the ray enters first on each axis. A zero
+       direction component has an infinite reciprocal, which makes that slab
+       either contain the whole ray or none of it; the NaN of a ray lying in
+       a slab plane only drops that slab from min() and max() */
+    for (int axis = 0; axis < 3; axis++) {
+        slab_ray.scalar_o[axis] = ray.o[axis];
+        slab_ray.scalar_rcp[axis] = ray.dRcp[axis];
+        slab_ray.o[axis] = SimdFloat(ray.o[axis]);
+        slab_ray.rcp[axis] = SimdFloat(ray.dRcp[axis]);
+        slab_ray.near[axis] = ray.dRcp[axis] < 0 ? axis + 3 : axis;
+        slab_ray.far[axis] = ray.dRcp[axis] < 0 ? axis : axis + 3;
+    }
+    slab_ray.mint = SimdFloat(ray.mint);
+}
+
+inline SimdFloat Accel::loadBounds(const WideNode& node, int row) {
+    return SimdFloat::load(node.bounds[row]);
+}
+
+template <typename Q> inline SimdFloat Accel::loadBounds(const QuantizedNode<Q>& node, int row) {
+    // q * step is exact, so this rounds once, to the plane that quantizeNode() checked against the exact bound
+    int axis = row % 3;
+    return SimdFloat::load(node.bounds[row]) * SimdFloat(quantizationStep(node.exponent[axis])) +
+           SimdFloat(node.origin[axis]);
+}
+
+template <typename NodeType> inline void Accel::intersectChildren(const NodeType& node, const SlabRay& ray,
+        float maxt, SimdFloat& near_t, SimdFloat& far_t) {
+    // the slab distances come first, since min() and max() return the second argument for NaN
+    near_t = max((loadBounds(node, ray.near[2]) - ray.o[2]) * ray.rcp[2],
+             max((loadBounds(node, ray.near[1]) - ray.o[1]) * ray.rcp[1],
+             max((loadBounds(node, ray.near[0]) - ray.o[0]) * ray.rcp[0], ray.mint)));
+    far_t = min((loadBounds(node, ray.far[2]) - ray.o[2]) * ray.rcp[2],
+            min((loadBounds(node, ray.far[1]) - ray.o[1]) * ray.rcp[1],
+            min((loadBounds(node, ray.far[0]) - ray.o[0]) * ray.rcp[0], SimdFloat(maxt))));
+}
+
+/// Index of the lowest ray in a non-zero packet mask
+static inline uint32_t lowestRay(uint64_t rays) {
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward64(&index, rays);
+    return (uint32_t) index;
+#else
+    return (uint32_t) __builtin_ctzll(rays);
+#endif
+}
+
+/// Number of slots of a wide node that hold a child (empty slots have their minimum above their maximum)
+template <typename NodeType> static inline uint32_t countUsedSlots(const NodeType& node) {
+    uint32_t used = 0;
+    for (int i = 0; i < NORI_SIMD_WIDTH; i++)
+        used += node.bounds[0][i] <= node.bounds[3][i] ? 1 : 0;
+    return used;
+}
+
+template <bool ShadowRay, typename NodeType, typename LeafFunc> bool Accel::traverseWide(const NodeType* nodes,
+        Ray3f &ray, const LeafFunc& intersect_leaf) const {
+    /* Children still to be visited: a wide node if count is 0, a leaf otherwise */
+    struct StackEntry {
+        uint32_t child;
+        uint32_t count;
+        float near_t;
+    };
+    StackEntry stack[TRAVERSAL_STACK_SIZE];
+    uint32_t stack_size = 0;
+    bool foundIntersection = false;
+    SlabRay slab_ray;
+    initSlabRay(ray, slab_ray);
+
+    uint32_t child = 0, count = 0;
+    while (true) {
+        if (count == 0) {
+            const NodeType& node = nodes[child];
+            SimdFloat near_t, far_t;
+            intersectChildren(node, slab_ray, ray.maxt, near_t, far_t);
+            NORI_ACCEL_COUNT(ENodes, 1);
+            NORI_ACCEL_COUNT(EBoxes, countUsedSlots(node));
+            NORI_ACCEL_COUNT(ECacheMisses, simulated_cache.access(&node, sizeof(NodeType)));
+            int hits = (near_t <= far_t).bits();
+            alignas(32) float dist[NORI_SIMD_WIDTH];
+            near_t.store(dist);
+
+            // push the hit children sorted by distance, so that the nearest one ends up on top
+            uint32_t first = stack_size;
+            while (hits) {
+                int i = lowestLane(hits);
+                hits &= hits - 1;
+                StackEntry entry{ node.child[i], node.count[i], dist[i] };
+                uint32_t j = stack_size++;
+                for (; !ShadowRay && j > first && stack[j - 1].near_t < entry.near_t; --j)
+                    stack[j] = stack[j - 1];
+                stack[j] = entry;
+            }
+        } else if (intersect_leaf(child, count)) {
+            if (ShadowRay)
+                return true;
             foundIntersection = true;
         }
+
+        // pop the next node, skipping those that start behind the closest hit
+        do {
+            if (stack_size == 0)
+                return foundIntersection;
+            --stack_size;
+        } while (!ShadowRay && stack[stack_size].near_t > ray.maxt);
+        child = stack[stack_size].child;
+        count = stack[stack_size].count;
     }
+}
+
+template <typename NodeType> void Accel::traversePacket(const NodeType* nodes, uint32_t count, Ray3f *rays,
+        Intersection *its, uint32_t *hit_idx, bool *found) const {
+    /* Like traverseWide(), every entry also keeps the rays that hit its box */
+    struct StackEntry {
+        uint32_t child;
+        uint32_t count;
+        float near_t;    ///< Smallest entry distance of these rays
+        uint64_t rays;
+    };
+    StackEntry stack[TRAVERSAL_STACK_SIZE];
+    uint32_t stack_size = 0;
+
+    /* Intervals that contain the origins and the reciprocal directions of all rays */
+    SlabRay slab_rays[PACKET_SIZE];
+    float o_lo[3], o_hi[3], rcp_lo[3], rcp_hi[3], mint = rays[0].mint;
+    for (int axis = 0; axis < 3; axis++) {
+        o_lo[axis] = o_hi[axis] = rays[0].o[axis];
+        rcp_lo[axis] = rcp_hi[axis] = rays[0].dRcp[axis];
+    }
+    for (uint32_t r = 0; r < count; r++) {
+        initSlabRay(rays[r], slab_rays[r]);
+        mint = std::min(mint, rays[r].mint);
+        for (int axis = 0; axis < 3; axis++) {
+            o_lo[axis] = std::min(o_lo[axis], rays[r].o[axis]);
+            o_hi[axis] = std::max(o_hi[axis], rays[r].o[axis]);
+            rcp_lo[axis] = std::min(rcp_lo[axis], rays[r].dRcp[axis]);
+            rcp_hi[axis] = std::max(rcp_hi[axis], rays[r].dRcp[axis]);
+        }
+    }
+    const SlabRay& first = slab_rays[0];
+
+    uint32_t child = 0, leaf_count = 0;
+    uint64_t active = count == 64 ? ~0ull : (1ull << count) - 1;
+    while (true) {
+        if (leaf_count == 0) {
+            const NodeType& node = nodes[child];
+            NORI_ACCEL_COUNT_RAY(lowestRay(active), ECacheMisses, simulated_cache.access(&node, sizeof(NodeType)));
+            for (uint64_t bits = active; bits; bits &= bits - 1)
+                NORI_ACCEL_COUNT_RAY(lowestRay(bits), ENodes, 1);
+
+            /* Bounds of the entry and exit distances of all rays. The planes
+               are decoded and the products round like those of
+               intersectChildren(), so the bounds hold for the distances that
+               the rays compute themselves */
+            SimdFloat packet_near(mint), packet_far(-std::numeric_limits<float>::infinity());
+            for (int axis = 0; axis < 3; axis++) {
+                SimdFloat rl(rcp_lo[axis]), rh(rcp_hi[axis]);
+                SimdFloat bn = loadBounds(node, first.near[axis]);
+                SimdFloat bf = loadBounds(node, first.far[axis]);
+                SimdFloat n0 = bn - SimdFloat(o_hi[axis]), n1 = bn - SimdFloat(o_lo[axis]);
+                SimdFloat f0 = bf - SimdFloat(o_hi[axis]), f1 = bf - SimdFloat(o_lo[axis]);
+                packet_near = max(packet_near, min(min(n0 * rl, n0 * rh), min(n1 * rl, n1 * rh)));
+                SimdFloat exit_t = max(max(f0 * rl, f0 * rh), max(f1 * rl, f1 * rh));
+                packet_far = axis == 0 ? exit_t : min(packet_far, exit_t);
+            }
+            float maxt = 0.f;
+            for (uint64_t bits = active; bits; bits &= bits - 1)
+                maxt = std::max(maxt, rays[lowestRay(bits)].maxt);
+            int candidates = (packet_near <= min(packet_far, SimdFloat(maxt))).bits();
+
+            // test the remaining children with every ray that reached this node
+            uint64_t child_rays[NORI_SIMD_WIDTH] = { };
+            alignas(32) float child_near[NORI_SIMD_WIDTH];
+            for (int i = 0; i < NORI_SIMD_WIDTH; i++)
+                child_near[i] = std::numeric_limits<float>::infinity();
+            int hits = 0;
+            if (candidates) {
+                for (uint64_t bits = active; bits; bits &= bits - 1) {
+                    uint32_t r = lowestRay(bits);
+                    SimdFloat near_t, far_t;
+                    intersectChildren(node, slab_rays[r], rays[r].maxt, near_t, far_t);
+                    NORI_ACCEL_COUNT_RAY(r, EBoxes, countUsedSlots(node));
+                    int ray_hits = (near_t <= far_t).bits() & candidates;
+                    if (!ray_hits)
+                        continue;
+                    alignas(32) float dist[NORI_SIMD_WIDTH];
+                    near_t.store(dist);
+                    hits |= ray_hits;
+                    while (ray_hits) {
+                        int i = lowestLane(ray_hits);
+                        ray_hits &= ray_hits - 1;
+                        child_rays[i] |= 1ull << r;
+                        child_near[i] = std::min(child_near[i], dist[i]);
+                    }
+                }
+            }
+
+            // push the hit children sorted by distance, so that the nearest one ends up on top
+            uint32_t first_entry = stack_size;
+            while (hits) {
+                int i = lowestLane(hits);
+                hits &= hits - 1;
+                StackEntry entry{ node.child[i], node.count[i], child_near[i], child_rays[i] };
+                uint32_t j = stack_size++;
+                for (; j > first_entry && stack[j - 1].near_t < entry.near_t; --j)
+                    stack[j] = stack[j - 1];
+                stack[j] = entry;
+            }
+        } else {
+            for (uint64_t bits = active; bits; bits &= bits - 1) {
+                uint32_t r = lowestRay(bits);
+                if (intersectLeaf<false>(child, leaf_count, rays[r], its[r], hit_idx[r]))
+                    found[r] = true;
+                NORI_ACCEL_MOVE_COUNTS(r);
+            }
+        }
 
-    if (node.child) {
-        std::pair<Node*, float> children[8];
-        Node* current_child = node.child;
-        int i = 0;
+        // pop the next node, dropping the rays whose closest hit lies in front of it
         do {
-            children[i] = std::pair<Node*, float>(current_child, current_child->bbox.distanceTo(ray.o));
-            current_child = current_child->next;
-            i++;
-        } while (current_child);
+            if (stack_size == 0)
+                return;
+            --stack_size;
+            active = stack[stack_size].rays;
+            for (uint64_t bits = active; bits; bits &= bits - 1) {
+                uint32_t r = lowestRay(bits);
+                if (stack[stack_size].near_t > rays[r].maxt)
+                    active &= ~(1ull << r);
+            }
+        } while (!active);
+        child = stack[stack_size].child;
+        leaf_count = stack[stack_size].count;
+    }
+}
 
-        std::sort(children, children + 8, [ray](const std::pair<Node*, float>& l, const std::pair<Node*, float>& r) {
-            return l.second < r.second;
-        });
+template <bool ShadowRay> bool Accel::traverseOctree(Ray3f &ray, Intersection &its, uint32_t& hit_idx) const {
+    /* Nodes still to be visited, along with the distance at which the ray enters them */
+    struct StackEntry {
+        uint32_t node_idx;
+        float near_t;
+    };
+    StackEntry stack[TRAVERSAL_STACK_SIZE];
+    uint32_t stack_size = 0;
+    bool foundIntersection = false;
 
-        for (auto child: children) {
-            foundIntersection = traverseRecursive(*child.first, ray, its, shadowRay, hit_idx) || foundIntersection;
-            if (shadowRay && foundIntersection)
-                return true;
+    /* Octant of the ray direction. Visiting the children of an octree node
+       in the order of (octant ^ dir_mask) is front to back without sorting */
+    const uint32_t dir_mask = (ray.d.x() < 0 ? 1 : 0) | (ray.d.y() < 0 ? 2 : 0) | (ray.d.z() < 0 ? 4 : 0);
+
+    float near_t;
+    NORI_ACCEL_COUNT(EBoxes, 1);
+    NORI_ACCEL_COUNT(ECacheMisses, simulated_cache.access(&m_node_view[0], sizeof(Node)));
+    if (!intersectBox(m_node_view[0].bbox, ray.o, ray.dRcp, ray.mint, ray.maxt, near_t))
+        return false;
+
+    /* The nearest child is visited right away, the others are pushed */
+    uint32_t node_idx = 0;
+    while (true) {
+        const Node& node = m_node_view[node_idx];
+
+        if (!node.leaf) {
+            NORI_ACCEL_COUNT(ENodes, 1);
+            NORI_ACCEL_COUNT(EBoxes, node.count);
+            NORI_ACCEL_COUNT(ECacheMisses, simulated_cache.access(&m_node_view[node.offset], node.count * sizeof(Node)));
         }
+
+        if (!node.leaf && ShadowRay) {
+            // any hit ends the query, so the children are simply visited in storage order
+            uint32_t next = 0;
+            bool found_child = false;
+            for (uint32_t i = 0; i < node.count; ++i) {
+                if (!intersectBox(m_node_view[node.offset + i].bbox, ray.o, ray.dRcp, ray.mint, ray.maxt, near_t))
+                    continue;
+                if (found_child)
+                    stack[stack_size++] = StackEntry{ node.offset + i, near_t };
+                else
+                    next = node.offset + i;
+                found_child = true;
+            }
+            if (found_child) {
+                node_idx = next;
+                continue;
+            }
+        } else if (!node.leaf) {
+            // front to back over the stored octants, remembering the nearest hit child
+            uint32_t nearest = 0;
+            float nearest_t = 0.f;
+            bool found_child = false;
+            for (int k = 7; k >= 0; --k) {
+                uint32_t octant = k ^ dir_mask;
+                if (!(node.flags & (1 << octant)))
+                    continue;
+                uint32_t child = node.offset + (uint32_t) std::bitset<8>(node.flags & ((1 << octant) - 1)).count();
+                if (!intersectBox(m_node_view[child].bbox, ray.o, ray.dRcp, ray.mint, ray.maxt, near_t))
+                    continue;
+                if (found_child)
+                    stack[stack_size++] = StackEntry{ nearest, nearest_t };
+                nearest = child;
+                nearest_t = near_t;
+                found_child = true;
+            }
+            if (found_child) {
+                node_idx = nearest;
+                continue;
+            }
+        } else {
+            if (intersectLeaf<ShadowRay>(node.offset, node.count, ray, its, hit_idx)) {
+                if (ShadowRay)
+                    return true;
+                foundIntersection = true;
+            }
+        }
+
+        // pop the next node, skipping those that start behind the closest hit
+        do {
+            if (stack_size == 0)
+                return foundIntersection;
+            --stack_size;
+        } while (!ShadowRay && stack[stack_size].near_t > ray.maxt);
+        node_idx = stack[stack_size].node_idx;
     }
-    return foundIntersection;
+}
+
+float Accel::getSAHCost() const {
+    if (getWideNodeCount() > 0) {
+        // the root is always visited, every slot contributes the cost of its child
+        float cost = SAH_TRAVERSAL_COST * m_bbox.getSurfaceArea();
+        auto add_node = [&](const WideNode& node) {
+            for (int i = 0; i < NORI_SIMD_WIDTH; i++) {
+                if (node.bounds[0][i] == std::numeric_limits<float>::infinity())
+                    continue;
+                BoundingBox3f bbox = getChildBounds(node, i);
+                float weight = node.count[i] > 0 ? SAH_INTERSECTION_COST * getLeafTestCount(node.count[i])
+                                                 : SAH_TRAVERSAL_COST;
+                cost += weight * bbox.getSurfaceArea();
+            }
+        };
+        for (const WideNode& node : m_wide_view)
+            add_node(node);
+        // quantized nodes contribute the boxes that the traversal actually tests
+        WideNode decoded;
+        for (const QuantizedNode<uint8_t>& node : m_quantized8_view) {
+            dequantizeNode(node, decoded);
+            add_node(decoded);
+        }
+        for (const QuantizedNode<uint16_t>& node : m_quantized16_view) {
+            dequantizeNode(node, decoded);
+            add_node(decoded);
+        }
+        return cost / m_bbox.getSurfaceArea();
+    }
+    if (m_node_view.empty())
+        return 0.f;
+    float cost = 0.f;
+    for (const Node& node : m_node_view) {
+        float weight = node.leaf ? SAH_INTERSECTION_COST * getLeafTestCount(node.count) : SAH_TRAVERSAL_COST;
+        cost += weight * node.bbox.getSurfaceArea();
+    }
+    return cost / m_node_view[0].bbox.getSurfaceArea();
 }
 
 void Accel::subdivideBBox(const nori::BoundingBox3f &parent, nori::BoundingBox3f *bboxes) {
@@ -0,0 +1,441 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/scene.h>
+#include <nori/accel.h>
+#include <nori/instance.h>
+#include <nori/frame.h>
+#include <pcg32.h>
+#include <filesystem>
+#include <memory>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Checks that all configurations of \ref Accel return the same hits
+ *
+ * The meshes of the \c <scene> child are put into one hierarchy per
+ * configuration: the octree, the SAH BVH with and without precomputed
+ * triangles and with spatial splits, the linear BVH with and without
+ * treelet restructuring, quantized nodes, the other node layouts and a
+ * hierarchy that is mapped from a temporary cache directory. Every one of
+ * them has to agree with a brute force loop over all triangles (and
+ * instances) on
+ *
+ * 1. the closest hit of random rays, some of them exactly axis-aligned
+ *    and through the vertices and along the edges of the scene,
+ *
+ * 2. the visibility of shadow rays with a random maximum extent, and
+ *
+ * 3. the closest hits of coherent packets of \ref Accel::rayIntersectPacket(),
+ *
+ * before and after the vertices are displaced and the hierarchy is refitted
+ * (once plainly and once rebuilding every subtree that got worse), and
+ * again after the vertices were moved back. All rays are drawn from a fixed
+ * seed, so a failure can be reproduced.
+ */
+class AccelTest : public NoriObject {
+public:
+    AccelTest(const PropertyList &propList) {
+        /* Number of random rays of each kind (default: 4096) */
+        m_rayCount = propList.getInteger("rayCount", 4096);
+
+        /* Seed of the random number generator */
+        m_seed = propList.getInteger("seed", 1);
+
+        /* How far the vertices are moved before refitting, relative to the scene */
+        m_displacement = propList.getFloat("displacement", 0.02f);
+    }
+
+    virtual ~AccelTest() {
+        delete m_scene;
+    }
+
+    void addChild(NoriObject *obj) {
+        switch (obj->getClassType()) {
+            case EScene:
+                if (m_scene)
+                    throw NoriException("AccelTest: there can only be one scene per test!");
+                m_scene = static_cast<Scene *>(obj);
+                break;
+
+            default:
+                throw NoriException("AccelTest::addChild(<%s>) is not supported!",
+                    classTypeName(obj->getClassType()));
+        }
+    }
+
+    void activate() {
+        if (!m_scene)
+            throw NoriException("AccelTest: a scene is required!");
+        const std::vector<Mesh *> &meshes = m_scene->getMeshes();
+
+        generateRays();
+
+        /* The reference hits of the original and of the displaced vertices */
+        std::vector<MatrixXf> original, displaced;
+        for (const Mesh *mesh : meshes) {
+            original.push_back(mesh->getVertexPositions());
+            displaced.push_back(displace(mesh->getVertexPositions()));
+        }
+        Reference reference[2];
+        computeReference(reference[0]);
+        setVertexPositions(displaced);
+        computeReference(reference[1]);
+        setVertexPositions(original);
+
+        struct Configuration {
+            const char *name;
+            Accel::EType type;
+            bool precompute;
+            bool treelets;
+            float spatialSplitBudget;
+            int quantization;
+            Accel::ENodeLayout layout;
+            bool cache;
+        } configurations[] = {
+            { "octree",         Accel::EOctree,    true,  true,  0.f,  0,  Accel::EDepthFirst,      false },
+            { "bvh",            Accel::EBVH,       true,  true,  0.f,  0,  Accel::EDepthFirst,      false },
+            { "bvh (triangle references)",
+                                Accel::EBVH,       false, true,  0.f,  0,  Accel::EDepthFirst,      false },
+            { "sbvh",           Accel::EBVH,       true,  true,  0.3f, 0,  Accel::EDepthFirst,      false },
+            { "lbvh",           Accel::ELinearBVH, true,  true,  0.f,  0,  Accel::EDepthFirst,      false },
+            { "lbvh (no treelets)",
+                                Accel::ELinearBVH, true,  false, 0.f,  0,  Accel::EDepthFirst,      false },
+            { "bvh (8 bit nodes)",
+                                Accel::EBVH,       true,  true,  0.f,  8,  Accel::EDepthFirst,      false },
+            { "sbvh (16 bit nodes)",
+                                Accel::EBVH,       true,  true,  0.3f, 16, Accel::EDepthFirst,      false },
+            { "bvh (van Emde Boas layout)",
+                                Accel::EBVH,       true,  true,  0.f,  0,  Accel::EVanEmdeBoas,     false },
+            { "lbvh (treelet layout, 8 bit nodes)",
+                                Accel::ELinearBVH, true,  true,  0.f,  8,  Accel::ETreeletClusters, false },
+            { "bvh (mapped from the cache)",
+                                Accel::EBVH,       true,  true,  0.f,  0,  Accel::EDepthFirst,      true  }
+        };
+
+        /* The cache configuration writes to a directory of its own, which
+           is removed again when the test finishes */
+        struct TemporaryDirectory {
+            std::filesystem::path path;
+            TemporaryDirectory() {
+                const std::filesystem::path base = std::filesystem::temp_directory_path();
+                for (uint32_t i = 0; ; ++i) {
+                    path = base / tfm::format("nori-acceltest-%u", i);
+                    if (std::filesystem::create_directory(path))
+                        break;
+                }
+            }
+            ~TemporaryDirectory() {
+                std::error_code error;
+                std::filesystem::remove_all(path, error);
+            }
+        } cacheDirectory;
+
+        int passed = 0, total = 0;
+        for (const Configuration &c : configurations) {
+            auto create = [&]() {
+                Accel *accel = new Accel(c.type, c.precompute);
+                accel->setTreeletRestructuring(c.treelets);
+                accel->setSpatialSplitBudget(c.spatialSplitBudget);
+                accel->setNodeQuantization(c.quantization);
+                accel->setNodeLayout(c.layout);
+                if (c.cache)
+                    accel->setCacheDirectory(cacheDirectory.path.string());
+                for (Mesh *mesh : meshes)
+                    accel->addMesh(mesh);
+                accel->build();
+                return accel;
+            };
+
+            cout << "------------------------------------------------------" << endl;
+            cout << "Testing " << c.name << endl;
+
+            /* The first build writes the cache file, which the second one maps */
+            std::unique_ptr<Accel> accel(create());
+            if (c.cache)
+                accel.reset(create());
+
+            struct Step {
+                const char *name;
+                int pose;
+                float rebuildThreshold;
+            } steps[] = {
+                { "build",                         0, -1.f },
+                { "refit (displaced)",             1, 0.f },
+                { "refit and rebuild (displaced)", 1, 1.0001f },
+                { "refit (restored)",              0, 0.f }
+            };
+
+            for (const Step &step : steps) {
+                if (step.rebuildThreshold >= 0) {
+                    setVertexPositions(step.pose == 0 ? original : displaced);
+                    accel->refit(step.rebuildThreshold);
+                }
+                std::string result = check(*accel, reference[step.pose]);
+                if (result.empty()) {
+                    cout << "Passed: " << step.name << endl;
+                    passed++;
+                } else {
+                    cout << "Failed: " << step.name << ": " << result << endl;
+                }
+                total++;
+            }
+            setVertexPositions(original);
+        }
+
+        cout << "------------------------------------------------------" << endl;
+        cout << "Passed " << passed << "/" << total << " tests." << endl;
+
+        if (passed < total)
+            throw std::runtime_error("Some tests failed :(");
+    }
+
+    std::string toString() const {
+        return tfm::format(
+            "AccelTest[\n"
+            "  rayCount = %i,\n"
+            "  seed = %i,\n"
+            "  displacement = %f\n"
+            "]",
+            m_rayCount,
+            m_seed,
+            m_displacement
+        );
+    }
+
+    EClassType getClassType() const { return ETest; }
+
+private:
+    /// Closest hit of the brute force reference
+    struct Hit {
+        bool found = false;
+        float t = 0.f;
+        Point3f p = Point3f::Zero();
+        const Mesh *mesh = nullptr;
+    };
+
+    struct Reference {
+        std::vector<Hit> closest, packets;
+        std::vector<bool> occluded;
+    };
+
+    /// Draw the rays of all queries from the seed
+    void generateRays() {
+        pcg32 rng;
+        rng.seed(m_seed);
+
+        BoundingBox3f bbox = m_scene->getBoundingBox();
+        const Vector3f extents = bbox.getExtents();
+        BoundingBox3f outer(bbox.min - 0.25f * extents, bbox.max + 0.25f * extents);
+
+        auto sample = [&](const BoundingBox3f &box) {
+            return Point3f(box.min + Vector3f(rng.nextFloat(), rng.nextFloat(),
+                rng.nextFloat()).cwiseProduct(box.getExtents()));
+        };
+
+        m_rays.clear();
+        m_shadowRays.clear();
+        m_packetRays.clear();
+
+        for (int i = 0; i < m_rayCount; ++i) {
+            Point3f o = sample(outer);
+            Vector3f d = (sample(bbox) - o).normalized();
+            if (i % 4 == 0) {
+                /* Exactly along an axis, every other ray with the other
+                   coordinates snapped to half units. Such rays run through
+                   the vertices and along the edges of the floor and the wall
+                   and through flat boxes, or lie in their planes. */
+                int axis = (int) rng.nextUInt(3);
+                d = Vector3f::Zero();
+                d[axis] = rng.nextFloat() < 0.5f ? -1.f : 1.f;
+                if (i % 8 == 0) {
+                    for (int k = 0; k < 3; ++k)
+                        if (k != axis)
+                            o[k] = std::round(o[k] * 2.f) * 0.5f;
+                }
+            }
+            m_rays.push_back(Ray3f(o, d));
+
+            Point3f target = sample(bbox);
+            Ray3f shadowRay(sample(outer), Vector3f::Zero());
+            shadowRay.d = (target - shadowRay.o).normalized();
+            shadowRay.maxt = (target - shadowRay.o).norm() * rng.nextFloat();
+            shadowRay.update();
+            m_shadowRays.push_back(shadowRay);
+        }
+
+        /* Pinhole cameras, each one square packet of rays through a small cone */
+        const int side = (int) std::sqrt((float) PACKET_SIZE);
+        const int packetCount = (m_rayCount + side * side - 1) / (side * side);
+        const float center = 0.5f * (side - 1);
+        m_packetSize = (uint32_t) (side * side);
+        for (int i = 0; i < packetCount; ++i) {
+            Point3f o = sample(outer);
+            Vector3f d = (sample(bbox) - o).normalized();
+            Frame frame(d);
+            float spread = 0.01f + 0.1f * rng.nextFloat();
+            for (int y = 0; y < side; ++y)
+                for (int x = 0; x < side; ++x)
+                    m_packetRays.push_back(Ray3f(o, (d + spread * ((x - center) * frame.s
+                        + (y - center) * frame.t)).normalized()));
+        }
+    }
+
+    /// Move every vertex by a smooth function of its position
+    MatrixXf displace(const MatrixXf &V) const {
+        const float scale = m_displacement * m_scene->getBoundingBox().getExtents().maxCoeff();
+        MatrixXf result = V;
+        for (int i = 0; i < (int) V.cols(); ++i) {
+            const float x = V(0, i), y = V(1, i), z = V(2, i);
+            result(0, i) += scale * std::sin(3.f * y + 2.f * z);
+            result(1, i) += scale * std::sin(2.f * x + 3.f * z);
+            result(2, i) += scale * std::sin(3.f * x + 2.f * y);
+        }
+        return result;
+    }
+
+    void setVertexPositions(const std::vector<MatrixXf> &V) {
+        const std::vector<Mesh *> &meshes = m_scene->getMeshes();
+        for (size_t i = 0; i < meshes.size(); ++i)
+            meshes[i]->setVertexPositions(V[i]);
+    }
+
+    /// Intersect every triangle of every mesh (and instance)
+    bool referenceIntersect(Ray3f ray, Hit &hit, bool shadowRay) const {
+        hit = Hit();
+
+        auto intersectMesh = [&](const Mesh *mesh, Ray3f local) {
+            float u, v, t;
+            for (uint32_t idx = 0; idx < mesh->getTriangleCount(); ++idx) {
+                if (mesh->rayIntersect(idx, local, u, v, t)) {
+                    /* Rays are transformed without normalizing their
+                       direction, so \c t is the same in world space */
+                    local.maxt = ray.maxt = t;
+                    hit.found = true;
+                    hit.t = t;
+                    hit.mesh = mesh;
+                    if (shadowRay)
+                        return;
+                }
+            }
+        };
+
+        for (const Mesh *mesh : m_scene->getMeshes()) {
+            if (mesh->getInstances().empty())
+                intersectMesh(mesh, ray);
+            else
+                for (const Instance *instance : mesh->getInstances())
+                    intersectMesh(mesh, instance->getTransform().inverse() * ray);
+            if (shadowRay && hit.found)
+                return true;
+        }
+
+        if (hit.found)
+            hit.p = ray(hit.t);
+        return hit.found;
+    }
+
+    void computeReference(Reference &reference) const {
+        reference.closest.resize(m_rays.size());
+        for (size_t i = 0; i < m_rays.size(); ++i)
+            referenceIntersect(m_rays[i], reference.closest[i], false);
+
+        reference.packets.resize(m_packetRays.size());
+        for (size_t i = 0; i < m_packetRays.size(); ++i)
+            referenceIntersect(m_packetRays[i], reference.packets[i], false);
+
+        reference.occluded.resize(m_shadowRays.size());
+        for (size_t i = 0; i < m_shadowRays.size(); ++i) {
+            Hit hit;
+            reference.occluded[i] = referenceIntersect(m_shadowRays[i], hit, true);
+        }
+    }
+
+    static std::string describe(const Ray3f &ray) {
+        return tfm::format("from %s along %s (maxt=%f)", ray.o.toString(), ray.d.toString(), ray.maxt);
+    }
+
+    /// Compare a hit of \c accel with the reference, returns an empty string if they agree
+    static std::string compare(const Ray3f &ray, bool found, const Intersection &its, const Hit &hit) {
+        if (found != hit.found)
+            return tfm::format("ray %s %s", describe(ray), found ? "hit, expected a miss" : "missed");
+        if (!found)
+            return "";
+        const float tolerance = 1e-4f * std::max(1.f, hit.t);
+        if (std::abs(its.t - hit.t) > tolerance || (its.p - hit.p).norm() > tolerance)
+            return tfm::format("ray %s hit t=%f at %s, expected t=%f at %s", describe(ray),
+                its.t, its.p.toString(), hit.t, hit.p.toString());
+        if (its.mesh != hit.mesh)
+            return tfm::format("ray %s hit another mesh", describe(ray));
+        return "";
+    }
+
+    /// Run all queries against \c accel, returns a description of the failures
+    std::string check(const Accel &accel, const Reference &reference) const {
+        int failures = 0;
+        std::string first;
+        auto fail = [&](const std::string &what) {
+            if (failures++ == 0)
+                first = what;
+        };
+
+        for (size_t i = 0; i < m_rays.size(); ++i) {
+            Intersection its;
+            bool found = accel.rayIntersect(m_rays[i], its, false);
+            std::string result = compare(m_rays[i], found, its, reference.closest[i]);
+            if (!result.empty())
+                fail("closest hit: " + result);
+        }
+
+        for (size_t i = 0; i < m_shadowRays.size(); ++i) {
+            Intersection its;
+            bool occluded = accel.rayIntersect(m_shadowRays[i], its, true);
+            if (occluded != reference.occluded[i])
+                fail(tfm::format("shadow ray %s %s", describe(m_shadowRays[i]),
+                    occluded ? "occluded, expected it to be unoccluded" : "unoccluded"));
+        }
+
+        Intersection its[PACKET_SIZE];
+        bool found[PACKET_SIZE];
+        for (size_t i = 0; i < m_packetRays.size(); i += m_packetSize) {
+            accel.rayIntersectPacket(m_packetSize, &m_packetRays[i], its, found);
+            for (uint32_t j = 0; j < m_packetSize; ++j) {
+                std::string result = compare(m_packetRays[i + j], found[j], its[j], reference.packets[i + j]);
+                if (!result.empty())
+                    fail("packet: " + result);
+            }
+        }
+
+        if (failures == 0)
+            return "";
+        return tfm::format("%i of %i queries differ, the first %s", failures,
+            (int) (m_rays.size() + m_shadowRays.size() + m_packetRays.size()), first);
+    }
+
+private:
+    Scene *m_scene = nullptr;
+    int m_rayCount;
+    int m_seed;
+    float m_displacement;
+    std::vector<Ray3f> m_rays, m_shadowRays, m_packetRays;
+    uint32_t m_packetSize = 0;
+};
+
+NORI_REGISTER_CLASS(AccelTest, "acceltest");
+NORI_NAMESPACE_END
@@ -21,6 +21,7 @@
 #include <Eigen/LU>
 #include <filesystem/resolver.h>
 #include <iomanip>
+#include <cstring>
 
 #if defined(PLATFORM_LINUX)
 #include <malloc.h>
@@ -170,6 +171,29 @@ std::string memString(size_t size, bool precise) {
     return os.str();
 }
 
+/// Finalizer of SplitMix64, every input bit affects every output bit
+static inline uint64_t mixWord(uint64_t h) {
+    h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ull;
+    h = (h ^ (h >> 27)) * 0x94D049BB133111EBull;
+    return h ^ (h >> 31);
+}
+
+uint64_t hashWords(uint64_t hash, const void *data, size_t size) {
+    const uint8_t *bytes = (const uint8_t *) data;
+    for (; size >= 8; bytes += 8, size -= 8) {
+        uint64_t word;
+        memcpy(&word, bytes, 8);
+        hash = mixWord(hash ^ word);
+    }
+    if (size > 0) {
+        /* The remaining bytes, zero padded and tagged with their count */
+        uint64_t word = 0;
+        memcpy(&word, bytes, size);
+        hash = mixWord(hash ^ word ^ ((uint64_t) size << 56));
+    }
+    return hash;
+}
+
 filesystem::resolver *getFileResolver() {
     static filesystem::resolver *resolver = new filesystem::resolver();
     return resolver;
@@ -25,10 +25,12 @@
 #include <nori/sampler.h>
 #include <nori/integrator.h>
 #include <nori/gui.h>
+#include <nori/rasterizer.h>
 #include <tbb/parallel_for.h>
 #include <tbb/blocked_range.h>
 #include <tbb/task_scheduler_init.h>
 #include <filesystem/resolver.h>
+#include <pcg32.h>
 #include <thread>
 
 // filesystem/resolverΪ˷ƽ̨ļ·õģͬĲϵͳҵļ
@@ -36,6 +38,12 @@
 using namespace nori;
 
 static int threadCount = -1;
+static bool layoutBenchmark = false;
+
+/// Rays per vertex traced by the node layout benchmark
+static const int LAYOUT_BENCHMARK_DIRECTIONS = 16;
+/// Edge length in pixels of the tiles whose camera rays are traced as packets
+static const int PACKET_TILE_SIZE = 8;
 
 static void renderBlock(const Scene *scene, Sampler *sampler, ImageBlock &block)
 {
@@ -72,6 +80,100 @@ static void renderBlock(const Scene *scene, Sampler *sampler, ImageBlock &block)
     }
 }
 
+static void renderBlockPackets(const Scene *scene, Sampler *sampler, ImageBlock &block)
+{
+    const Camera *camera = scene->getCamera();
+    const Integrator *integrator = scene->getIntegrator();
+
+    Point2i offset = block.getOffset();
+    Vector2i size = block.getSize();
+
+    /* Clear the block contents */
+    block.clear();
+
+    Ray3f rays[PACKET_SIZE];
+    Intersection its[PACKET_SIZE];
+    bool found[PACKET_SIZE];
+    Point2f pixelSamples[PACKET_SIZE];
+    Color3f weights[PACKET_SIZE];
+    uint32_t count = 0;
+
+    /* Trace the buffered camera rays together and shade their first hits */
+    auto flush = [&]()
+    {
+        scene->rayIntersectPacket(count, rays, its, found);
+        for (uint32_t i = 0; i < count; ++i)
+        {
+            Color3f value = found[i] ? Color3f(weights[i] * integrator->Lo(scene, sampler, its[i])) : Color3f(0.0f);
+            block.put(pixelSamples[i], value);
+        }
+        count = 0;
+    };
+
+    /* Walk over small square tiles, whose camera rays stay close together */
+    for (int ty = 0; ty < size.y(); ty += PACKET_TILE_SIZE)
+    {
+        for (int tx = 0; tx < size.x(); tx += PACKET_TILE_SIZE)
+        {
+            for (int y = ty; y < std::min(ty + PACKET_TILE_SIZE, size.y()); ++y)
+            {
+                for (int x = tx; x < std::min(tx + PACKET_TILE_SIZE, size.x()); ++x)
+                {
+                    for (uint32_t i = 0; i < sampler->getSampleCount(); ++i)
+                    {
+                        Point2f pixelSample = Point2f((float)(x + offset.x()), (float)(y + offset.y())) + sampler->next2D();
+                        Point2f apertureSample = sampler->next2D();
+
+                        pixelSamples[count] = pixelSample;
+                        weights[count] = camera->sampleRay(rays[count], pixelSample, apertureSample);
+                        if (++count == PACKET_SIZE)
+                            flush();
+                    }
+                }
+            }
+            if (count > 0)
+                flush();
+        }
+    }
+}
+
+static void renderBlock(const Scene *scene, const Rasterizer &rasterizer, Sampler *sampler, ImageBlock &block)
+{
+    const Camera *camera = scene->getCamera();
+    const Integrator *integrator = scene->getIntegrator();
+
+    Point2i offset = block.getOffset();
+    Vector2i size = block.getSize();
+
+    /* Clear the block contents */
+    block.clear();
+
+    /* The visibility buffer only holds the surface seen through each pixel
+       center, so every pixel sample is shaded at the hit of the pixel that
+       contains it. The samples are still drawn and filtered like those of
+       the ray traced path. Rasterization requires a pinhole camera (see
+       Camera::getWorldToRaster()), whose rays all carry the same weight, so
+       it is evaluated once */
+    Ray3f ray;
+    Color3f weight = camera->sampleRay(ray, Point2f((float) offset.x(), (float) offset.y()), Point2f(0.5f, 0.5f));
+    for (int y = 0; y < size.y(); ++y)
+    {
+        for (int x = 0; x < size.x(); ++x)
+        {
+            Intersection its;
+            bool found = rasterizer.getIntersection(x + offset.x(), y + offset.y(), its);
+
+            for (uint32_t i = 0; i < sampler->getSampleCount(); ++i)
+            {
+                Point2f pixelSample = Point2f((float)(x + offset.x()), (float)(y + offset.y())) + sampler->next2D();
+                Color3f value = found ? Color3f(weight * integrator->Lo(scene, sampler, its)) : Color3f(0.0f);
+
+                block.put(pixelSample, value);
+            }
+        }
+    }
+}
+
 static void render(Scene *scene, const std::string &filename)
 {
     const Camera *camera = scene->getCamera();
@@ -95,6 +197,18 @@ static void render(Scene *scene, const std::string &filename)
         {
             tbb::task_scheduler_init init(threadCount);
 
+            /* Resolve primary visibility up front if the integrator allows it */
+            std::unique_ptr<Rasterizer> rasterizer;
+            if (scene->getIntegrator()->isRasterizable())
+            {
+                cout << "Rasterizing .. ";
+                cout.flush();
+                Timer rasterTimer;
+                rasterizer.reset(new Rasterizer());
+                rasterizer->render(scene);
+                cout << "done. (took " << rasterTimer.elapsedString() << ")" << endl;
+            }
+
             cout << "Rendering .. ";
             cout.flush();
             Timer timer;
@@ -121,7 +235,12 @@ static void render(Scene *scene, const std::string &filename)
                         sampler->prepare(block);
 
                         /* Render all contained pixels */
-                        renderBlock(scene, sampler.get(), block);
+                        if (rasterizer)
+                            renderBlock(scene, *rasterizer, sampler.get(), block);
+                        else if (scene->getIntegrator()->shadesFirstHit())
+                            renderBlockPackets(scene, sampler.get(), block);
+                        else
+                            renderBlock(scene, sampler.get(), block);
 
                         /* The image block has been processed. Now add it to
                            the "big" block that represents the entire image */
@@ -147,6 +266,9 @@ static void render(Scene *scene, const std::string &filename)
     delete screen;
     nanogui::shutdown();
 
+    /* Write the accel statistics of the rendering if the scene asks for them */
+    scene->writeAccelStatistics();
+
     /* Now turn the rendered image block into
        a properly normalized bitmap */
     std::unique_ptr<Bitmap> bitmap(result.toBitmap());
@@ -164,11 +286,70 @@ static void render(Scene *scene, const std::string &filename)
     bitmap->savePNG(outputName);
 }
 
+/**
+ * Trace the visibility rays of a shadowed PRT bake (random directions over
+ * the hemisphere of every vertex) with each node layout of the acceleration
+ * structure. The cache misses per ray come from the simulated cache of the
+ * traversal statistics, so they are only available if nori was compiled
+ * with NORI_ACCEL_STATS.
+ */
+static void benchmarkLayouts(Scene *scene)
+{
+    tbb::task_scheduler_init init(threadCount);
+
+    std::vector<Ray3f> rays;
+    pcg32 random;
+    for (const Mesh *mesh : scene->getMeshes())
+    {
+        const MatrixXf &V = mesh->getVertexPositions();
+        const MatrixXf &N = mesh->getVertexNormals();
+        for (int i = 0; i < V.cols(); ++i)
+        {
+            for (int k = 0; k < LAYOUT_BENCHMARK_DIRECTIONS; ++k)
+            {
+                float z = 2.f * random.nextFloat() - 1.f, phi = 2.f * M_PI * random.nextFloat();
+                float r = std::sqrt(std::max(0.f, 1.f - z * z));
+                Vector3f d(r * std::cos(phi), r * std::sin(phi), z);
+                if (N.cols() > 0 && d.dot(Vector3f(N.col(i))) < 0)
+                    d = -d;
+                rays.push_back(Ray3f(Point3f(V.col(i)), d));
+            }
+        }
+    }
+
+    const char *names[] = { "depth-first", "van Emde Boas", "treelet" };
+    Accel *accel = scene->getAccel();
+    for (int layout = 0; layout < 3; ++layout)
+    {
+        accel->setNodeLayout((Accel::ENodeLayout) layout);
+        accel->build();
+        accel->resetTraversalStatistics();
+
+        Timer timer;
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, rays.size(), 4096),
+            [&](const tbb::blocked_range<size_t> &range)
+            {
+                for (size_t i = range.begin(); i < range.end(); ++i)
+                    scene->rayIntersect(rays[i]);
+            }
+        );
+        double seconds = timer.elapsed() / 1000.0;
+
+        TraversalStatistics stats = accel->getTraversalStatistics(true);
+        cout << tfm::format("%-14s %.2f Mrays/s", names[layout], rays.size() / seconds * 1e-6);
+        if (stats.queries > 0)
+            cout << tfm::format(", %.2f nodes and %.2f cache misses per ray",
+                (double) stats.total[TraversalStatistics::ENodes] / stats.queries,
+                (double) stats.total[TraversalStatistics::ECacheMisses] / stats.queries);
+        cout << endl;
+    }
+}
+
 int main(int argc, char **argv)
 {
     std::cout << "ԡǴmainһִļȻȡȨޣʹֻնֶУĲ\n";
     if (argc < 2) {
-        cerr << "Syntax: " << argv[0] << " <scene.xml>" << endl;
+        cerr << "Syntax: " << argv[0] << " [--threads <count>] [--layout-benchmark] <scene.xml>" << endl;
         return -1;
     }
 
@@ -194,6 +375,11 @@ int main(int argc, char **argv)
 
             continue;
         }
+        if (token == "--layout-benchmark")
+        {
+            layoutBenchmark = true;
+            continue;
+        }
 
         filesystem::path path(argv[i]);
 
@@ -250,7 +436,9 @@ int main(int argc, char **argv)
             std::unique_ptr<NoriObject> root(loadFromXML(sceneName));
             /* When the XML root object is a scene, start rendering it .. */
             // scenesdo nothing
-            if (root->getClassType() == NoriObject::EScene)
+            if (root->getClassType() == NoriObject::EScene && layoutBenchmark)
+                benchmarkLayouts(static_cast<Scene *>(root.get()));
+            else if (root->getClassType() == NoriObject::EScene)
                 // static_castָȡתΪSceneָԶ
                 render(static_cast<Scene *>(root.get()), sceneName);
 
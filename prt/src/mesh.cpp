@@ -20,16 +20,62 @@
 #include <nori/bbox.h>
 #include <nori/bsdf.h>
 #include <nori/emitter.h>
+#include <nori/instance.h>
 #include <nori/warp.h>
 #include <Eigen/Geometry>
+#include <algorithm>
 
 NORI_NAMESPACE_BEGIN
 
+/// Bits per axis of the quantized positions that are sorted along a space-filling curve
+static const int REORDER_CURVE_BITS = 21;
+/// Size of the FIFO vertex cache that the triangle order is optimized for
+static const uint32_t REORDER_CACHE_SIZE = 16;
+
+/// Interleave the bits of three quantized coordinates, the first axis being the most significant
+static uint64_t mortonKey(const uint32_t x[3]) {
+    uint64_t key = 0;
+    for (int bit = REORDER_CURVE_BITS - 1; bit >= 0; --bit)
+        for (int axis = 0; axis < 3; ++axis)
+            key = (key << 1) | ((x[axis] >> bit) & 1);
+    return key;
+}
+
+/// Position along the Hilbert curve (J. Skilling, "Programming the Hilbert curve", 2004)
+static uint64_t hilbertKey(uint32_t x[3]) {
+    /* Undo the rotations and reflections of the coarser levels */
+    for (uint32_t q = 1u << (REORDER_CURVE_BITS - 1); q > 1; q >>= 1) {
+        uint32_t p = q - 1;
+        for (int axis = 0; axis < 3; ++axis) {
+            if (x[axis] & q) {
+                x[0] ^= p;
+            } else {
+                uint32_t t = (x[0] ^ x[axis]) & p;
+                x[0] ^= t;
+                x[axis] ^= t;
+            }
+        }
+    }
+
+    /* Gray encode, which leaves the index spread over the axes like a Morton code */
+    x[1] ^= x[0];
+    x[2] ^= x[1];
+    uint32_t t = 0;
+    for (uint32_t q = 1u << (REORDER_CURVE_BITS - 1); q > 1; q >>= 1)
+        if (x[2] & q)
+            t ^= q - 1;
+    for (int axis = 0; axis < 3; ++axis)
+        x[axis] ^= t;
+    return mortonKey(x);
+}
+
 Mesh::Mesh() { }
 
 Mesh::~Mesh() {
     delete m_bsdf;
     delete m_emitter;
+    for (Instance *instance : m_instances)
+        delete instance;
 }
 
 void Mesh::activate() {
@@ -40,6 +86,136 @@ void Mesh::activate() {
     }
 }
 
+void Mesh::setVertexPositions(const MatrixXf &V, const MatrixXf &N) {
+    if (V.rows() != 3 || V.cols() != m_V.cols())
+        throw NoriException("Mesh::setVertexPositions(): expected %i vertices, got %i!", m_V.cols(), V.cols());
+    if (N.size() > 0 && (N.rows() != 3 || N.cols() != m_V.cols()))
+        throw NoriException("Mesh::setVertexPositions(): expected %i normals, got %i!", m_V.cols(), N.cols());
+
+    // same size, so the storage is reused
+    m_V = V;
+    if (N.size() > 0)
+        m_N = N;
+    m_bbox.reset();
+    for (uint32_t i = 0; i < (uint32_t) m_V.cols(); ++i)
+        m_bbox.expandBy(m_V.col(i));
+}
+
+void Mesh::reorder(EVertexOrder order) {
+    const uint32_t vertexCount = getVertexCount(), triangleCount = getTriangleCount();
+    if (order == EFileOrder || vertexCount == 0)
+        return;
+
+    /* Sort the vertices along the curve, ties keep their file order */
+    std::vector<std::pair<uint64_t, uint32_t>> keys(vertexCount);
+    const Vector3f extents = m_bbox.getExtents();
+    const float resolution = (float) (1u << REORDER_CURVE_BITS);
+    for (uint32_t i = 0; i < vertexCount; ++i) {
+        uint32_t x[3];
+        for (int axis = 0; axis < 3; ++axis) {
+            float rel = extents[axis] > 0 ? (m_V(axis, i) - m_bbox.min[axis]) / extents[axis] : 0.0f;
+            x[axis] = (uint32_t) clamp(rel * resolution, 0.0f, resolution - 1.0f);
+        }
+        keys[i] = std::make_pair(order == EMortonOrder ? mortonKey(x) : hilbertKey(x), i);
+    }
+    std::sort(keys.begin(), keys.end());
+
+    m_vertexRemap.resize(vertexCount);
+    for (uint32_t i = 0; i < vertexCount; ++i)
+        m_vertexRemap[keys[i].second] = i;
+    for (MatrixXf *attribute : { &m_V, &m_N, &m_UV, &m_C }) {
+        if (attribute->size() == 0)
+            continue;
+        MatrixXf sorted(attribute->rows(), vertexCount);
+        for (uint32_t i = 0; i < vertexCount; ++i)
+            sorted.col(i) = attribute->col(keys[i].second);
+        attribute->swap(sorted);
+    }
+    for (uint32_t f = 0; f < triangleCount; ++f)
+        for (int k = 0; k < 3; ++k)
+            m_F(k, f) = m_vertexRemap[m_F(k, f)];
+
+    /* Triangles around every vertex */
+    std::vector<uint32_t> offsets(vertexCount + 1, 0), adjacent(3 * (size_t) triangleCount);
+    for (uint32_t f = 0; f < triangleCount; ++f)
+        for (int k = 0; k < 3; ++k)
+            offsets[m_F(k, f) + 1]++;
+    for (uint32_t i = 0; i < vertexCount; ++i)
+        offsets[i + 1] += offsets[i];
+    std::vector<uint32_t> live(vertexCount), fill(offsets.begin(), offsets.end() - 1);
+    for (uint32_t f = 0; f < triangleCount; ++f)
+        for (int k = 0; k < 3; ++k)
+            adjacent[fill[m_F(k, f)]++] = f;
+    for (uint32_t i = 0; i < vertexCount; ++i)
+        live[i] = offsets[i + 1] - offsets[i];
+
+    /* Tipsify: emit all remaining triangles around a fanning vertex, then
+       continue with a vertex of those triangles whose fan still fits into
+       the cache, preferring the one that entered it first. At dead ends,
+       go back to the most recently used vertex with triangles left, or
+       else to the next one along the curve */
+    const uint32_t none = (uint32_t) -1;
+    std::vector<uint32_t> cacheTime(vertexCount, 0), deadEnd, candidates, emitted;
+    std::vector<bool> done(triangleCount, false);
+    emitted.reserve(triangleCount);
+    uint32_t time = REORDER_CACHE_SIZE + 1, cursor = 0;
+    auto skipDeadEnd = [&]() {
+        while (!deadEnd.empty()) {
+            uint32_t v = deadEnd.back();
+            deadEnd.pop_back();
+            if (live[v] > 0)
+                return v;
+        }
+        for (; cursor < vertexCount; ++cursor)
+            if (live[cursor] > 0)
+                return cursor;
+        return none;
+    };
+
+    for (uint32_t fan = skipDeadEnd(); fan != none; ) {
+        candidates.clear();
+        for (uint32_t a = offsets[fan]; a < offsets[fan + 1]; ++a) {
+            uint32_t f = adjacent[a];
+            if (done[f])
+                continue;
+            done[f] = true;
+            emitted.push_back(f);
+            for (int k = 0; k < 3; ++k) {
+                uint32_t v = m_F(k, f);
+                live[v]--;
+                deadEnd.push_back(v);
+                candidates.push_back(v);
+                if (time - cacheTime[v] > REORDER_CACHE_SIZE)
+                    cacheTime[v] = time++;
+            }
+        }
+
+        fan = none;
+        int64_t best = -1;
+        for (uint32_t v : candidates) {
+            if (live[v] == 0)
+                continue;
+            int64_t priority = 0;
+            if (time - cacheTime[v] + 2 * live[v] <= REORDER_CACHE_SIZE)
+                priority = time - cacheTime[v];
+            if (priority > best) {
+                best = priority;
+                fan = v;
+            }
+        }
+        if (fan == none)
+            fan = skipDeadEnd();
+    }
+
+    MatrixXu F(3, triangleCount);
+    m_triangleRemap.resize(triangleCount);
+    for (uint32_t i = 0; i < triangleCount; ++i) {
+        F.col(i) = m_F.col(emitted[i]);
+        m_triangleRemap[emitted[i]] = i;
+    }
+    m_F.swap(F);
+}
+
 float Mesh::surfaceArea(uint32_t index) const {
     uint32_t i0 = m_F(0, index), i1 = m_F(1, index), i2 = m_F(2, index);
 
@@ -91,6 +267,51 @@ bool Mesh::rayIntersect(uint32_t index, const Ray3f &ray, float &u, float &v, fl
     return t >= ray.mint && t <= ray.maxt;
 }
 
+void Mesh::setHitInformation(uint32_t index, Intersection &its) const {
+    /* Find the barycentric coordinates */
+    Vector3f bary;
+    bary << 1-its.uv.sum(), its.uv;
+
+    /* Vertex indices of the triangle */
+    uint32_t idx0 = m_F(0, index), idx1 = m_F(1, index), idx2 = m_F(2, index);
+
+    Point3f p0 = m_V.col(idx0), p1 = m_V.col(idx1), p2 = m_V.col(idx2);
+
+    its.mesh = this;
+
+    its.bary = bary;
+
+    its.tri_index = Point3f(idx0, idx1, idx2);
+
+    /* Compute the intersection positon accurately
+       using barycentric coordinates */
+    its.p = bary.x() * p0 + bary.y() * p1 + bary.z() * p2;
+
+    /* Compute proper texture coordinates if provided by the mesh */
+    if (m_UV.size() > 0)
+        its.uv = bary.x() * m_UV.col(idx0) +
+            bary.y() * m_UV.col(idx1) +
+            bary.z() * m_UV.col(idx2);
+
+    /* Compute the geometry frame */
+    its.geoFrame = Frame((p1-p0).cross(p2-p0).normalized());
+
+    if (m_N.size() > 0) {
+        /* Compute the shading frame. Note that for simplicity,
+           the current implementation doesn't attempt to provide
+           tangents that are continuous across the surface. That
+           means that this code will need to be modified to be able
+           use anisotropic BRDFs, which need tangent continuity */
+
+        its.shFrame = Frame(
+            (bary.x() * m_N.col(idx0) +
+             bary.y() * m_N.col(idx1) +
+             bary.z() * m_N.col(idx2)).normalized());
+    } else {
+        its.shFrame = its.geoFrame;
+    }
+}
+
 BoundingBox3f Mesh::getBoundingBox(uint32_t index) const {
     BoundingBox3f result(m_V.col(m_F(0, index)));
     result.expandBy(m_V.col(m_F(1, index)));
@@ -123,6 +344,10 @@ void Mesh::addChild(NoriObject *obj) {
             }
             break;
 
+        case EInstance:
+            m_instances.push_back(static_cast<Instance *>(obj));
+            break;
+
         default:
             throw NoriException("Mesh::addChild(<%s>) is not supported!",
                                 classTypeName(obj->getClassType()));
@@ -135,12 +360,14 @@ std::string Mesh::toString() const {
         "  name = \"%s\",\n"
         "  vertexCount = %i,\n"
         "  triangleCount = %i,\n"
+        "  instanceCount = %i,\n"
         "  bsdf = %s,\n"
         "  emitter = %s\n"
         "]",
         m_name,
         m_V.cols(),
         m_F.cols(),
+        m_instances.size(),
         m_bsdf ? indent(m_bsdf->toString()) : std::string("null"),
         m_emitter ? indent(m_emitter->toString()) : std::string("null")
     );
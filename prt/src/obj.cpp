@@ -17,91 +17,197 @@
 */
 
 #include <nori/mesh.h>
+#include <nori/mmap.h>
 #include <nori/timer.h>
 #include <filesystem/resolver.h>
-#include <unordered_map>
-#include <fstream>
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
+#include <cstring>
 
 NORI_NAMESPACE_BEGIN
 
+/// Approximate number of bytes of the OBJ file that are parsed by one task
+static const size_t OBJ_CHUNK_SIZE = 1024 * 1024;
+
+/// Is this a character that separates the tokens of a line?
+static inline bool isBlank(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+/// Return the next token of a line in [begin, end) and advance \c pos past it (empty at the end of the line)
+static inline bool nextToken(const char *&pos, const char *lineEnd, const char *&begin, const char *&end) {
+    while (pos != lineEnd && isBlank(*pos))
+        ++pos;
+    begin = pos;
+    while (pos != lineEnd && !isBlank(*pos))
+        ++pos;
+    end = pos;
+    return begin != end;
+}
+
+/**
+ * \brief Parse a floating point token
+ *
+ * Decimals whose significant digits and power of ten are both exactly
+ * representable as doubles are converted with a single (correctly
+ * rounded) multiplication or division. Rounding that double to float
+ * gives the correctly rounded float unless it lies exactly halfway
+ * between two floats. Everything else goes through \c strtof(), so the
+ * result always matches what the stream operators produce.
+ */
+static bool parseFloat(const char *begin, const char *end, float &value) {
+    static const double powers[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+                                     1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+
+    const char *pos = begin;
+    bool negative = false;
+    if (pos != end && (*pos == '+' || *pos == '-'))
+        negative = *pos++ == '-';
+
+    uint64_t mantissa = 0;
+    int exponent = 0, digits = 0, significant = 0;
+    for (; pos != end && *pos >= '0' && *pos <= '9'; ++pos, ++digits) {
+        mantissa = mantissa * 10 + (uint64_t) (*pos - '0');
+        significant += mantissa != 0 ? 1 : 0;
+    }
+    if (pos != end && *pos == '.') {
+        for (++pos; pos != end && *pos >= '0' && *pos <= '9'; ++pos, ++digits) {
+            mantissa = mantissa * 10 + (uint64_t) (*pos - '0');
+            significant += mantissa != 0 ? 1 : 0;
+            exponent--;
+        }
+    }
+    bool fast = digits > 0 && significant <= 18;
+    if (fast && pos != end && (*pos == 'e' || *pos == 'E')) {
+        const char *exponentStart = ++pos;
+        bool negativeExponent = false;
+        if (pos != end && (*pos == '+' || *pos == '-'))
+            negativeExponent = *pos++ == '-';
+        int explicitExponent = 0;
+        for (; pos != end && *pos >= '0' && *pos <= '9' && explicitExponent < 1000; ++pos)
+            explicitExponent = explicitExponent * 10 + (*pos - '0');
+        fast = pos != exponentStart + (negativeExponent || *exponentStart == '+' ? 1 : 0);
+        exponent += negativeExponent ? -explicitExponent : explicitExponent;
+    }
+
+    if (fast && pos == end) {
+        while (mantissa != 0 && mantissa % 10 == 0 && exponent < 0) {
+            mantissa /= 10;
+            exponent++;
+        }
+        if (mantissa <= (1ull << 53) && exponent >= -22 && exponent <= 22) {
+            double result = exponent < 0 ? (double) mantissa / powers[-exponent]
+                                         : (double) mantissa * powers[exponent];
+            uint64_t bits;
+            memcpy(&bits, &result, sizeof(double));
+            if ((bits & 0x1FFFFFFFull) != 0x10000000ull) {
+                value = (float) (negative ? -result : result);
+                return true;
+            }
+        }
+    }
+
+    std::string token(begin, end);
+    char *endPtr = nullptr;
+    value = strtof(token.c_str(), &endPtr);
+    return !token.empty() && *endPtr == '\0';
+}
+
 /**
  * \brief Loader for Wavefront OBJ triangle meshes
+ *
+ * The file is memory mapped and split into chunks of whole lines, which
+ * are parsed in parallel. Faces refer to the vertex data by absolute
+ * index, so they are only resolved after all chunks have been merged in
+ * file order, which gives exactly the mesh of a sequential parse.
  */
 class WavefrontOBJ : public Mesh {
 public:
     WavefrontOBJ(const PropertyList &propList) {
-        typedef std::unordered_map<OBJVertex, uint32_t, OBJVertexHash> VertexMap;
-
         filesystem::path filename =
             getFileResolver()->resolve(propList.getString("filename"));
 
-        std::ifstream is(filename.str());
-        if (is.fail())
+        std::unique_ptr<MemoryMappedFile> file;
+        try {
+            file.reset(new MemoryMappedFile(filename.str()));
+        } catch (const NoriException &) {
             throw NoriException("Unable to open OBJ file \"%s\"!", filename);
+        }
         Transform trafo = propList.getTransform("toWorld", Transform());
 
+        /* Optionally sort the vertices along a space-filling curve, see Mesh::reorder() */
+        std::string orderName = propList.getString("vertexOrder", "file");
+        EVertexOrder order;
+        if (orderName == "file")
+            order = EFileOrder;
+        else if (orderName == "morton")
+            order = EMortonOrder;
+        else if (orderName == "hilbert")
+            order = EHilbertOrder;
+        else
+            throw NoriException("OBJ: unknown vertex order \"%s\"!", orderName);
+
         cout << "Loading \"" << filename << "\" .. ";
         cout.flush();
         Timer timer;
 
+        /* Split the file into chunks that end at a line break */
+        const char *data = (const char *) file->data(), *dataEnd = data + file->size();
+        std::vector<const char *> bounds(1, data);
+        while (bounds.back() != dataEnd) {
+            const char *next = dataEnd;
+            if ((size_t) (dataEnd - bounds.back()) > OBJ_CHUNK_SIZE) {
+                next = (const char *) memchr(bounds.back() + OBJ_CHUNK_SIZE, '\n',
+                                             dataEnd - bounds.back() - OBJ_CHUNK_SIZE);
+                next = next ? next + 1 : dataEnd;
+            }
+            bounds.push_back(next);
+        }
+
+        std::vector<OBJChunk> chunks(bounds.size() - 1);
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, chunks.size(), 1),
+            [&](const tbb::blocked_range<size_t> &range) {
+                for (size_t i = range.begin(); i != range.end(); ++i)
+                    parseChunk(bounds[i], bounds[i + 1], trafo, chunks[i]);
+            }
+        );
+
+        /* Merge the chunks in file order */
         std::vector<Vector3f>   positions;
         std::vector<Vector2f>   texcoords;
         std::vector<Vector3f>   normals;
+        std::vector<Color3f>    colors;
         std::vector<uint32_t>   indices;
         std::vector<OBJVertex>  vertices;
-        VertexMap vertexMap;
-
-        std::string line_str;
-        while (std::getline(is, line_str)) {
-            std::istringstream line(line_str);
-
-            std::string prefix;
-            line >> prefix;
-
-            if (prefix == "v") {
-                Point3f p;
-                line >> p.x() >> p.y() >> p.z();
-                p = trafo * p;
-                m_bbox.expandBy(p);
-                positions.push_back(p);
-            } else if (prefix == "vt") {
-                Point2f tc;
-                line >> tc.x() >> tc.y();
-                texcoords.push_back(tc);
-            } else if (prefix == "vn") {
-                Normal3f n;
-                line >> n.x() >> n.y() >> n.z();
-                normals.push_back((trafo * n).normalized());
-            } else if (prefix == "f") {
-                std::string v1, v2, v3, v4;
-                line >> v1 >> v2 >> v3 >> v4;
-                OBJVertex verts[6];
-                int nVertices = 3;
 
-                verts[0] = OBJVertex(v1);
-                verts[1] = OBJVertex(v2);
-                verts[2] = OBJVertex(v3);
+        size_t positionCount = 0, texcoordCount = 0, normalCount = 0, colorCount = 0, cornerCount = 0;
+        for (const OBJChunk &chunk : chunks) {
+            positionCount += chunk.positions.size();
+            texcoordCount += chunk.texcoords.size();
+            normalCount += chunk.normals.size();
+            colorCount += chunk.colors.size();
+            cornerCount += chunk.corners.size();
+        }
+        positions.reserve(positionCount);
+        texcoords.reserve(texcoordCount);
+        normals.reserve(normalCount);
+        colors.reserve(colorCount);
+        indices.reserve(cornerCount);
+        for (OBJChunk &chunk : chunks) {
+            positions.insert(positions.end(), chunk.positions.begin(), chunk.positions.end());
+            texcoords.insert(texcoords.end(), chunk.texcoords.begin(), chunk.texcoords.end());
+            normals.insert(normals.end(), chunk.normals.begin(), chunk.normals.end());
+            colors.insert(colors.end(), chunk.colors.begin(), chunk.colors.end());
+            m_bbox.expandBy(chunk.bbox);
+        }
 
-                if (!v4.empty()) {
-                    /* This is a quad, split into two triangles */
-                    verts[3] = OBJVertex(v4);
-                    verts[4] = verts[0];
-                    verts[5] = verts[2];
-                    nVertices = 6;
-                }
-                /* Convert to an indexed vertex list */
-                for (int i=0; i<nVertices; ++i) {
-                    const OBJVertex &v = verts[i];
-                    VertexMap::const_iterator it = vertexMap.find(v);
-                    if (it == vertexMap.end()) {
-                        vertexMap[v] = (uint32_t) vertices.size();
-                        indices.push_back((uint32_t) vertices.size());
-                        vertices.push_back(v);
-                    } else {
-                        indices.push_back(it->second);
-                    }
-                }
-            }
+        /* Convert to an indexed vertex list */
+        OBJVertexMap vertexMap(positionCount);
+        vertices.reserve(positionCount);
+        for (OBJChunk &chunk : chunks) {
+            for (const OBJVertex &v : chunk.corners)
+                indices.push_back(vertexMap.insert(v, vertices));
+            chunk = OBJChunk();
         }
 
         m_F.resize(3, indices.size()/3);
@@ -123,11 +229,21 @@ public:
                 m_UV.col(i) = texcoords.at(vertices[i].uv-1);
         }
 
+        if (!colors.empty()) {
+            if (colors.size() != positions.size())
+                throw NoriException("OBJ file \"%s\" only provides colors for some vertices!", filename);
+            m_C.resize(3, vertices.size());
+            for (uint32_t i=0; i<vertices.size(); ++i)
+                m_C.col(i) = colors.at(vertices[i].p-1);
+        }
+
+        reorder(order);
+
         m_name = filename.str();
         cout << "done. (V=" << m_V.cols() << ", F=" << m_F.cols() << ", took "
              << timer.elapsedString() << " and "
              << memString(m_F.size() * sizeof(uint32_t) +
-                          sizeof(float) * (m_V.size() + m_N.size() + m_UV.size()))
+                          sizeof(float) * (m_V.size() + m_N.size() + m_UV.size() + m_C.size()))
              << ")" << endl;
     }
 
@@ -155,20 +271,192 @@ protected:
                 n = toUInt(tokens[2]);
         }
 
+        /**
+         * \brief Fast path of the string constructor for the common forms
+         * "p", "p/uv", "p//n" and "p/uv/n" with plain decimal indices
+         *
+         * \return \c false for anything else, which then has to go through
+         * the string constructor
+         */
+        inline bool parse(const char *begin, const char *end) {
+            uint32_t *fields[3] = { &p, &uv, &n };
+            const char *pos = begin;
+            for (int field = 0; field < 3; ++field) {
+                const char *start = pos;
+                uint32_t value = 0;
+                for (; pos != end && *pos >= '0' && *pos <= '9' && pos - start < 9; ++pos)
+                    value = value * 10 + (uint32_t) (*pos - '0');
+                if (pos != start)
+                    *fields[field] = value;
+                else if (field == 0)
+                    return false;
+                if (pos == end)
+                    return true;
+                if (*pos != '/')
+                    return false;
+                ++pos;
+            }
+            return false;
+        }
+
         inline bool operator==(const OBJVertex &v) const {
             return v.p == p && v.n == n && v.uv == uv;
         }
     };
 
-    /// Hash function for OBJVertex
-    struct OBJVertexHash {
-        std::size_t operator()(const OBJVertex &v) const {
-            size_t hash = std::hash<uint32_t>()(v.p);
-            hash = hash * 37 + std::hash<uint32_t>()(v.uv);
-            hash = hash * 37 + std::hash<uint32_t>()(v.n);
-            return hash;
+    /**
+     * \brief Open-addressing hash table that numbers the distinct OBJ
+     * vertices in the order of their first occurrence
+     *
+     * The home slot of a vertex is its position index spread evenly over
+     * the table, so the probes follow the order in which the file refers
+     * to its positions (which is usually coherent) instead of jumping all
+     * over memory. Each slot packs a hash of all three indices with the
+     * vertex index plus one (zero marks an empty slot), so vertices that
+     * share a position are mostly told apart without looking at the
+     * vertex list. Linear probing, grown at a load factor of one half.
+     */
+    class OBJVertexMap {
+    public:
+        /// Create a table for a file with \c positionCount positions
+        OBJVertexMap(size_t positionCount) : m_positionCount(std::max(positionCount, (size_t) 1)) {
+            resize(2 * positionCount);
+        }
+
+        /// Return the index of a vertex, appending it to \c vertices if it was not seen before
+        uint32_t insert(const OBJVertex &v, std::vector<OBJVertex> &vertices) {
+            if (2 * (vertices.size() + 1) > m_slots.size()) {
+                resize(2 * m_slots.size());
+                for (uint32_t index = 0; index < (uint32_t) vertices.size(); ++index)
+                    m_slots[findEmpty(vertices[index])] = tag(vertices[index]) | (index + 1);
+            }
+            uint64_t t = tag(v);
+            size_t mask = m_slots.size() - 1;
+            for (size_t i = home(v); ; i = (i + 1) & mask) {
+                uint64_t slot = m_slots[i];
+                if (slot == 0) {
+                    uint32_t index = (uint32_t) vertices.size();
+                    m_slots[i] = t | (index + 1);
+                    vertices.push_back(v);
+                    return index;
+                }
+                if ((slot & 0xFFFFFFFF00000000ull) == t && vertices[(uint32_t) slot - 1] == v)
+                    return (uint32_t) slot - 1;
+            }
+        }
+
+    private:
+        /// Clear the table and make room for at least \c capacity slots
+        void resize(size_t capacity) {
+            size_t size = 16;
+            while (size < capacity)
+                size *= 2;
+            m_slots.assign(size, 0);
+            m_stride = std::max(size / m_positionCount, (size_t) 1);
         }
+
+        size_t home(const OBJVertex &v) const {
+            return ((size_t) (v.p - 1) * m_stride) & (m_slots.size() - 1);
+        }
+
+        size_t findEmpty(const OBJVertex &v) const {
+            size_t i = home(v), mask = m_slots.size() - 1;
+            while (m_slots[i] != 0)
+                i = (i + 1) & mask;
+            return i;
+        }
+
+        /// Upper half of a hash of all 96 bits of the indices (finalizer of SplitMix64)
+        static uint64_t tag(const OBJVertex &v) {
+            uint64_t h = (((uint64_t) v.p << 32) | v.uv) ^ ((uint64_t) v.n * 0x9E3779B97F4A7C15ull);
+            h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ull;
+            h = (h ^ (h >> 27)) * 0x94D049BB133111EBull;
+            return (h ^ (h >> 31)) & 0xFFFFFFFF00000000ull;
+        }
+
+        std::vector<uint64_t> m_slots;
+        size_t m_positionCount;
+        size_t m_stride = 1;
+    };
+
+    /// Contents of a range of lines of the file
+    struct OBJChunk {
+        std::vector<Vector3f>  positions;
+        std::vector<Vector2f>  texcoords;
+        std::vector<Vector3f>  normals;
+        std::vector<Color3f>   colors;
+        std::vector<OBJVertex> corners;  ///< Three per triangle, quads are already split
+        BoundingBox3f bbox;              ///< Bounds of the transformed positions
     };
+
+    /// Parse the lines in [pos, end), which must start at the beginning of a line
+    static void parseChunk(const char *pos, const char *end, const Transform &trafo, OBJChunk &chunk) {
+        while (pos != end) {
+            const char *lineEnd = (const char *) memchr(pos, '\n', end - pos);
+            if (!lineEnd)
+                lineEnd = end;
+            const char *line = pos, *begin, *tokenEnd;
+            pos = lineEnd == end ? end : lineEnd + 1;
+
+            if (!nextToken(line, lineEnd, begin, tokenEnd) || tokenEnd - begin > 2)
+                continue;
+            std::string prefix(begin, tokenEnd);
+
+            /* Read 'count' floating point values as leniently as the stream
+               operators did: a token with trailing characters yields its
+               numeric prefix (or 0), and the values after it, like missing
+               ones, are 0. Returns the number of complete values */
+            auto readFloats = [&](float *values, int count) {
+                std::fill(values, values + count, 0.0f);
+                for (int i = 0; i < count; ++i) {
+                    if (!nextToken(line, lineEnd, begin, tokenEnd) || !parseFloat(begin, tokenEnd, values[i]))
+                        return i;
+                }
+                return count;
+            };
+
+            if (prefix == "v") {
+                float values[6];
+                readFloats(values, 3);
+                Point3f p = trafo * Point3f(values[0], values[1], values[2]);
+                chunk.bbox.expandBy(p);
+                chunk.positions.push_back(p);
+                /* Optional vertex color extension: "v x y z r g b" */
+                if (readFloats(values + 3, 3) == 3)
+                    chunk.colors.push_back(Color3f(values[3], values[4], values[5]));
+            } else if (prefix == "vt") {
+                float values[2];
+                readFloats(values, 2);
+                chunk.texcoords.push_back(Vector2f(values[0], values[1]));
+            } else if (prefix == "vn") {
+                float values[3];
+                readFloats(values, 3);
+                chunk.normals.push_back((trafo * Normal3f(values[0], values[1], values[2])).normalized());
+            } else if (prefix == "f") {
+                OBJVertex verts[6];
+                bool quad = false;
+                for (int i = 0; i < 4; ++i) {
+                    if (!nextToken(line, lineEnd, begin, tokenEnd)) {
+                        /* Missing corners fail like empty strings do in the string constructor */
+                        if (i < 3)
+                            verts[i] = OBJVertex(std::string());
+                        continue;
+                    }
+                    if (!verts[i].parse(begin, tokenEnd))
+                        verts[i] = OBJVertex(std::string(begin, tokenEnd));
+                    quad = i == 3;
+                }
+                int nVertices = 3;
+                if (quad) {
+                    /* This is a quad, split into two triangles */
+                    verts[4] = verts[0];
+                    verts[5] = verts[2];
+                    nVertices = 6;
+                }
+                chunk.corners.insert(chunk.corners.end(), verts, verts + nVertices);
+            }
+        }
+    }
 };
 
 NORI_REGISTER_CLASS(WavefrontOBJ, "obj");
@@ -0,0 +1,174 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/mesh.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Checks the OBJ loader on the hand-written \c objtest.obj
+ *
+ * The \c <mesh> child has to be that file. It has CRLF line ends, no line
+ * break after the last face, quads, vertex colors and numbers with a '+'
+ * sign, a leading '.' and 17 significant digits. Its faces repeat corners
+ * and share positions between corners with other texture coordinates and
+ * normals, enough of them to make the vertex table of the loader grow
+ * twice. The loaded vertices have to come in the order of their first
+ * occurrence, and their positions, texture coordinates, colors and the
+ * triangles have to match the expected values exactly (the parser rounds
+ * correctly), the normals up to the rounding of their normalization.
+ */
+class OBJTest : public NoriObject {
+public:
+    OBJTest(const PropertyList &) { }
+
+    virtual ~OBJTest() {
+        delete m_mesh;
+    }
+
+    void addChild(NoriObject *obj) {
+        switch (obj->getClassType()) {
+            case EMesh:
+                if (m_mesh)
+                    throw NoriException("OBJTest: there can only be one mesh per test!");
+                m_mesh = static_cast<Mesh *>(obj);
+                break;
+
+            default:
+                throw NoriException("OBJTest::addChild(<%s>) is not supported!",
+                    classTypeName(obj->getClassType()));
+        }
+    }
+
+    void activate() {
+        if (!m_mesh)
+            throw NoriException("OBJTest: a mesh is required!");
+
+        /* The positions (with their colors), texture coordinates and normals of the file */
+        const float positions[][6] = {
+            { 0.f,  0.f,                   0.f,   1.f, 0.f, 0.f },
+            { 1.5f, 0.f,                   0.f,   0.f, 1.f, 0.f },
+            { 1.5f, .25f,                  0.f,   0.f, 0.f, 1.f },
+            { -.5f, 0.12345678901234567f,  2e-1f, .5f, .5f, .25f }
+        };
+        const float texcoords[][2] = {
+            { 0.f, 0.f }, { 1.f, 0.f }, { 1.f, 1.f }, { .5f, 1.2345678901234567f }
+        };
+        const float normals[][3] = {
+            { 0.f, 0.f, 1.f }, { 3.f, 0.f, -4.f }
+        };
+
+        /* The distinct p/uv/n corners of the faces (one-based like in the
+           file), in the order of their first occurrence */
+        const uint32_t vertices[][3] = {
+            { 1, 1, 1 }, { 2, 2, 1 }, { 3, 3, 1 }, { 4, 4, 1 }, { 3, 3, 2 }, { 2, 2, 2 },
+            { 1, 1, 2 }, { 4, 4, 2 }, { 1, 2, 1 }, { 2, 1, 1 }, { 1, 3, 2 }, { 1, 4, 1 },
+            { 1, 4, 2 }, { 2, 3, 1 }, { 2, 4, 1 }, { 3, 1, 2 }, { 4, 2, 1 }, { 4, 3, 2 }
+        };
+        /* Quads are split into (0, 1, 2) and (3, 0, 2) */
+        const uint32_t triangles[][3] = {
+            { 0, 1, 2 },   { 3, 0, 2 },    { 4, 5, 6 },   { 0, 2, 3 },    { 7, 8, 9 },
+            { 8, 7, 4 },   { 10, 11, 12 }, { 13, 10, 12 }, { 14, 15, 16 }, { 17, 14, 16 },
+            { 17, 14, 0 }
+        };
+
+        const int vertexCount = (int) (sizeof(vertices) / sizeof(vertices[0]));
+        const int triangleCount = (int) (sizeof(triangles) / sizeof(triangles[0]));
+        MatrixXf V(3, vertexCount), UV(2, vertexCount), N(3, vertexCount), C(3, vertexCount);
+        for (int i = 0; i < vertexCount; ++i) {
+            const float *p = positions[vertices[i][0] - 1];
+            const float *uv = texcoords[vertices[i][1] - 1];
+            const float *n = normals[vertices[i][2] - 1];
+            const float length = std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+            for (int k = 0; k < 3; ++k) {
+                V(k, i) = p[k];
+                N(k, i) = n[k] / length;
+                C(k, i) = p[3 + k];
+            }
+            UV(0, i) = uv[0];
+            UV(1, i) = uv[1];
+        }
+        MatrixXf F(3, triangleCount);
+        for (int i = 0; i < triangleCount; ++i)
+            for (int k = 0; k < 3; ++k)
+                F(k, i) = (float) triangles[i][k];
+
+        struct Check {
+            const char *name;
+            MatrixXf actual;
+            const MatrixXf &expected;
+            float tolerance;
+        } checks[] = {
+            { "positions",           m_mesh->getVertexPositions(),           V,  0.f },
+            { "texture coordinates", m_mesh->getVertexTexCoords(),           UV, 0.f },
+            { "normals",             m_mesh->getVertexNormals(),             N,  1e-6f },
+            { "colors",              m_mesh->getVertexColors(),              C,  0.f },
+            { "triangles",           m_mesh->getIndices().cast<float>(),     F,  0.f }
+        };
+
+        cout << "------------------------------------------------------" << endl;
+        cout << "Testing " << m_mesh->getName() << endl;
+        int passed = 0, total = 0;
+        for (const Check &check : checks) {
+            std::string result = compare(check.actual, check.expected, check.tolerance);
+            if (result.empty()) {
+                cout << "Passed: " << check.name << endl;
+                passed++;
+            } else {
+                cout << "Failed: " << check.name << ": " << result << endl;
+            }
+            total++;
+        }
+
+        cout << "------------------------------------------------------" << endl;
+        cout << "Passed " << passed << "/" << total << " tests." << endl;
+
+        if (passed < total)
+            throw std::runtime_error("Some tests failed :(");
+    }
+
+    std::string toString() const {
+        return "OBJTest[]";
+    }
+
+    EClassType getClassType() const { return ETest; }
+
+private:
+    /// Compare loaded vertex data with the expected values, returns an empty string if they agree
+    static std::string compare(const MatrixXf &actual, const MatrixXf &expected, float tolerance) {
+        if (actual.rows() != expected.rows() || actual.cols() != expected.cols())
+            return tfm::format("got %ix%i values, expected %ix%i", actual.rows(), actual.cols(),
+                expected.rows(), expected.cols());
+        for (int i = 0; i < actual.cols(); ++i) {
+            if ((actual.col(i) - expected.col(i)).cwiseAbs().maxCoeff() > tolerance) {
+                std::ostringstream a, e;
+                a.precision(9);
+                e.precision(9);
+                a << actual.col(i).transpose();
+                e << expected.col(i).transpose();
+                return tfm::format("column %i is [%s], expected [%s]", i, a.str(), e.str());
+            }
+        }
+        return "";
+    }
+
+    Mesh *m_mesh = nullptr;
+};
+
+NORI_REGISTER_CLASS(OBJTest, "objtest");
+NORI_NAMESPACE_END
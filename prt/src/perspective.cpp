@@ -108,6 +108,14 @@ public:
         return Color3f(1.0f);
     }
 
+    bool getWorldToRaster(Eigen::Matrix4f &trafo) const {
+        trafo = Eigen::DiagonalMatrix<float, 4>(Eigen::Vector4f(
+                    (float) m_outputSize.x(), (float) m_outputSize.y(), 1.0f, 1.0f)) *
+                m_sampleToCamera.getInverseMatrix() *
+                m_cameraToWorld.getInverseMatrix();
+        return true;
+    }
+
     void addChild(NoriObject *obj) {
         switch (obj->getClassType()) {
             case EReconstructionFilter:
@@ -1,13 +1,22 @@
 #include <nori/integrator.h>
 #include <nori/scene.h>
 #include <nori/ray.h>
+#include <nori/shrotation.h>
+#include <nori/mmap.h>
+#include <nori/bsdf.h>
+#include <nori/instance.h>
+#include <nori/shadowmap.h>
+#include <nori/timer.h>
 #include <filesystem/resolver.h>
 #include <sh/spherical_harmonics.h>
 #include <sh/default_image.h>
 #include <Eigen/Core>
+#include <cstring>
 #include <fstream>
 #include <random>
 #include <stb_image.h>
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
 
 NORI_NAMESPACE_BEGIN
 
@@ -155,10 +164,49 @@ public:
     static constexpr int SHOrder = 2;
     static constexpr int SHCoeffLength = (SHOrder + 1) * (SHOrder + 1);
 
-    // rho usually should be passed to BRDF diffuse object, it's a 3D vector. I set it to 0.5 For convenience
-    static constexpr float rho = 0.99f;
     static constexpr float Pi = 3.1415926f;
 
+    // Bits per axis of the origin Morton code that the streamed bake bins its rays by
+    static constexpr int StreamMortonBits = 5;
+    // One bin per direction octant and Morton cell
+    static constexpr uint32_t StreamBinCount = 8u << (3 * StreamMortonBits);
+
+    // Transport with albedo, the red, green and blue SH coefficients in a row
+    static constexpr int RGBCoeffLength = 3 * SHCoeffLength;
+    // Vertices whose interreflection samples are gathered in parallel before they are written
+    static constexpr uint32_t GatherBlockSize = 4096;
+    // Transport files that do not start with this magic and version are baked again
+    static constexpr char TransportMagic[8] = "NoriPRT";
+    static constexpr uint32_t TransportVersion = 3;
+
+    // Header of every transport file, followed by its payload
+    struct TransportHeader
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t vertexCount;
+        uint64_t key;  // transportKey() of the scene and settings that the file was baked for
+    };
+
+    // Interreflection sample of a vertex: the previous bounce at another vertex and its weight
+    struct GatherEntry
+    {
+        uint32_t vertex;
+        float weight;
+    };
+
+    // Visibility of a block of vertices from the sample directions of the shadow
+    // map backend, one bit per direction. Unlike sh::ProjectFunction, every vertex
+    // uses the same stratified directions, so that a single map serves all of them.
+    struct ShadowMapVisibility
+    {
+        std::vector<Vector3f> directions;
+        std::vector<float> basis;  // SHCoeffLength values per direction, scaled by the sample weight
+        uint32_t words = 0;  // Words per vertex
+        uint32_t start = 0;  // First vertex of the bits
+        std::vector<uint64_t> bits;
+    };
+
     enum class Type
     {
         Unshadowed = 0,
@@ -166,6 +214,12 @@ public:
         Interreflection = 2
     };
 
+    enum class Visibility
+    {
+        RayTrace = 0,
+        ShadowMap = 1
+    };
+
     PRTIntegrator(const PropertyList& props)
     {
         /* No parameters this time */
@@ -189,12 +243,49 @@ public:
         {
             throw NoriException("Unsupported type: %s.", type);
         }
+        // ZYZ Euler angles (in degrees) applied to the projected lighting
+        Vector3f rotation = props.getVector("envRotation", Vector3f(0.0f));
+        m_EnvRotation.setEulerZYZ(degToRad(rotation.x()), degToRad(rotation.y()), degToRad(rotation.z()));
+        // Number of frames of a full spin of the environment about the up (y) axis
+        m_EnvRotationFrames = props.getInteger("envRotationFrames", 0);
+        // Visibility backend of the shadowed transport
+        auto visibility = props.getString("visibility", "raytrace");
+        if (visibility == "raytrace")
+        {
+            m_Visibility = Visibility::RayTrace;
+        }
+        else if (visibility == "shadowmap")
+        {
+            m_Visibility = Visibility::ShadowMap;
+            m_ShadowMapResolution = props.getInteger("shadowMapResolution", 1024);
+            m_ShadowMapBias = props.getFloat("shadowMapBias", 1.5f);  // In texels, scaled with the slope
+            m_CompareVisibility = props.getBoolean("compareVisibility", false);
+        }
+        else
+        {
+            throw NoriException("Unsupported visibility: %s.", visibility);
+        }
+        // Memory budget (in MB) of the bake, 0 bakes everything in-core. It bounds the
+        // transport coefficients, shadow map visibility bits and ray stream batches kept
+        // in RAM, but not the mesh, the accel, the shadow map rasters, the samples of a
+        // GatherBlockSize block of vertices or the pages of the mapped transport files
+        m_BakeMemoryBudget = (size_t) std::max(props.getInteger("bakeMemoryBudget", 0), 0) * 1024 * 1024;
+        // Resolve primary visibility with the rasterizer instead of camera rays
+        m_Rasterize = props.getBoolean("rasterize", false);
+        // Trace the shadowed transport and the interreflection samples as binned ray
+        // streams instead of vertex by vertex. Each gather block of GatherBlockSize
+        // vertices is one stream; the shadow map backend does not trace rays at all
+        m_RayStream = props.getBoolean("rayStream", false);
+        m_RayStreamBatchSize = (uint32_t) std::max(props.getInteger("rayStreamBatchSize", 1 << 20), 1);
     }
 
     virtual void preprocess(const Scene* scene) override
     {
         // Here only compute one mesh
         const auto mesh = scene->getMeshes()[0];
+        // Vertices are baked in world space, which an instanced mesh does not have
+        if (!mesh->getInstances().empty())
+            throw NoriException("PRT: the baked mesh cannot be instanced!");
         // Projection environment
         auto cubePath = getFileResolver()->resolve(m_CubemapPath);
         auto lightPath = cubePath / "light.txt";
@@ -209,198 +300,992 @@ public:
         // Resize a matrix, make it shape 3x9
         m_LightCoeffs.resize(3, SHCoeffLength);
         for (int i = 0; i < envCoeffs.size(); i++)
-        {
-            // Write envCoeffs on Light.txt and store it in m_LightCoeffs, in colMajor.
-            lightFout << (envCoeffs)[i].x() << " " << (envCoeffs)[i].y() << " " << (envCoeffs)[i].z() << std::endl;
             m_LightCoeffs.col(i) = (envCoeffs)[i];
-        }
+
+        // Rotate the lighting in SH space instead of re-projecting the cubemap
+        LightRotation::Coeffs rotated;
+        m_EnvRotation.apply(LightRotation::Coeffs(m_LightCoeffs), rotated);
+        m_LightCoeffs = rotated;
+
+        // Write the coefficients on light.txt, in colMajor.
+        for (int i = 0; i < SHCoeffLength; i++)
+            lightFout << m_LightCoeffs(0, i) << " " << m_LightCoeffs(1, i) << " " << m_LightCoeffs(2, i) << std::endl;
         std::cout << "Computed light sh coeffs from: " << cubePath.str() << " to: " << lightPath.str() << std::endl;
 
-        // Projection transport
-        m_TransportSHCoeffs.resize(SHCoeffLength, mesh->getVertexCount());  // shape 9xN, N is vertices count
-        fout << mesh->getVertexCount() << std::endl;
-        for (int i = 0; i < mesh->getVertexCount(); i++)
+        if (m_EnvRotationFrames > 0)
         {
-            const Point3f& v = mesh->getVertexPositions().col(i);  // Vertex Point need to shader
-            const Normal3f& n = mesh->getVertexNormals().col(i);
-            auto shFunc = [&](double phi, double theta) -> double {
-                Eigen::Array3d d = sh::ToVector(phi, theta);
-                const auto wi = Vector3f(d.x(), d.y(), d.z());
+            // One block of SHCoeffLength lines per frame, each frame spins the
+            // (already rotated) environment a bit further about the y axis
+            auto spinPath = cubePath / "light_rotations.txt";
+            std::ofstream spinFout(spinPath.str());
+            spinFout << m_EnvRotationFrames << std::endl;
+            LightRotation spin;
+            LightRotation::Coeffs prepared, frame;
+            spin.prepareY(rotated, prepared);
+            for (int f = 0; f < m_EnvRotationFrames; f++)
+            {
+                spin.applyY(prepared, 2.0f * M_PI * f / m_EnvRotationFrames, frame);
+                for (int i = 0; i < SHCoeffLength; i++)
+                    spinFout << frame(0, i) << " " << frame(1, i) << " " << frame(2, i) << std::endl;
+            }
+            std::cout << "Computed " << m_EnvRotationFrames << " rotated light sh coeffs to: "
+                << spinPath.str() << std::endl;
+        }
+
+        // Projection transport. The transport is baked albedo-free into binary
+        // files next to the cubemap: the direct term of every vertex and, for
+        // interreflection, the samples that its bounces gather. Files baked for
+        // the same mesh and settings are mapped instead of baked again, so a
+        // new albedo or bounce count only costs the relighting below
+        const uint32_t vertexCount = mesh->getVertexCount();
+        const uint64_t key = transportKey(scene, mesh);
+        auto directPath = cubePath / "transport.bin";
+        auto gatherPath = cubePath / "transport.gather.bin";
+        bool cached = true;
+        if (!loadDirect(directPath, vertexCount, key))
+        {
+            bakeDirect(scene, mesh, directPath, key);
+            if (!loadDirect(directPath, vertexCount, key))
+                throw NoriException("Unable to read transport file \"%s\"!", directPath.str());
+            cached = false;
+        }
+        if (m_Type == Type::Interreflection && !loadGather(gatherPath, vertexCount, key))
+        {
+            bakeGather(scene, mesh, gatherPath, key);
+            if (!loadGather(gatherPath, vertexCount, key))
+                throw NoriException("Unable to read transport file \"%s\"!", gatherPath.str());
+            cached = false;
+        }
+        if (cached)
+            std::cout << "Using the baked transport of: " << directPath.str() << std::endl;
 
-                double cosine = wi.normalized().dot(n.normalized());
-                if (m_Type == Type::Unshadowed)
+        // Apply albedo and lighting
+        m_Mesh = mesh;
+        loadAlbedo(mesh);
+        relight(vertexCount, cubePath, key);
+
+        // Save in face format. The viewer keeps a single transport vector per
+        // vertex, so transport.txt holds the average of the three channels;
+        // transport_rgb.txt holds the red, green and blue transport in a row.
+        // The viewer loads the OBJ itself, so a reordered mesh is written in file order
+        auto rgbPath = cubePath / "transport_rgb.txt";
+        std::ofstream rgbFout(rgbPath.str());
+        fout << vertexCount << std::endl;
+        rgbFout << vertexCount << std::endl;
+        std::vector<float> coeffs(RGBCoeffLength);
+        const MatrixXu& F = mesh->getIndices();
+        const std::vector<uint32_t>& triangleRemap = mesh->getTriangleRemap();
+        for (int f = 0; f < mesh->getTriangleCount(); f++)
+        {
+            const uint32_t face = triangleRemap.empty() ? f : triangleRemap[f];
+            for (int k = 0; k < 3; k++)
+            {
+                exportTransport(F(k, face), coeffs.data());
+                for (int j = 0; j < SHCoeffLength; j++)
                 {
-                    // TODO: here you need to calculate unshadowed transport term of a given direction
-                    return cosine > 0 ? cosine * rho / M_PI : 0;
+                    fout << (coeffs[j] + coeffs[SHCoeffLength + j] + coeffs[2 * SHCoeffLength + j]) / 3.0f << " ";
                 }
-                else
+                fout << std::endl;
+                for (int j = 0; j < RGBCoeffLength; j++)
                 {
-                    // TODO: here you need to calculate shadowed transport term of a given direction
-                    Ray3f sampleRay(v, wi);
-                    if (cosine > 0 && !scene->rayIntersect(sampleRay))
-                        return cosine * rho / M_PI;
-                    else
-                        return 0;
+                    rgbFout << coeffs[j] << " ";
                 }
-            };
-            auto shCoeff = sh::ProjectFunction(SHOrder, shFunc, m_SampleCount); // 1x9
-            for (int j = 0; j < shCoeff->size(); j++)
+                rgbFout << std::endl;
+            }
+        }
+        std::cout << "Computed SH coeffs"
+            << " to: " << transPath.str() << " and " << rgbPath.str() << std::endl;
+    }
+
+    Color3f Li(const Scene* scene, Sampler* sampler, const Ray3f& ray) const
+    {
+        Intersection its;
+        if (!scene->rayIntersect(ray, its))
+            return Color3f(0.0f);
+        return Lo(scene, sampler, its);
+    }
+
+    bool isRasterizable() const
+    {
+        return m_Rasterize;
+    }
+
+    bool shadesFirstHit() const
+    {
+        return true;
+    }
+
+    Color3f Lo(const Scene* /* scene */, Sampler* /* sampler */, const Intersection& its) const
+    {
+        // Only the baked mesh has radiance, the vertex indices of other meshes
+        // (or instances) do not refer to it
+        if (its.mesh != m_Mesh)
+            return Color3f(0.0f);
+        Color3f c0 = vertexRadiance(its.tri_index.x()),
+            c1 = vertexRadiance(its.tri_index.y()),
+            c2 = vertexRadiance(its.tri_index.z());
+
+        const Vector3f& bary = its.bary;
+        Color3f c = bary.x() * c0 + bary.y() * c1 + bary.z() * c2;
+        return c;
+    }
+
+    std::string toString() const
+    {
+        return "PRTIntegrator[]";
+    }
+
+private:
+    typedef SHRotation<SHOrder> LightRotation;
+
+    // Project the (un)shadowed transport of vertex i, writes SHCoeffLength floats to coeffs
+    void projectTransport(const Scene* scene, const Mesh* mesh, int i, float* coeffs) const
+    {
+        const Point3f& v = mesh->getVertexPositions().col(i);  // Vertex Point need to shader
+        const Normal3f& n = mesh->getVertexNormals().col(i);
+        auto shFunc = [&](double phi, double theta) -> double {
+            Eigen::Array3d d = sh::ToVector(phi, theta);
+            const auto wi = Vector3f(d.x(), d.y(), d.z());
+
+            double cosine = wi.normalized().dot(n.normalized());
+            if (m_Type == Type::Unshadowed)
             {
-                m_TransportSHCoeffs.col(i).coeffRef(j) = (*shCoeff)[j];
+                // TODO: here you need to calculate unshadowed transport term of a given direction
+                return cosine > 0 ? cosine / M_PI : 0;
             }
+            else
+            {
+                // TODO: here you need to calculate shadowed transport term of a given direction
+                Ray3f sampleRay(v, wi);
+                if (cosine > 0 && !scene->rayIntersect(sampleRay))
+                    return cosine / M_PI;
+                else
+                    return 0;
+            }
+        };
+        auto shCoeff = sh::ProjectFunction(SHOrder, shFunc, m_SampleCount); // 1x9
+        for (int j = 0; j < shCoeff->size(); j++)
+        {
+            coeffs[j] = (*shCoeff)[j];
         }
+    }
 
+    // Project the direct transport of vertices [start, start + count), SHCoeffLength
+    // floats each. visibility is only used by the shadow map backend
+    void projectBlock(const Scene* scene, const Mesh* mesh, const ShadowMapVisibility& visibility,
+        uint32_t start, uint32_t count, float* coeffs) const
+    {
+        if (m_Type != Type::Unshadowed && m_Visibility == Visibility::ShadowMap)
+        {
+            projectTransportShadowMap(scene, mesh, visibility, start, count, coeffs);
+            return;
+        }
+        if (m_Type != Type::Unshadowed && m_RayStream)
+        {
+            projectTransportStream(scene, mesh, start, count, coeffs);
+            return;
+        }
+        for (uint32_t i = 0; i < count; i++)
+            projectTransport(scene, mesh, start + i, coeffs + (size_t) i * SHCoeffLength);
+    }
+
+    // Visibility ray of the streamed bake, the origin is the vertex. The direction
+    // is kept in double precision as sh::ToVector returned it, since sh::EvalSH
+    // rejects vectors that are not unit length to within a few double ulps
+    struct StreamRay
+    {
+        Eigen::Vector3d direction;
+        uint32_t vertex;  // Relative to the first vertex of the block
+    };
 
-        if (m_Type == Type::Interreflection)
+    // Bin of a ray: the octant of its direction above the Morton code of its origin cell
+    static uint32_t streamBin(const Point3f& origin, const Vector3f& d, const BoundingBox3f& bbox)
+    {
+        uint32_t code = 0;
+        for (int axis = 0; axis < 3; axis++)
         {
-            std::cout << "Using InterReflection material\n";
-            for (int bounceCount = 1; bounceCount <= m_Bounce; bounceCount++)  // For every bounce
-            {            
-                // A buffer for secondary illumnation coeffs, Not using unique_ptr 'cause it 
-                // will be add to m_TransportSHCoeffs soon.
-                Eigen::MatrixXf extraCoeffsBuffer(SHCoeffLength, mesh->getVertexCount());
+            float extent = bbox.max[axis] - bbox.min[axis];
+            float x = extent > 0 ? (origin[axis] - bbox.min[axis]) / extent : 0.0f;
+            uint32_t cell = (uint32_t) clamp((int) (x * (1 << StreamMortonBits)), 0, (1 << StreamMortonBits) - 1);
+            for (int bit = 0; bit < StreamMortonBits; bit++)
+                code |= ((cell >> bit) & 1) << (3 * bit + axis);
+        }
+        uint32_t octant = (d.x() < 0 ? 1 : 0) | (d.y() < 0 ? 2 : 0) | (d.z() < 0 ? 4 : 0);
+        return (octant << (3 * StreamMortonBits)) | code;
+    }
 
-                int vertexCount = mesh->getVertexCount();
-                for (int i = 0; i < mesh->getVertexCount(); i++)// For every vertices
+    // Append the rays of vertices [start + begin, start + end) and their bins. Every
+    // vertex uses the stratified directions of sh::ProjectFunction, seeded by its
+    // index so that the bake is reproducible. Directions below the surface carry
+    // no transport and are not traced
+    void generateStreamRays(const Scene* scene, const Mesh* mesh, uint32_t start, uint32_t begin, uint32_t end,
+        std::vector<StreamRay>& rays, std::vector<uint32_t>& bins) const
+    {
+        const int sample_side = static_cast<int>(floor(sqrt(m_SampleCount)));
+        const MatrixXf& V = mesh->getVertexPositions();
+        const MatrixXf& N = mesh->getVertexNormals();
+        const BoundingBox3f& bbox = scene->getBoundingBox();
+        for (uint32_t i = begin; i < end; i++)
+        {
+            const Point3f v = V.col(start + i);
+            const Vector3f n = Vector3f(N.col(start + i)).normalized();
+            std::mt19937 gen(start + i);
+            std::uniform_real_distribution<> rng(0.0, 1.0);
+            for (int t = 0; t < sample_side; t++)
+            {
+                for (int p = 0; p < sample_side; p++)
                 {
-                    std::cout << "computing interreflection light sh coeffs, current vertex idx: "
-                        << i << " total vertex idx: "<< mesh->getVertexCount() << std::endl;
+                    double alpha = (t + rng(gen)) / sample_side;
+                    double beta = (p + rng(gen)) / sample_side;
+                    Eigen::Vector3d d = sh::ToVector(2.0 * M_PI * beta, acos(2.0 * alpha - 1.0));
+                    const Vector3f wi(d.x(), d.y(), d.z());
+                    if (wi.dot(n) <= 0)
+                        continue;
+                    rays.push_back(StreamRay{ d, i });
+                    bins.push_back(streamBin(v, wi, bbox));
+                }
+            }
+        }
+    }
 
+    // Counting sort of the rays by bin into order, rays of the same bin stay in vertex order
+    static void sortStreamRays(const std::vector<uint32_t>& bins, std::vector<uint32_t>& binStart,
+        std::vector<uint32_t>& order)
+    {
+        binStart.assign(StreamBinCount + 1, 0);
+        for (uint32_t bin : bins)
+            binStart[bin + 1]++;
+        for (uint32_t bin = 0; bin < StreamBinCount; bin++)
+            binStart[bin + 1] += binStart[bin];
+        order.resize(bins.size());
+        for (uint32_t k = 0; k < (uint32_t) bins.size(); k++)
+            order[binStart[bins[k]]++] = k;
+    }
 
-                    // Prepare infos of shading point 
-                    const Point3f& v = mesh->getVertexPositions().col(i);  // Vertex Point need to shader
-                    const Normal3f& n = mesh->getVertexNormals().col(i);
+    // Shadowed transport of vertices [start, start + count) traced as ray streams.
+    // The rays of up to m_RayStreamBatchSize samples (fewer if they would not fit
+    // into m_BakeMemoryBudget) are generated up front, sorted
+    // into bins by direction octant and origin Morton code, so that consecutive rays
+    // take similar paths through the accel, traced bin by bin and scattered back to
+    // their vertices.
+    void projectTransportStream(const Scene* scene, const Mesh* mesh, uint32_t start, uint32_t count,
+        float* coeffs) const
+    {
+        const int sample_side = static_cast<int>(floor(sqrt(m_SampleCount)));
+        const double weight = 4.0 * M_PI / (sample_side * sample_side);
+        // A ray takes its StreamRay, bin, sort index and visibility flag
+        size_t batchRays = m_RayStreamBatchSize;
+        if (m_BakeMemoryBudget > 0)
+            batchRays = std::min(batchRays,
+                m_BakeMemoryBudget / (sizeof(StreamRay) + 2 * sizeof(uint32_t) + sizeof(uint8_t)));
+        const uint32_t batchVertices = (uint32_t) std::max<size_t>(1, batchRays / (sample_side * sample_side));
+        const MatrixXf& V = mesh->getVertexPositions();
+        const MatrixXf& N = mesh->getVertexNormals();
+        std::fill(coeffs, coeffs + (size_t) count * SHCoeffLength, 0.0f);
 
-                    // This is the approach demonstrated in [1] and is useful for arbitrary
-                    // functions on the sphere that are represented analytically.
-                    const int sample_side = static_cast<int>(floor(sqrt(m_SampleCount)));
+        std::vector<StreamRay> rays;
+        std::vector<uint32_t> bins, binStart, order;
+        std::vector<uint8_t> visible;
+        double generateTime = 0, binTime = 0, traceTime = 0;
+        size_t rayCount = 0;
+        Timer timer;
+        for (uint32_t batch = 0; batch < count; batch += batchVertices)
+        {
+            const uint32_t batchEnd = std::min(count, batch + batchVertices);
+            rays.clear();
+            bins.clear();
+            generateStreamRays(scene, mesh, start, batch, batchEnd, rays, bins);
+            generateTime += timer.lap();
 
-                    // A vector to store the extraCoeffs term of one singel shading point.
-                    std::unique_ptr<std::vector<double>> ExtraCoeffs(new std::vector<double>());
-                    ExtraCoeffs->assign(SHCoeffLength, 0.0);
+            sortStreamRays(bins, binStart, order);
+            binTime += timer.lap();
 
-                    // Begin Monte Carlo integration sampling
-                    for (int t = 0; t < sample_side; t++)
+            visible.assign(rays.size(), 0);
+            tbb::parallel_for(tbb::blocked_range<size_t>(0, order.size(), 4096),
+                [&](const tbb::blocked_range<size_t>& range)
+                {
+                    for (size_t j = range.begin(); j < range.end(); j++)
                     {
-                        for (int p = 0; p < sample_side; p++)
-                        {
-                            // generate sample_side^2 uniformly and stratified samples over the sphere
-                            // QUEASTION: should this part been put outside the loop?
-                            std::random_device rd;
-                            std::mt19937 gen(rd());
-                            std::uniform_real_distribution<> rng(0.0, 1.0);
-
-                            // Randomly sample rng, then sum it in p/sample_side to get a distribution 
-                            // that have mathematical expectation t and p
-                            double alpha = (t + rng(gen)) / sample_side;
-                            double beta = (p + rng(gen)) / sample_side;
-                            // See http://www.bogotobogo.com/Algorithms/uniform_distribution_sphere.php
-                            double phi = 2.0 * M_PI * beta;
-                            double theta = acos(2.0 * alpha - 1.0);
-
-                            // Using random phi and theta to make a sampling ray
-                            auto d = sh::ToVector(phi, theta);
-                            const auto wi = Vector3f(d.x(), d.y(), d.z());
-                            auto cosine = wi.normalized().dot(n.normalized());
-                            Ray3f sampleRay(v, wi);
-                            Intersection its;
-
-                            // If hit a triangle
-                            if (cosine > 0 && scene->rayIntersect(sampleRay, its))
-                            {
-                                //std::cout << " Hit ";
-                                Point3f idx = its.tri_index;
-                                //Point3f hitPos = its.p;
-                                Vector3f bary = its.bary;
-
-                                // Using barycentric interpolation to get extraCoeffs
-                                for (int j = 0; j < SHCoeffLength; j++)
-                                {
-                                    auto interpolateSH = (m_TransportSHCoeffs.col(idx.x()).coeffRef(j) * bary.x() +
-                                        m_TransportSHCoeffs.col(idx.y()).coeffRef(j) * bary.y() +
-                                        m_TransportSHCoeffs.col(idx.z()).coeffRef(j) * bary.z());
-
-                                    (*ExtraCoeffs)[j] += interpolateSH * cosine * rho / Pi;  // Not divide by PI
-                                }  // End of ExtraCoeffs calculation
-                            }  // End of hiting situation
-                        }
-                    }  // End of Monte Carlo integration
+                        const StreamRay& ray = rays[order[j]];
+                        const Vector3f wi(ray.direction.x(), ray.direction.y(), ray.direction.z());
+                        visible[order[j]] = !scene->rayIntersect(Ray3f(V.col(start + ray.vertex), wi));
+                    }
+                });
+            traceTime += timer.lap();
 
+            // Scattered in generation order, which walks the coefficients sequentially
+            for (size_t k = 0; k < rays.size(); k++)
+            {
+                if (!visible[k])
+                    continue;
+                const StreamRay& ray = rays[k];
+                const Vector3f n = Vector3f(N.col(start + ray.vertex)).normalized();
+                const Vector3f wi(ray.direction.x(), ray.direction.y(), ray.direction.z());
+                const double value = wi.dot(n) / M_PI * weight;
+                float* sh = coeffs + (size_t) ray.vertex * SHCoeffLength;
+                for (int l = 0; l <= SHOrder; l++)
+                    for (int m = -l; m <= l; m++)
+                        sh[sh::GetIndex(l, m)] += (float) (value * sh::EvalSH(l, m, ray.direction));
+            }
+            rayCount += rays.size();
+            generateTime += timer.lap();
+        }
+        std::cout << tfm::format("Ray stream bake (vertices %i-%i): %i rays, generation and scatter %s, "
+            "binning %s, tracing %s (%.2f Mrays/s)", start, start + count - 1, rayCount,
+            timeString(generateTime), timeString(binTime), timeString(traceTime),
+            traceTime > 0 ? rayCount / traceTime * 1e-3 : 0.0) << std::endl;
+    }
+
+    // Stratified sample directions of the shadow map backend and their SH basis,
+    // shared by all vertices
+    void shadowMapDirections(ShadowMapVisibility& visibility) const
+    {
+        const int sample_side = static_cast<int>(floor(sqrt(m_SampleCount)));
+        const double weight = 4.0 * M_PI / (sample_side * sample_side);
+        std::mt19937 gen(0);
+        std::uniform_real_distribution<> rng(0.0, 1.0);
+        for (int t = 0; t < sample_side; t++)
+        {
+            for (int p = 0; p < sample_side; p++)
+            {
+                double alpha = (t + rng(gen)) / sample_side;
+                double beta = (p + rng(gen)) / sample_side;
+                double phi = 2.0 * M_PI * beta;
+                double theta = acos(2.0 * alpha - 1.0);
+                Eigen::Vector3d d = sh::ToVector(phi, theta);
+                visibility.directions.push_back(Vector3f(d.x(), d.y(), d.z()));
+                for (int l = 0; l <= SHOrder; l++)
+                    for (int m = -l; m <= l; m++)
+                        visibility.basis.push_back((float) (sh::EvalSH(l, m, d) * weight / M_PI));
+            }
+        }
+        visibility.words = (uint32_t) (visibility.directions.size() + 63) / 64;
+    }
 
-                    // scale by the probability of a particular sample, which is
-                    // 4pi/sample_side^2. 4pi for the surface area of a unit sphere, and
-                    // 1/sample_side^2 for the number of samples drawn uniformly.
-                    double weight = 4.0 * M_PI / (sample_side * sample_side) ;
-                    for (unsigned int j = 0; j < ExtraCoeffs->size(); j++)
+    // Render one depth map per sample direction and test vertices [start, start + count)
+    // against it. The bits take K/8 bytes per vertex for K directions; the maps are
+    // rendered again for every block that the bake is split into to fit the budget.
+    void renderShadowMapVisibility(const Scene* scene, const Mesh* mesh, uint32_t start, uint32_t count,
+        ShadowMapVisibility& visibility) const
+    {
+        const MatrixXf& V = mesh->getVertexPositions();
+        const MatrixXf& N = mesh->getVertexNormals();
+        visibility.start = start;
+        visibility.bits.assign((size_t) count * visibility.words, 0);
+        ShadowMap shadowMap(m_ShadowMapResolution);
+        for (size_t k = 0; k < visibility.directions.size(); k++)
+        {
+            const Vector3f& wi = visibility.directions[k];
+            shadowMap.render(scene, wi);
+            tbb::parallel_for(tbb::blocked_range<uint32_t>(0, count, 1024),
+                [&](const tbb::blocked_range<uint32_t>& range)
+                {
+                    for (uint32_t i = range.begin(); i < range.end(); i++)
                     {
-                        (*ExtraCoeffs)[j] *= weight;
-                        // Send it into buffer
-                        extraCoeffsBuffer.col(i).coeffRef(j) = (*ExtraCoeffs)[j];
+                        const Vector3f n = Vector3f(N.col(start + i)).normalized();
+                        if (wi.dot(n) > 0 && shadowMap.isVisible(V.col(start + i), n, m_ShadowMapBias))
+                            visibility.bits[(size_t) i * visibility.words + k / 64] |= (uint64_t) 1 << (k % 64);
                     }
-                }  // End of one bounce calculation
-                
-                // Add one bounce coeffs
-                m_TransportSHCoeffs = m_TransportSHCoeffs + extraCoeffsBuffer;
+                });
+        }
+    }
+
+    // Shadowed transport of vertices [start, start + count) from the visibility
+    // of renderShadowMapVisibility()
+    void projectTransportShadowMap(const Scene* scene, const Mesh* mesh, const ShadowMapVisibility& visibility,
+        uint32_t start, uint32_t count, float* coeffs) const
+    {
+        std::fill(coeffs, coeffs + (size_t) count * SHCoeffLength, 0.0f);
+
+        // Ray traced transport for the same directions, only used for the comparison
+        std::vector<float> reference;
+        if (m_CompareVisibility)
+            reference.assign((size_t) count * SHCoeffLength, 0.0f);
+        size_t tests = 0, mismatches = 0;
+
+        const MatrixXf& V = mesh->getVertexPositions();
+        const MatrixXf& N = mesh->getVertexNormals();
+        for (uint32_t i = 0; i < count; i++)
+        {
+            const Point3f v = V.col(start + i);
+            const Vector3f n = Vector3f(N.col(start + i)).normalized();
+            const uint64_t* bits = visibility.bits.data() + (size_t) (start + i - visibility.start) * visibility.words;
+            for (size_t k = 0; k < visibility.directions.size(); k++)
+            {
+                const Vector3f& wi = visibility.directions[k];
+                const float* shBasis = visibility.basis.data() + k * SHCoeffLength;
+                float cosine = wi.dot(n);
+                if (cosine <= 0)
+                    continue;
+                bool visible = (bits[k / 64] >> (k % 64)) & 1;
+                if (visible)
+                {
+                    for (int j = 0; j < SHCoeffLength; j++)
+                        coeffs[(size_t) i * SHCoeffLength + j] += cosine * shBasis[j];
+                }
+                if (m_CompareVisibility)
+                {
+                    bool traced = !scene->rayIntersect(Ray3f(v, wi));
+                    if (traced)
+                    {
+                        for (int j = 0; j < SHCoeffLength; j++)
+                            reference[(size_t) i * SHCoeffLength + j] += cosine * shBasis[j];
+                    }
+                    tests++;
+                    mismatches += traced != visible;
+                }
             }
         }
-        
-        // Save in face format
-        for (int f = 0; f < mesh->getTriangleCount(); f++)
+
+        if (m_CompareVisibility && tests > 0)
         {
-            const MatrixXu& F = mesh->getIndices();
-            uint32_t idx0 = F(0, f), idx1 = F(1, f), idx2 = F(2, f);
-            for (int j = 0; j < SHCoeffLength; j++)
+            double error = 0, norm = 0;
+            for (size_t k = 0; k < reference.size(); k++)
             {
-                fout << m_TransportSHCoeffs.col(idx0).coeff(j) << " ";
+                error += (coeffs[k] - reference[k]) * (coeffs[k] - reference[k]);
+                norm += reference[k] * reference[k];
             }
-            fout << std::endl;
-            for (int j = 0; j < SHCoeffLength; j++)
+            std::cout << tfm::format("Shadow map vs. ray traced visibility (vertices %i-%i): "
+                "%.3f%% of %i visibility tests disagree, relative transport RMSE %.4f",
+                start, start + count - 1, 100.0 * mismatches / tests, tests,
+                norm > 0 ? std::sqrt(error / norm) : 0.0) << std::endl;
+        }
+    }
+
+    // Interreflection samples of vertices [start, start + count) traced as ray
+    // streams, binned like projectTransportStream(). The samples of vertex
+    // start + i end up in block[i], the same entries as gatherSamples()
+    void gatherSamplesStream(const Scene* scene, const Mesh* mesh, uint32_t start, uint32_t count,
+        std::vector<std::vector<GatherEntry>>& block) const
+    {
+        const int sample_side = static_cast<int>(floor(sqrt(m_SampleCount)));
+        const double weight = 4.0 * M_PI / (sample_side * sample_side);
+        const MatrixXf& V = mesh->getVertexPositions();
+        const MatrixXf& N = mesh->getVertexNormals();
+        std::vector<StreamRay> rays;
+        std::vector<uint32_t> bins, binStart, order;
+        generateStreamRays(scene, mesh, start, 0, count, rays, bins);
+        sortStreamRays(bins, binStart, order);
+
+        // The three corners of the triangle that every ray hits, a weight of -1 marks
+        // a miss or a hit on another mesh
+        std::vector<GatherEntry> hits(rays.size() * 3);
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, order.size(), 4096),
+            [&](const tbb::blocked_range<size_t>& range)
             {
-                fout << m_TransportSHCoeffs.col(idx1).coeff(j) << " ";
+                for (size_t j = range.begin(); j < range.end(); j++)
+                {
+                    const StreamRay& ray = rays[order[j]];
+                    const Vector3f n = Vector3f(N.col(start + ray.vertex)).normalized();
+                    const Vector3f wi(ray.direction.x(), ray.direction.y(), ray.direction.z());
+                    GatherEntry* corners = hits.data() + (size_t) order[j] * 3;
+                    Intersection its;
+                    if (!scene->rayIntersect(Ray3f(V.col(start + ray.vertex), wi), its) || its.mesh != mesh)
+                    {
+                        corners[0].weight = -1.0f;
+                        continue;
+                    }
+                    const float w = (float) (wi.dot(n) / Pi * weight);
+                    for (int k = 0; k < 3; k++)
+                        corners[k] = GatherEntry{ (uint32_t) its.tri_index[k], w * its.bary[k] };
+                }
+            });
+
+        // Collected in generation order, so every vertex sees its samples in the order of gatherSamples()
+        for (uint32_t i = 0; i < count; i++)
+            block[i].clear();
+        for (size_t k = 0; k < rays.size(); k++)
+        {
+            const GatherEntry* corners = hits.data() + k * 3;
+            if (corners[0].weight < 0)
+                continue;
+            block[rays[k].vertex].insert(block[rays[k].vertex].end(), corners, corners + 3);
+        }
+        tbb::parallel_for(tbb::blocked_range<uint32_t>(0, count, 64),
+            [&](const tbb::blocked_range<uint32_t>& range)
+            {
+                for (uint32_t i = range.begin(); i < range.end(); i++)
+                    mergeGatherEntries(block[i]);
+            });
+    }
+
+    // Trace the interreflection samples of vertex i. A sample that hits the mesh
+    // adds the corners of the hit triangle, weighted by their barycentric
+    // coordinates, the cosine and the sample weight. Other meshes and instances
+    // have no baked radiance, so a sample that hits them only counts as occluded. Entries of the same corner
+    // are merged. The directions are stratified like in sh::ProjectFunction and
+    // seeded by the vertex index, so that the bake is reproducible.
+    void gatherSamples(const Scene* scene, const Mesh* mesh, uint32_t i, std::vector<GatherEntry>& entries) const
+    {
+        const Point3f v = mesh->getVertexPositions().col(i);
+        const Vector3f n = Vector3f(mesh->getVertexNormals().col(i)).normalized();
+        const int sample_side = static_cast<int>(floor(sqrt(m_SampleCount)));
+        // The probability of a sample is 4pi/sample_side^2: 4pi for the surface area
+        // of a unit sphere, and 1/sample_side^2 for the number of samples
+        const double weight = 4.0 * M_PI / (sample_side * sample_side);
+        std::mt19937 gen(i);
+        std::uniform_real_distribution<> rng(0.0, 1.0);
+
+        entries.clear();
+        for (int t = 0; t < sample_side; t++)
+        {
+            for (int p = 0; p < sample_side; p++)
+            {
+                double alpha = (t + rng(gen)) / sample_side;
+                double beta = (p + rng(gen)) / sample_side;
+                // See http://www.bogotobogo.com/Algorithms/uniform_distribution_sphere.php
+                Eigen::Vector3d d = sh::ToVector(2.0 * M_PI * beta, acos(2.0 * alpha - 1.0));
+                const Vector3f wi(d.x(), d.y(), d.z());
+                float cosine = wi.dot(n);
+                Intersection its;
+                if (cosine <= 0 || !scene->rayIntersect(Ray3f(v, wi), its) || its.mesh != mesh)
+                    continue;
+                const float w = (float) (cosine / Pi * weight);
+                for (int k = 0; k < 3; k++)
+                    entries.push_back(GatherEntry{ (uint32_t) its.tri_index[k], w * its.bary[k] });
             }
-            fout << std::endl;
-            for (int j = 0; j < SHCoeffLength; j++)
+        }
+        mergeGatherEntries(entries);
+    }
+
+    // Sort the entries by vertex and merge the entries of the same vertex
+    static void mergeGatherEntries(std::vector<GatherEntry>& entries)
+    {
+        std::sort(entries.begin(), entries.end(),
+            [](const GatherEntry& a, const GatherEntry& b) { return a.vertex < b.vertex; });
+        size_t merged = 0;
+        for (size_t k = 0; k < entries.size(); k++)
+        {
+            if (merged > 0 && entries[merged - 1].vertex == entries[k].vertex)
+                entries[merged - 1].weight += entries[k].weight;
+            else
+                entries[merged++] = entries[k];
+        }
+        entries.resize(merged);
+    }
+
+    // Albedo comes from the vertex colors of the mesh if it has any and from
+    // its diffuse BSDF otherwise. The colors are read from the mesh, not copied
+    void loadAlbedo(const Mesh* mesh)
+    {
+        const MatrixXf& colors = mesh->getVertexColors();
+        if (colors.size() > 0)
+        {
+            m_VertexAlbedo = &colors;
+            return;
+        }
+        m_VertexAlbedo = nullptr;
+        const BSDF* bsdf = mesh->getBSDF();
+        if (!bsdf->isDiffuse())
+            throw NoriException("PRTIntegrator: only diffuse BSDFs are supported!");
+        // A diffuse BSDF evaluates to albedo / pi for every pair of directions
+        BSDFQueryRecord bRec(Vector3f(0.0f, 0.0f, 1.0f), Vector3f(0.0f, 0.0f, 1.0f), ESolidAngle);
+        m_Albedo = bsdf->eval(bRec) * M_PI;
+    }
+
+    // Albedo of vertex i, the uniform BSDF albedo unless the mesh has vertex colors
+    Color3f albedo(uint32_t i) const
+    {
+        if (m_VertexAlbedo)
+            return Color3f(m_VertexAlbedo->col(i).array());
+        return m_Albedo;
+    }
+
+    // Radiance of vertex i, read from m_VertexRadiance or from the mapped radiance file
+    Color3f vertexRadiance(uint32_t i) const
+    {
+        const float* radiance = m_RadianceData + (size_t) i * 3;
+        return Color3f(radiance[0], radiance[1], radiance[2]);
+    }
+
+    /**
+     * \brief Solve one bounce of the transport with albedo for the vertices
+     * [start, start + count), writes RGBCoeffLength floats per vertex
+     *
+     * Bounce 0 (prior is null) is the direct transport scaled by the albedo of
+     * the vertex. Every further bounce gathers the solution of the previous one
+     * (RGBCoeffLength floats per vertex) through the baked samples, so the light
+     * carries the albedo of every surface it was reflected by, and is then
+     * scaled by the albedo of the receiving vertex.
+     */
+    void solveBlock(const float* prior, uint32_t start, uint32_t count, float* rgb) const
+    {
+        typedef Eigen::Matrix<float, SHCoeffLength, 3> RGBTransport;
+        tbb::parallel_for(tbb::blocked_range<uint32_t>(0, count, 1024),
+            [&](const tbb::blocked_range<uint32_t>& range)
+            {
+                for (uint32_t i = range.begin(); i < range.end(); i++)
+                {
+                    const uint32_t vertex = start + i;
+                    const Eigen::Array3f a = albedo(vertex);
+                    Eigen::Map<RGBTransport> result(rgb + (size_t) i * RGBCoeffLength);
+                    if (!prior)
+                    {
+                        Eigen::Map<const Eigen::Matrix<float, SHCoeffLength, 1>> sh(
+                            m_DirectData + (size_t) vertex * SHCoeffLength);
+                        result = sh * a.matrix().transpose();
+                        continue;
+                    }
+                    RGBTransport sum = RGBTransport::Zero();
+                    for (uint64_t e = m_GatherOffsets[vertex]; e < m_GatherOffsets[vertex + 1]; e++)
+                    {
+                        const GatherEntry& entry = m_GatherEntries[e];
+                        sum += entry.weight * Eigen::Map<const RGBTransport>(
+                            prior + (size_t) entry.vertex * RGBCoeffLength);
+                    }
+                    result = sum * a.matrix().asDiagonal();
+                }
+            });
+    }
+
+    // Evaluate the radiance of vertices [start, start + count), writes 3 floats per vertex
+    void radianceBlock(uint32_t start, uint32_t count, float* radiance) const
+    {
+        typedef Eigen::Matrix<float, SHCoeffLength, 3> RGBTransport;
+        const Eigen::Matrix<float, 3, SHCoeffLength> light = m_LightCoeffs;
+        for (uint32_t i = 0; i < count; i++)
+        {
+            Eigen::Vector3f sum(0.0f, 0.0f, 0.0f);
+            for (const float* component : m_TransportData)
             {
-                fout << m_TransportSHCoeffs.col(idx2).coeff(j) << " ";
+                Eigen::Map<const RGBTransport> sh(component + (size_t) (start + i) * RGBCoeffLength);
+                for (int c = 0; c < 3; c++)
+                    sum[c] += light.row(c).dot(sh.col(c));
             }
-            fout << std::endl;
+            Eigen::Map<Eigen::Vector3f>(radiance + (size_t) i * 3) = sum;
         }
-        std::cout << "Computed SH coeffs"
-            << " to: " << transPath.str() << std::endl;
     }
 
-    Color3f Li(const Scene* scene, Sampler* sampler, const Ray3f& ray) const
+    /**
+     * \brief Re-evaluate the per-vertex radiance from the baked transport
+     *
+     * Solves the bounces of the transport with the current albedo (see
+     * solveBlock()) and applies the lighting. This only reads the albedo-free
+     * transport and the gather samples, so changing the albedo (or rotating
+     * the lighting) never re-traces rays.
+     *
+     * The in-core bake keeps the transport, summed over all bounces, and the
+     * radiance in memory. The out-of-core bake solves every bounce in blocks
+     * that fit into m_BakeMemoryBudget, streams it to transport.rgb.bin (or
+     * transport.rgb.bounce<k>.bin for bounce k), which the next bounce gathers
+     * through a read-only mapping, and streams the radiance to radiance.bin
+     * (3 floats per vertex), which is then mapped as well.
+     */
+    void relight(uint32_t vertexCount, const filesystem::path& cubePath, uint64_t key)
     {
-        Intersection its;
-        if (!scene->rayIntersect(ray, its))
-            return Color3f(0.0f);
+        const int bounces = m_Type == Type::Interreflection ? m_Bounce : 0;
+        m_TransportData.clear();
+        m_TransportFiles.clear();
+        m_RadianceData = nullptr;
+        m_RadianceFile.reset();  // Unmap before the file is rewritten
+        if (m_BakeMemoryBudget == 0)
+        {
+            m_Transport.resize(RGBCoeffLength, vertexCount);
+            solveBlock(nullptr, 0, vertexCount, m_Transport.data());
+            Eigen::MatrixXf prior = m_Transport, next(RGBCoeffLength, vertexCount);
+            for (int bounce = 1; bounce <= bounces; bounce++)
+            {
+                solveBlock(prior.data(), 0, vertexCount, next.data());
+                m_Transport += next;
+                prior.swap(next);
+            }
+            m_TransportData.push_back(m_Transport.data());
+            m_VertexRadiance.resize(3, vertexCount);
+            radianceBlock(0, vertexCount, m_VertexRadiance.data());
+            m_RadianceData = m_VertexRadiance.data();
+            return;
+        }
 
-        const Eigen::Matrix<Vector3f::Scalar, SHCoeffLength, 1> sh0 = m_TransportSHCoeffs.col(its.tri_index.x()),
-            sh1 = m_TransportSHCoeffs.col(its.tri_index.y()),
-            sh2 = m_TransportSHCoeffs.col(its.tri_index.z());
-        const Eigen::Matrix<Vector3f::Scalar, SHCoeffLength, 1> rL = m_LightCoeffs.row(0), gL = m_LightCoeffs.row(1), bL = m_LightCoeffs.row(2);
+        m_Transport.resize(0, 0);
+        m_VertexRadiance.resize(0, 0);
+        const uint32_t blockSize = bakeBlockSize(vertexCount, RGBCoeffLength * sizeof(float));
+        for (int bounce = 0; bounce <= bounces; bounce++)
+        {
+            filesystem::path binPath = bounce == 0 ? cubePath / "transport.rgb.bin" :
+                cubePath / tfm::format("transport.rgb.bounce%i.bin", bounce);
+            const float* prior = bounce == 0 ? nullptr : m_TransportData.back();
+            writeTransportFile(binPath, vertexCount, key, [&](std::ostream& out)
+                {
+                    std::vector<float> block((size_t) blockSize * RGBCoeffLength);
+                    for (uint32_t start = 0; start < vertexCount; start += blockSize)
+                    {
+                        uint32_t count = std::min<uint32_t>(blockSize, vertexCount - start);
+                        solveBlock(prior, start, count, block.data());
+                        out.write((const char*) block.data(), (size_t) count * RGBCoeffLength * sizeof(float));
+                    }
+                });
+            m_TransportFiles.push_back(mapTransportFile(binPath, vertexCount, key,
+                (size_t) vertexCount * RGBCoeffLength * sizeof(float)));
+            if (!m_TransportFiles.back())
+                throw NoriException("Unable to read transport file \"%s\"!", binPath.str());
+            m_TransportData.push_back((const float*) (m_TransportFiles.back()->data() + sizeof(TransportHeader)));
+        }
 
-        Color3f c0 = Color3f(rL.dot(sh0), gL.dot(sh0), bL.dot(sh0)),
-            c1 = Color3f(rL.dot(sh1), gL.dot(sh1), bL.dot(sh1)),
-            c2 = Color3f(rL.dot(sh2), gL.dot(sh2), bL.dot(sh2));
+        filesystem::path binPath = cubePath / "radiance.bin";
+        const uint32_t radianceBlockSize = bakeBlockSize(vertexCount, 3 * sizeof(float));
+        writeTransportFile(binPath, vertexCount, key, [&](std::ostream& out)
+            {
+                std::vector<float> block((size_t) radianceBlockSize * 3);
+                for (uint32_t start = 0; start < vertexCount; start += radianceBlockSize)
+                {
+                    uint32_t count = std::min<uint32_t>(radianceBlockSize, vertexCount - start);
+                    radianceBlock(start, count, block.data());
+                    out.write((const char*) block.data(), (size_t) count * 3 * sizeof(float));
+                }
+            });
+        m_RadianceFile = mapTransportFile(binPath, vertexCount, key, (size_t) vertexCount * 3 * sizeof(float));
+        if (!m_RadianceFile)
+            throw NoriException("Unable to read radiance file \"%s\"!", binPath.str());
+        m_RadianceData = (const float*) (m_RadianceFile->data() + sizeof(TransportHeader));
+    }
 
-        const Vector3f& bary = its.bary;
-        Color3f c = bary.x() * c0 + bary.y() * c1 + bary.z() * c2;
-        return c;
+    // Transport of vertex i with albedo, summed over all bounces, RGBCoeffLength floats
+    void exportTransport(uint32_t i, float* coeffs) const
+    {
+        std::fill(coeffs, coeffs + RGBCoeffLength, 0.0f);
+        for (const float* component : m_TransportData)
+        {
+            const float* sh = component + (size_t) i * RGBCoeffLength;
+            for (int j = 0; j < RGBCoeffLength; j++)
+                coeffs[j] += sh[j];
+        }
     }
 
-    std::string toString() const
+    // Vertices per block of the bake and of the relighting, so that a block of
+    // vertexBytes per vertex fits into m_BakeMemoryBudget (all of them in-core)
+    uint32_t bakeBlockSize(uint32_t vertexCount, size_t vertexBytes) const
     {
-        return "PRTIntegrator[]";
+        if (m_BakeMemoryBudget == 0)
+            return std::max<uint32_t>(vertexCount, 1);
+        return (uint32_t) std::max<size_t>(1, std::min<size_t>(vertexCount, m_BakeMemoryBudget / vertexBytes));
+    }
+
+    // Hash of the baked mesh and of every setting that changes the albedo-free
+    // transport. Shadows and interreflections also depend on the other meshes
+    // and their instances, so those are hashed as well unless it is unshadowed
+    uint64_t transportKey(const Scene* scene, const Mesh* mesh) const
+    {
+        uint32_t settings[] = { TransportVersion, (uint32_t) SHOrder, m_Type == Type::Unshadowed,
+            (uint32_t) m_SampleCount, (uint32_t) m_Visibility, (uint32_t) m_ShadowMapResolution, m_RayStream };
+        uint64_t hash = hashWords(0xcbf29ce484222325ull, settings, sizeof(settings));
+        hash = hashWords(hash, &m_ShadowMapBias, sizeof(m_ShadowMapBias));
+        hash = hashMesh(hash, mesh);
+        if (m_Type == Type::Unshadowed)
+            return hash;
+        uint64_t meshCount = scene->getMeshes().size();
+        hash = hashWords(hash, &meshCount, sizeof(meshCount));
+        for (const Mesh* other : scene->getMeshes())
+        {
+            hash = hashMesh(hash, other);
+            uint64_t instanceCount = other->getInstances().size();
+            hash = hashWords(hash, &instanceCount, sizeof(instanceCount));
+            for (const Instance* instance : other->getInstances())
+                hash = hashWords(hash, instance->getTransform().getMatrix().data(), sizeof(float) * 16);
+        }
+        return hash;
+    }
+
+    // Continue hash with the vertices, normals and triangles of mesh
+    static uint64_t hashMesh(uint64_t hash, const Mesh* mesh)
+    {
+        const MatrixXf& V = mesh->getVertexPositions();
+        const MatrixXf& N = mesh->getVertexNormals();
+        const MatrixXu& F = mesh->getIndices();
+        uint64_t sizes[] = { (uint64_t) V.cols(), (uint64_t) N.cols(), (uint64_t) F.cols() };
+        hash = hashWords(hash, sizes, sizeof(sizes));
+        hash = hashWords(hash, V.data(), sizeof(float) * V.size());
+        hash = hashWords(hash, N.data(), sizeof(float) * N.size());
+        return hashWords(hash, F.data(), sizeof(uint32_t) * F.size());
+    }
+
+    // Write a transport file: the header, followed by whatever payload() writes.
+    // It is written under a temporary name and renamed into place once complete,
+    // so that an interrupted bake never leaves a file that looks valid
+    template <typename Func> static void writeTransportFile(const filesystem::path& path, uint32_t vertexCount,
+        uint64_t key, const Func& payload)
+    {
+        TransportHeader header;
+        memset(&header, 0, sizeof(TransportHeader));
+        memcpy(header.magic, TransportMagic, sizeof(header.magic));
+        header.version = TransportVersion;
+        header.vertexCount = vertexCount;
+        header.key = key;
+
+        std::string tempFile = createTemporaryFile(path.str());
+        std::ofstream out(tempFile, std::ios::binary);
+        out.write((const char*) &header, sizeof(TransportHeader));
+        payload(out);
+        out.close();
+        if (!out || !replaceFile(tempFile, path.str()))
+        {
+            std::remove(tempFile.c_str());
+            throw NoriException("Unable to write transport file \"%s\"!", path.str());
+        }
+    }
+
+    // Map a transport file. Returns null if it is missing or truncated, or if it was
+    // baked for another mesh or other settings. A payloadBytes of 0 accepts any size
+    static std::unique_ptr<MemoryMappedFile> mapTransportFile(const filesystem::path& path, uint32_t vertexCount,
+        uint64_t key, size_t payloadBytes)
+    {
+        std::unique_ptr<MemoryMappedFile> file;
+        try
+        {
+            file.reset(new MemoryMappedFile(path.str()));
+        }
+        catch (const NoriException&)
+        {
+            return nullptr;
+        }
+        TransportHeader header;
+        if (file->size() < sizeof(TransportHeader))
+            return nullptr;
+        memcpy(&header, file->data(), sizeof(TransportHeader));
+        if (memcmp(header.magic, TransportMagic, sizeof(header.magic)) != 0 || header.version != TransportVersion ||
+            header.vertexCount != vertexCount || header.key != key)
+            return nullptr;
+        if (payloadBytes > 0 && file->size() != sizeof(TransportHeader) + payloadBytes)
+            return nullptr;
+        return file;
+    }
+
+    // Bake the albedo-free direct transport to a transport file (SHCoeffLength
+    // floats per vertex), in blocks of vertices that fit into m_BakeMemoryBudget
+    void bakeDirect(const Scene* scene, const Mesh* mesh, const filesystem::path& path, uint64_t key) const
+    {
+        const uint32_t vertexCount = mesh->getVertexCount();
+        const bool shadowMap = m_Type != Type::Unshadowed && m_Visibility == Visibility::ShadowMap;
+        ShadowMapVisibility visibility;
+        if (shadowMap)
+            shadowMapDirections(visibility);
+        // The visibility bits of a block count against the budget as well
+        const size_t vertexBytes = SHCoeffLength * sizeof(float) + visibility.words * sizeof(uint64_t);
+        const uint32_t blockSize = bakeBlockSize(vertexCount, vertexBytes);
+        if (m_BakeMemoryBudget > 0)
+            std::cout << "Out-of-core transport bake: " << blockSize << " vertices per block ("
+                << memString(blockSize * vertexBytes) << ")" << std::endl;
+        writeTransportFile(path, vertexCount, key, [&](std::ostream& out)
+            {
+                Eigen::MatrixXf block(SHCoeffLength, blockSize);
+                for (uint32_t start = 0; start < vertexCount; start += blockSize)
+                {
+                    uint32_t count = std::min<uint32_t>(blockSize, vertexCount - start);
+                    if (shadowMap)
+                        renderShadowMapVisibility(scene, mesh, start, count, visibility);
+                    projectBlock(scene, mesh, visibility, start, count, block.data());
+                    out.write((const char*) block.data(), (size_t) count * SHCoeffLength * sizeof(float));
+                }
+            });
+        std::cout << "Baked transport SH coeffs to: " << path.str() << std::endl;
+    }
+
+    // Bake the interreflection samples of every vertex to a transport file: the
+    // offsets of the entries of every vertex (vertexCount + 1 uint64), followed
+    // by the GatherEntry records of all vertices. The offsets table is written as
+    // zeros first and filled in block by block, so that only the offsets and the
+    // samples of GatherBlockSize vertices are kept in memory
+    void bakeGather(const Scene* scene, const Mesh* mesh, const filesystem::path& path, uint64_t key) const
+    {
+        std::cout << "Using InterReflection material\n";
+        const uint32_t vertexCount = mesh->getVertexCount();
+        const size_t entriesStart = sizeof(TransportHeader) + ((size_t) vertexCount + 1) * sizeof(uint64_t);
+        std::vector<uint64_t> offsets(GatherBlockSize, 0);
+        std::vector<std::vector<GatherEntry>> block(GatherBlockSize);
+        uint64_t total = 0;
+        writeTransportFile(path, vertexCount, key, [&](std::ostream& out)
+            {
+                for (size_t i = 0; i <= vertexCount; i += GatherBlockSize)
+                    out.write((const char*) offsets.data(),
+                        std::min<size_t>(GatherBlockSize, (size_t) vertexCount + 1 - i) * sizeof(uint64_t));
+                for (uint32_t start = 0; start < vertexCount; start += GatherBlockSize)
+                {
+                    std::cout << "computing interreflection samples, vertices " << start
+                        << " of " << vertexCount << std::endl;
+                    uint32_t count = std::min<uint32_t>(GatherBlockSize, vertexCount - start);
+                    if (m_RayStream)
+                    {
+                        gatherSamplesStream(scene, mesh, start, count, block);
+                    }
+                    else
+                    {
+                        tbb::parallel_for(tbb::blocked_range<uint32_t>(0, count, 16),
+                            [&](const tbb::blocked_range<uint32_t>& range)
+                            {
+                                for (uint32_t i = range.begin(); i < range.end(); i++)
+                                    gatherSamples(scene, mesh, start + i, block[i]);
+                            });
+                    }
+                    out.seekp(entriesStart + total * sizeof(GatherEntry));
+                    for (uint32_t i = 0; i < count; i++)
+                    {
+                        out.write((const char*) block[i].data(), block[i].size() * sizeof(GatherEntry));
+                        total += block[i].size();
+                        offsets[i] = total;  // The end of vertex start + i, which is offsets[start + i + 1]
+                    }
+                    out.seekp(sizeof(TransportHeader) + ((size_t) start + 1) * sizeof(uint64_t));
+                    out.write((const char*) offsets.data(), count * sizeof(uint64_t));
+                }
+            });
+        std::cout << "Baked " << total << " interreflection samples to: " << path.str() << std::endl;
+    }
+
+    // Map the direct transport, returns false if there is no valid file
+    bool loadDirect(const filesystem::path& path, uint32_t vertexCount, uint64_t key)
+    {
+        std::unique_ptr<MemoryMappedFile> file = mapTransportFile(path, vertexCount, key,
+            (size_t) vertexCount * SHCoeffLength * sizeof(float));
+        if (!file)
+            return false;
+        m_DirectData = (const float*) (file->data() + sizeof(TransportHeader));
+        m_DirectFile = std::move(file);
+        return true;
+    }
+
+    // Map the interreflection samples, returns false if there is no valid file
+    bool loadGather(const filesystem::path& path, uint32_t vertexCount, uint64_t key)
+    {
+        std::unique_ptr<MemoryMappedFile> file = mapTransportFile(path, vertexCount, key, 0);
+        const size_t offsetBytes = ((size_t) vertexCount + 1) * sizeof(uint64_t);
+        if (!file || file->size() < sizeof(TransportHeader) + offsetBytes)
+            return false;
+        const uint64_t* offsets = (const uint64_t*) (file->data() + sizeof(TransportHeader));
+        if (file->size() != sizeof(TransportHeader) + offsetBytes + offsets[vertexCount] * sizeof(GatherEntry))
+            return false;
+        m_GatherOffsets = offsets;
+        m_GatherEntries = (const GatherEntry*) (file->data() + sizeof(TransportHeader) + offsetBytes);
+        m_GatherFile = std::move(file);
+        return true;
     }
 
-private:
     Type m_Type;
     int m_Bounce = 1;
     int m_SampleCount = 100;
     std::string m_CubemapPath;
-    Eigen::MatrixXf m_TransportSHCoeffs;
+    std::unique_ptr<MemoryMappedFile> m_DirectFile;  // Mapped albedo-free direct transport
+    std::unique_ptr<MemoryMappedFile> m_GatherFile;  // Mapped interreflection samples
+    const float* m_DirectData = nullptr;  // SHCoeffLength floats per vertex
+    const uint64_t* m_GatherOffsets = nullptr;  // The samples of vertex i are entries [offsets[i], offsets[i + 1])
+    const GatherEntry* m_GatherEntries = nullptr;
+    Eigen::MatrixXf m_Transport;  // shape 27xN, transport with albedo summed over the bounces, in-core only
+    std::vector<std::unique_ptr<MemoryMappedFile>> m_TransportFiles;  // Mapped bounces of the out-of-core solve
+    std::vector<const float*> m_TransportData;  // Transport with albedo of every vertex, summed over all entries
+    Color3f m_Albedo;  // Uniform albedo of the diffuse BSDF
+    const Mesh* m_Mesh = nullptr;  // The baked mesh
+    const Eigen::MatrixXf* m_VertexAlbedo = nullptr;  // shape 3xN, the vertex colors of the mesh if it has any
+    Eigen::MatrixXf m_VertexRadiance;  // shape 3xN, transport * lighting, in-core only
+    std::unique_ptr<MemoryMappedFile> m_RadianceFile;  // Mapped radiance of the out-of-core bake
+    const float* m_RadianceData = nullptr;  // 3 floats per vertex, in-core or mapped
+    size_t m_BakeMemoryBudget = 0;
+    Visibility m_Visibility = Visibility::RayTrace;
+    int m_ShadowMapResolution = 1024;
+    float m_ShadowMapBias = 1.5f;
+    bool m_CompareVisibility = false;
+    bool m_Rasterize = false;
+    bool m_RayStream = false;
+    uint32_t m_RayStreamBatchSize = 1 << 20;  // Rays per batch of the streamed bake
     Eigen::MatrixXf m_LightCoeffs;
+    LightRotation m_EnvRotation;
+    int m_EnvRotationFrames = 0;
 };
 
 NORI_REGISTER_CLASS(PRTIntegrator, "prt");
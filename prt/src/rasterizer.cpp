@@ -0,0 +1,286 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/rasterizer.h>
+#include <nori/scene.h>
+#include <nori/camera.h>
+#include <nori/instance.h>
+#include <nori/simd.h>
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
+
+NORI_NAMESPACE_BEGIN
+
+/// Number of triangles per parallel setup task
+static const uint32_t SETUP_CHUNK_SIZE = 16384;
+
+void Rasterizer::render(const Scene *scene) {
+    const Camera *camera = scene->getCamera();
+    Eigen::Matrix4f worldToRaster;
+    if (!camera || !camera->getWorldToRaster(worldToRaster))
+        throw NoriException("Rasterizer: the camera does not provide a projective transformation!");
+
+    m_size = camera->getOutputSize();
+    m_tileCount = Vector2i((m_size.x() + TileSize - 1) / TileSize,
+                           (m_size.y() + TileSize - 1) / TileSize);
+    m_meshes.clear();
+    m_instances.clear();
+    for (const Mesh *mesh : scene->getMeshes()) {
+        if (mesh->getInstances().empty()) {
+            m_meshes.push_back(mesh);
+            m_instances.push_back(nullptr);
+        }
+        for (const Instance *instance : mesh->getInstances()) {
+            m_meshes.push_back(mesh);
+            m_instances.push_back(instance);
+        }
+    }
+    m_triangles.clear();
+
+    for (uint32_t meshIdx = 0; meshIdx < (uint32_t) m_meshes.size(); ++meshIdx) {
+        const MatrixXf &V = m_meshes[meshIdx]->getVertexPositions();
+        const MatrixXu &F = m_meshes[meshIdx]->getIndices();
+        Eigen::Matrix4f meshToRaster = worldToRaster;
+        if (m_instances[meshIdx])
+            meshToRaster = worldToRaster * m_instances[meshIdx]->getTransform().getMatrix();
+
+        /* Project all vertices into homogeneous raster space */
+        MatrixXf clip(4, V.cols());
+        tbb::parallel_for(tbb::blocked_range<int>(0, (int) V.cols(), 4096),
+            [&](const tbb::blocked_range<int> &range) {
+                for (int i = range.begin(); i < range.end(); ++i) {
+                    Eigen::Vector4f p = meshToRaster * Eigen::Vector4f(V(0, i), V(1, i), V(2, i), 1.0f);
+                    for (int k = 0; k < 4; ++k)
+                        clip(k, i) = p[k];
+                }
+            }
+        );
+
+        /* Clip and set up the triangles in parallel. Every chunk writes its
+           own list so that the final order (and hence the winner of depth
+           ties) does not depend on the scheduling */
+        uint32_t triangleCount = (uint32_t) F.cols();
+        uint32_t chunkCount = (triangleCount + SETUP_CHUNK_SIZE - 1) / SETUP_CHUNK_SIZE;
+        std::vector<std::vector<Triangle>> chunks(chunkCount);
+        tbb::parallel_for(tbb::blocked_range<uint32_t>(0, chunkCount, 1),
+            [&](const tbb::blocked_range<uint32_t> &range) {
+                const Vector2f bary[3] = { Vector2f(0.f, 0.f), Vector2f(1.f, 0.f), Vector2f(0.f, 1.f) };
+                for (uint32_t chunk = range.begin(); chunk < range.end(); ++chunk) {
+                    uint32_t end = std::min(triangleCount, (chunk + 1) * SETUP_CHUNK_SIZE);
+                    for (uint32_t f = chunk * SETUP_CHUNK_SIZE; f < end; ++f) {
+                        const Vector4f vertices[3] = {
+                            clip.col(F(0, f)), clip.col(F(1, f)), clip.col(F(2, f))
+                        };
+                        setup(vertices, bary, meshIdx, f, chunks[chunk]);
+                    }
+                }
+            }
+        );
+        for (const std::vector<Triangle> &chunk : chunks)
+            m_triangles.insert(m_triangles.end(), chunk.begin(), chunk.end());
+    }
+
+    /* Bin the triangles into the screen tiles they overlap */
+    m_bins.assign((size_t) m_tileCount.x() * m_tileCount.y(), std::vector<uint32_t>());
+    for (uint32_t id = 0; id < (uint32_t) m_triangles.size(); ++id) {
+        const Triangle &t = m_triangles[id];
+        for (int ty = t.yMin / TileSize; ty <= t.yMax / TileSize; ++ty)
+            for (int tx = t.xMin / TileSize; tx <= t.xMax / TileSize; ++tx)
+                m_bins[(size_t) ty * m_tileCount.x() + tx].push_back(id);
+    }
+
+    size_t pixelCount = (size_t) m_size.x() * m_size.y();
+    m_depth.assign(pixelCount, 0.f);
+    m_ids.assign(pixelCount, (uint32_t) VisibilitySample::Invalid);
+    m_samples.resize(pixelCount);
+
+    /* Tiles cover disjoint pixels, so they can be processed independently */
+    tbb::parallel_for(tbb::blocked_range<int>(0, (int) m_bins.size(), 1),
+        [&](const tbb::blocked_range<int> &range) {
+            for (int tile = range.begin(); tile < range.end(); ++tile) {
+                rasterizeTile(tile);
+                resolveTile(tile);
+            }
+        }
+    );
+}
+
+void Rasterizer::setup(const Vector4f *clip, const Vector2f *bary,
+        uint32_t mesh, uint32_t index, std::vector<Triangle> &out) const {
+    /* Sutherland-Hodgman clipping against the near plane (z >= 0). The
+       barycentric coordinates of the new vertices are interpolated along */
+    Vector4f poly[4];
+    Vector2f polyBary[4];
+    int n = 0;
+    for (int i = 0; i < 3; ++i) {
+        int j = (i + 1) % 3;
+        float di = clip[i].z(), dj = clip[j].z();
+        if (di >= 0.f) {
+            poly[n] = clip[i];
+            polyBary[n++] = bary[i];
+        }
+        if ((di >= 0.f) != (dj >= 0.f)) {
+            float t = di / (di - dj);
+            poly[n] = clip[i] + t * (clip[j] - clip[i]);
+            polyBary[n++] = bary[i] + t * (bary[j] - bary[i]);
+        }
+    }
+
+    /* Triangulate the clipped polygon as a fan */
+    for (int k = 1; k + 1 < n; ++k) {
+        const int corner[3] = { 0, k, k + 1 };
+        Triangle t;
+        float x[3], y[3];
+        for (int i = 0; i < 3; ++i) {
+            const Vector4f &p = poly[corner[i]];
+            t.q[i] = 1.f / p.w();
+            x[i] = p.x() * t.q[i];
+            y[i] = p.y() * t.q[i];
+            t.u[i] = polyBary[corner[i]].x();
+            t.v[i] = polyBary[corner[i]].y();
+        }
+
+        /* Pixels whose centers lie within the bounding box of the triangle */
+        float xMin = std::ceil(std::max(std::min({x[0], x[1], x[2]}) - 0.5f, 0.f)),
+              xMax = std::floor(std::min(std::max({x[0], x[1], x[2]}) - 0.5f, m_size.x() - 1.f)),
+              yMin = std::ceil(std::max(std::min({y[0], y[1], y[2]}) - 0.5f, 0.f)),
+              yMax = std::floor(std::min(std::max({y[0], y[1], y[2]}) - 0.5f, m_size.y() - 1.f));
+        if (!(xMin <= xMax && yMin <= yMax))
+            continue;
+
+        /* Edge functions relative to the first vertex, normalized by the
+           signed area so that both orientations yield barycentric weights */
+        float ex[3] = { 0.f, x[1] - x[0], x[2] - x[0] },
+              ey[3] = { 0.f, y[1] - y[0], y[2] - y[0] };
+        float area = ex[1] * ey[2] - ey[1] * ex[2];
+        if (!(area != 0.f && std::isfinite(area)))
+            continue;
+        float invArea = 1.f / area;
+        for (int i = 0; i < 3; ++i) {
+            int a = (i + 1) % 3, b = (i + 2) % 3;
+            t.a[i] = (ey[a] - ey[b]) * invArea;
+            t.b[i] = (ex[b] - ex[a]) * invArea;
+            t.c[i] = (ex[a] * ey[b] - ey[a] * ex[b]) * invArea;
+        }
+        t.ox = x[0];
+        t.oy = y[0];
+        t.mesh = mesh;
+        t.index = index;
+        t.xMin = (int) xMin; t.xMax = (int) xMax;
+        t.yMin = (int) yMin; t.yMax = (int) yMax;
+        out.push_back(t);
+    }
+}
+
+void Rasterizer::rasterizeTile(int tile) {
+    int x0 = (tile % m_tileCount.x()) * TileSize, y0 = (tile / m_tileCount.x()) * TileSize;
+    int x1 = std::min(x0 + (int) TileSize, m_size.x()) - 1,
+        y1 = std::min(y0 + (int) TileSize, m_size.y()) - 1;
+
+    /* Pixel offsets of the lanes within a span */
+    alignas(32) float offsets[NORI_SIMD_WIDTH];
+    for (int i = 0; i < SimdFloat::Size; ++i)
+        offsets[i] = (float) i;
+    const SimdFloat lane = SimdFloat::load(offsets), zero(0.f);
+
+    for (uint32_t id : m_bins[tile]) {
+        const Triangle &t = m_triangles[id];
+        int xs = std::max(t.xMin, x0), xe = std::min(t.xMax, x1),
+            ys = std::max(t.yMin, y0), ye = std::min(t.yMax, y1);
+        const SimdFloat a0(t.a[0]), a1(t.a[1]), a2(t.a[2]),
+                        q0(t.q[0]), q1(t.q[1]), q2(t.q[2]);
+
+        for (int y = ys; y <= ye; ++y) {
+            float py = y + 0.5f - t.oy;
+            SimdFloat r0(t.b[0] * py + t.c[0]),
+                      r1(t.b[1] * py + t.c[1]),
+                      r2(t.b[2] * py + t.c[2]);
+            float *depth = m_depth.data() + (size_t) y * m_size.x();
+            uint32_t *ids = m_ids.data() + (size_t) y * m_size.x();
+
+            /* Evaluate the edge functions and depths of SimdFloat::Size pixels
+               at once, only the covered lanes go through the depth test */
+            for (int x = xs; x <= xe; x += SimdFloat::Size) {
+                SimdFloat px = SimdFloat(x + 0.5f - t.ox) + lane;
+                SimdFloat l0 = r0 + a0 * px,
+                          l1 = r1 + a1 * px,
+                          l2 = r2 + a2 * px;
+                int covered = ((l0 >= zero) & (l1 >= zero) & (l2 >= zero)).bits() &
+                              ((1 << std::min(SimdFloat::Size, xe - x + 1)) - 1);
+                if (!covered)
+                    continue;
+
+                alignas(32) float q[NORI_SIMD_WIDTH];
+                (l0 * q0 + l1 * q1 + l2 * q2).store(q);
+                do {
+                    int i = lowestLane(covered);
+                    covered &= covered - 1;
+                    if (q[i] > depth[x + i]) {
+                        depth[x + i] = q[i];
+                        ids[x + i] = id;
+                    }
+                } while (covered);
+            }
+        }
+    }
+}
+
+void Rasterizer::resolveTile(int tile) {
+    int x0 = (tile % m_tileCount.x()) * TileSize, y0 = (tile / m_tileCount.x()) * TileSize;
+    int x1 = std::min(x0 + (int) TileSize, m_size.x()) - 1,
+        y1 = std::min(y0 + (int) TileSize, m_size.y()) - 1;
+
+    for (int y = y0; y <= y1; ++y) {
+        for (int x = x0; x <= x1; ++x) {
+            size_t pixel = (size_t) y * m_size.x() + x;
+            VisibilitySample &sample = m_samples[pixel];
+            uint32_t id = m_ids[pixel];
+            if (id == VisibilitySample::Invalid) {
+                sample = VisibilitySample();
+                continue;
+            }
+
+            /* Perspective-correct interpolation of the mesh barycentrics */
+            const Triangle &t = m_triangles[id];
+            float px = x + 0.5f - t.ox, py = y + 0.5f - t.oy;
+            float w[3];
+            for (int i = 0; i < 3; ++i)
+                w[i] = (t.a[i] * px + t.b[i] * py + t.c[i]) * t.q[i];
+            float invQ = 1.f / (w[0] + w[1] + w[2]);
+
+            sample.mesh = t.mesh;
+            sample.triangle = t.index;
+            sample.u = (w[0] * t.u[0] + w[1] * t.u[1] + w[2] * t.u[2]) * invQ;
+            sample.v = (w[0] * t.v[0] + w[1] * t.v[1] + w[2] * t.v[2]) * invQ;
+        }
+    }
+}
+
+bool Rasterizer::getIntersection(int x, int y, Intersection &its) const {
+    const VisibilitySample &sample = get(x, y);
+    if (!sample.isValid())
+        return false;
+    its.uv = Point2f(sample.u, sample.v);
+    m_meshes[sample.mesh]->setHitInformation(sample.triangle, its);
+    if (m_instances[sample.mesh])
+        m_instances[sample.mesh]->transformHit(its);
+    its.t = 1.f / m_depth[(size_t) y * m_size.x() + x];
+    return true;
+}
+
+NORI_NAMESPACE_END
@@ -25,8 +25,31 @@
 
 NORI_NAMESPACE_BEGIN
 
-Scene::Scene(const PropertyList &) {
-    m_accel = new Accel();
+Scene::Scene(const PropertyList &props) {
+    std::string accel = props.getString("accel", "bvh");
+    bool precompute = props.getBoolean("precomputeTriangles", true);
+    if (accel == "bvh")
+        m_accel = new Accel(Accel::EBVH, precompute);
+    else if (accel == "octree")
+        m_accel = new Accel(Accel::EOctree, precompute);
+    else if (accel == "lbvh")
+        m_accel = new Accel(Accel::ELinearBVH, precompute);
+    else
+        throw NoriException("Scene: unknown acceleration structure \"%s\"!", accel);
+    m_accel->setTreeletRestructuring(props.getBoolean("treelets", true));
+    m_accel->setSpatialSplitBudget(props.getFloat("spatialSplitBudget", 0.f));
+    m_accel->setCacheDirectory(props.getString("accelCache", ""));
+    m_accel->setNodeQuantization(props.getInteger("nodeQuantization", 0));
+    std::string layout = props.getString("nodeLayout", "dfs");
+    if (layout == "dfs")
+        m_accel->setNodeLayout(Accel::EDepthFirst);
+    else if (layout == "veb")
+        m_accel->setNodeLayout(Accel::EVanEmdeBoas);
+    else if (layout == "treelet")
+        m_accel->setNodeLayout(Accel::ETreeletClusters);
+    else
+        throw NoriException("Scene: unknown node layout \"%s\"!", layout);
+    m_accelStatistics = props.getString("accelStatistics", "");
 }
 
 Scene::~Scene() {
@@ -0,0 +1,97 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/shadowmap.h>
+#include <nori/scene.h>
+#include <nori/instance.h>
+
+NORI_NAMESPACE_BEGIN
+
+ShadowMap::ShadowMap(int resolution) : m_resolution(resolution),
+    m_depth((size_t) resolution * resolution) {
+    if (resolution <= 0)
+        throw NoriException("ShadowMap: the resolution must be positive!");
+}
+
+void ShadowMap::render(const Scene *scene, const Vector3f &d) {
+    const BoundingBox3f &bbox = scene->getBoundingBox();
+    m_frame = Frame(d.normalized());
+    m_center = bbox.getCenter();
+    /* Slightly enlarge the sphere so that silhouettes never touch the border */
+    m_radius = std::max(0.5f * bbox.getExtents().norm(), Epsilon) * 1.01f;
+    m_scale = m_resolution / (2.f * m_radius);
+    m_texelSize = 1.f / m_scale;
+
+    std::fill(m_depth.begin(), m_depth.end(), -std::numeric_limits<float>::infinity());
+
+    auto drawMesh = [&](const Mesh *mesh, const Transform &toWorld) {
+        const MatrixXf &V = mesh->getVertexPositions();
+        const MatrixXu &F = mesh->getIndices();
+
+        /* Transform the vertices into raster space once */
+        MatrixXf raster(3, V.cols());
+        for (int i = 0; i < V.cols(); ++i) {
+            Vector3f local = m_frame.toLocal(toWorld * Point3f(V.col(i)) - m_center);
+            raster(0, i) = (local.x() + m_radius) * m_scale;
+            raster(1, i) = (local.y() + m_radius) * m_scale;
+            raster(2, i) = local.z();
+        }
+
+        for (int f = 0; f < F.cols(); ++f)
+            rasterize(raster.col(F(0, f)), raster.col(F(1, f)), raster.col(F(2, f)));
+    };
+
+    for (const Mesh *mesh : scene->getMeshes()) {
+        if (mesh->getInstances().empty())
+            drawMesh(mesh, Transform());
+        for (const Instance *instance : mesh->getInstances())
+            drawMesh(mesh, instance->getTransform());
+    }
+}
+
+void ShadowMap::rasterize(const Point3f &p0, const Point3f &p1, const Point3f &p2) {
+    /* Signed area, both orientations are rasterized */
+    float area = (p1.x() - p0.x()) * (p2.y() - p0.y()) - (p1.y() - p0.y()) * (p2.x() - p0.x());
+    if (area == 0.f)
+        return;
+    float invArea = 1.f / area;
+
+    /* Texels whose centers lie within the bounding box of the triangle */
+    int xMin = std::max((int) std::ceil(std::min({p0.x(), p1.x(), p2.x()}) - 0.5f), 0),
+        xMax = std::min((int) std::floor(std::max({p0.x(), p1.x(), p2.x()}) - 0.5f), m_resolution - 1),
+        yMin = std::max((int) std::ceil(std::min({p0.y(), p1.y(), p2.y()}) - 0.5f), 0),
+        yMax = std::min((int) std::floor(std::max({p0.y(), p1.y(), p2.y()}) - 0.5f), m_resolution - 1);
+
+    for (int y = yMin; y <= yMax; ++y) {
+        float py = y + 0.5f;
+        float *row = m_depth.data() + (size_t) y * m_resolution;
+        for (int x = xMin; x <= xMax; ++x) {
+            float px = x + 0.5f;
+            /* Barycentric coordinates from the edge functions */
+            float b1 = ((px - p0.x()) * (p2.y() - p0.y()) - (py - p0.y()) * (p2.x() - p0.x())) * invArea,
+                  b2 = ((p1.x() - p0.x()) * (py - p0.y()) - (p1.y() - p0.y()) * (px - p0.x())) * invArea,
+                  b0 = 1.f - b1 - b2;
+            if (b0 < 0.f || b1 < 0.f || b2 < 0.f)
+                continue;
+            float z = b0 * p0.z() + b1 * p1.z() + b2 * p2.z();
+            row[x] = std::max(row[x], z);
+        }
+    }
+}
+
+NORI_NAMESPACE_END